@@ -1,19 +1,22 @@
 #!/usr/bin/env python3
 
-import cv2
 import sys
 import time
 import signal
 import numpy as np
 
-from PySide6.QtCore import Qt, Signal, Slot, QTimer, QThread
-from PySide6.QtWidgets import QApplication, QFrame, QWidget, QHBoxLayout, QVBoxLayout, QSplitter, QLabel, QLineEdit, QGroupBox, QPushButton
-from PySide6.QtGui import QImage, QPixmap
+from PySide6.QtCore import Qt, Signal, Slot, QTimer, QThread, QRect, QPoint
+from PySide6.QtWidgets import QApplication, QFrame, QWidget, QHBoxLayout, QVBoxLayout, QSplitter, QLabel, QLineEdit, QGroupBox, QPushButton, QComboBox, QSpinBox, QDoubleSpinBox, QFileDialog
+from PySide6.QtGui import QImage, QPainter
 
-from dalsa_teensy import DalsaTeensy
+import dalsa_native
+from dalsa_teensy import DalsaTeensy, DalsaReadoutAborted
+from auto_exposure import AutoExposure
+from sequencer import Sequencer
 
 dalsa_teensy = None
 raw_frame = np.zeros((DalsaTeensy.FRAME_WIDTH, DalsaTeensy.FRAME_HEIGHT), dtype=np.uint16)
+display_window = None # (low, high) from the on-device histogram, None to normalize over the frame
 
 class Setting(QHBoxLayout):
   value_changed = Signal(str)
@@ -32,6 +35,8 @@ class Setting(QHBoxLayout):
     self.addWidget(self.value)
 
 class FaxitronGroupBox(QGroupBox):
+  state_changed = Signal(str)
+
   def exposure_changed(self, value):
     try:
       val = float(value)
@@ -53,8 +58,11 @@ class FaxitronGroupBox(QGroupBox):
   def tick(self):
     if self.exposure_start_time is not None:
       self.fire_button.setText(f"Exposing... ({int(time.monotonic() - self.exposure_start_time)}s / {int(self.exposure_time + 2)}s)")
-    else:
-      self.state_label.setText(f"State: {dalsa_teensy.get_faxitron_state()}")
+
+  def event_received(self, event):
+    # Event thread, the firmware watches the state and pushes changes
+    if event['type'] == DalsaTeensy.EVENT_FAXITRON_STATE:
+      self.state_changed.emit(str(DalsaTeensy.faxitron_state_name(event['arg0'])))
 
   class FireThread(QThread):
     done = Signal()
@@ -66,6 +74,74 @@ class FaxitronGroupBox(QGroupBox):
       dalsa_teensy.perform_faxitron_exposure()
       self.done.emit()
 
+  class AutoExposureThread(QThread):
+    done = Signal(float, int)
+    failed = Signal(str)
+    progress = Signal(str)
+
+    def __init__(self, parent=None):
+      super().__init__(parent)
+
+    def run(self):
+      try:
+        exposure, voltage = AutoExposure(dalsa_teensy).run(progress=self.progress.emit)
+      except Exception as e:
+        print(e)
+        self.failed.emit(str(e))
+        return
+      self.done.emit(exposure, voltage)
+
+  def auto_expose(self):
+    def auto_exposure_done(exposure, voltage):
+      self.exposure_control.value.setText(str(exposure))
+      self.voltage_control.value.setText(str(voltage))
+      self.auto_exposure_button.setEnabled(True)
+      self.auto_exposure_button.setText("Auto exposure")
+
+    def auto_exposure_failed(message):
+      self.auto_exposure_button.setEnabled(True)
+      self.auto_exposure_button.setText("Auto exposure")
+
+    self.auto_exposure_thread = self.AutoExposureThread()
+    self.auto_exposure_thread.done.connect(auto_exposure_done)
+    self.auto_exposure_thread.failed.connect(auto_exposure_failed)
+    self.auto_exposure_thread.progress.connect(self.auto_exposure_button.setText)
+    self.auto_exposure_button.setEnabled(False)
+    self.auto_exposure_thread.start()
+
+  class PlanThread(QThread):
+    done = Signal()
+    progress = Signal(str)
+
+    def __init__(self, sequencer, parent=None):
+      super().__init__(parent)
+      self.sequencer = sequencer
+
+    def run(self):
+      try:
+        self.sequencer.run(progress=self.progress.emit)
+      except Exception as e:
+        print(e)
+      self.done.emit()
+
+  def run_plan(self):
+    path, _ = QFileDialog.getOpenFileName(self, "Run plan", "", "Plans (*.json *.yaml *.yml)")
+    if len(path) == 0:
+      return
+    sequencer = Sequencer(dalsa_teensy, Sequencer.load(path))
+
+    def plan_done():
+      self.exposure_control.value.setText(str(sequencer.exposure))
+      self.voltage_control.value.setText(str(sequencer.kv))
+      self.plan_button.setEnabled(True)
+      self.plan_button.setText("Run plan...")
+
+    self.plan_thread = self.PlanThread(sequencer)
+    self.plan_thread.done.connect(plan_done)
+    self.plan_thread.progress.connect(self.plan_button.setText)
+    self.plan_button.setEnabled(False)
+    self.plan_thread.start()
+
   def fire(self):
     self.exposure_time = dalsa_teensy.get_faxitron_exposure_time()
 
@@ -90,21 +166,31 @@ class FaxitronGroupBox(QGroupBox):
 
     layout = QVBoxLayout()
 
-    self.state_label = QLabel("State: N/A")
+    self.state_label = QLabel(f"State: {dalsa_teensy.get_faxitron_state()}")
     layout.addWidget(self.state_label)
+    self.state_changed.connect(lambda state: self.state_label.setText(f"State: {state}"))
+    dalsa_teensy.add_event_callback(self.event_received)
 
-    exposure_control = Setting("Exposure (s)", str(dalsa_teensy.get_faxitron_exposure_time()))
-    exposure_control.value_changed.connect(self.exposure_changed)
-    layout.addLayout(exposure_control)
+    self.exposure_control = Setting("Exposure (s)", str(dalsa_teensy.get_faxitron_exposure_time()))
+    self.exposure_control.value_changed.connect(self.exposure_changed)
+    layout.addLayout(self.exposure_control)
 
-    voltage_control = Setting("Voltage (kV)", str(dalsa_teensy.get_faxitron_voltage()))
-    voltage_control.value_changed.connect(self.voltage_changed)
-    layout.addLayout(voltage_control)
+    self.voltage_control = Setting("Voltage (kV)", str(dalsa_teensy.get_faxitron_voltage()))
+    self.voltage_control.value_changed.connect(self.voltage_changed)
+    layout.addLayout(self.voltage_control)
 
     self.fire_button = QPushButton("Fire!")
     self.fire_button.clicked.connect(self.fire)
     layout.addWidget(self.fire_button)
 
+    self.auto_exposure_button = QPushButton("Auto exposure")
+    self.auto_exposure_button.clicked.connect(self.auto_expose)
+    layout.addWidget(self.auto_exposure_button)
+
+    self.plan_button = QPushButton("Run plan...")
+    self.plan_button.clicked.connect(self.run_plan)
+    layout.addWidget(self.plan_button)
+
     self.setLayout(layout)
 
     # start periodic update timer
@@ -113,58 +199,334 @@ class FaxitronGroupBox(QGroupBox):
     self.timer.start(250)
 
 
+class FrameView(QWidget):
+  # Keeps the raw frame and one QImage of the same size around. A new frame or new levels only run the
+  # frame through the display LUT into the image, window/level/gamma changes only rebuild the 64K LUT.
+  def __init__(self, parent=None):
+    super().__init__(parent)
+    self.frame = None
+    self.image = None
+    self.pixels = None # numpy view of the image's scanlines
+    self.rows = 0 # Rows of the frame that are there so far, the rest stays black
+    self.levels = None
+    self.lut = None
+
+  def set_frame(self, frame, rows=None):
+    self.frame = frame
+    self.rows = frame.shape[0] if rows is None else rows
+    if self.image is None or (self.image.height(), self.image.width()) != frame.shape:
+      self.image = QImage(frame.shape[1], frame.shape[0], QImage.Format_Grayscale8)
+      self.pixels = np.frombuffer(self.image.bits(), dtype=np.uint8).reshape(frame.shape[0], self.image.bytesPerLine())[:, :frame.shape[1]]
+    self.pixels[self.rows:] = 0
+    self.redraw()
+
+  def add_rows(self, row_start, row_count):
+    # Rows that arrived in self.frame during a readout, only their part of the widget gets repainted
+    self.rows = max(self.rows, row_start + row_count)
+    if self.lut is None:
+      return
+    dalsa_native.apply_lut(self.frame[row_start:row_start + row_count], self.lut, out=self.pixels[row_start:row_start + row_count])
+    scale = self.image.size().scaled(self.size(), Qt.KeepAspectRatio).height() / self.image.height()
+    self.update(0, int(row_start * scale), self.width(), int(row_count * scale) + 2)
+
+  def set_levels(self, window, gamma=1.0):
+    levels = (int(window[0]), int(window[1]), float(gamma))
+    if levels == self.levels:
+      return
+    self.levels = levels
+    # Inverted, so X-ray shadows come out dark
+    self.lut = dalsa_native.window_lut(window, gamma, invert=True)
+    self.redraw()
+
+  def redraw(self):
+    if self.frame is None or self.lut is None:
+      return
+    dalsa_native.apply_lut(self.frame[:self.rows], self.lut, out=self.pixels[:self.rows])
+    self.update()
+
+  def paintEvent(self, event):
+    if self.image is None:
+      return
+    painter = QPainter(self)
+    painter.drawImage(QRect(QPoint(0, 0), self.image.size().scaled(self.size(), Qt.KeepAspectRatio)), self.image)
+
+class DisplayGroupBox(QGroupBox):
+  levels_changed = Signal()
+
+  def __init__(self, parent=None):
+    super().__init__("Display", parent)
+
+    layout = QVBoxLayout()
+
+    self.low_box = QSpinBox()
+    self.high_box = QSpinBox()
+    self.gamma_box = QDoubleSpinBox()
+    for title, box in (("Black", self.low_box), ("White", self.high_box), ("Gamma", self.gamma_box)):
+      row = QHBoxLayout()
+      row.addWidget(QLabel(title))
+      row.addWidget(box)
+      layout.addLayout(row)
+    for box in (self.low_box, self.high_box):
+      box.setRange(0, 0xFFFF)
+      box.setSingleStep(100)
+    self.high_box.setValue(0xFFFF)
+    self.gamma_box.setRange(0.1, 5.0)
+    self.gamma_box.setSingleStep(0.1)
+    self.gamma_box.setValue(1.0)
+
+    # Follow the histogram window of every new frame until the levels are edited by hand
+    self.auto_button = QPushButton("Auto")
+    self.auto_button.setCheckable(True)
+    self.auto_button.setChecked(True)
+    self.auto_button.toggled.connect(lambda _: self.levels_changed.emit())
+    layout.addWidget(self.auto_button)
+
+    for box in (self.low_box, self.high_box):
+      box.valueChanged.connect(lambda _: self.auto_button.setChecked(False))
+    for box in (self.low_box, self.high_box, self.gamma_box):
+      box.valueChanged.connect(lambda _: self.levels_changed.emit())
+
+    self.setLayout(layout)
+
+  def window(self):
+    return (self.low_box.value(), self.high_box.value())
+
+  def set_window(self, window):
+    for box, value in zip((self.low_box, self.high_box), window):
+      box.blockSignals(True)
+      box.setValue(value)
+      box.blockSignals(False)
+
 class DalsaGroupBox(QGroupBox):
   new_frame = Signal()
+  new_rows = Signal(int, int)
 
   class ReadoutThread(QThread):
     done = Signal()
     progress = Signal(int)
+    rows = Signal(int, int) # row_start, row_count now in raw_frame
 
     def __init__(self, parent=None):
       super().__init__(parent)
 
     def run(self):
       global raw_frame
+      global display_window
+
+      self.header = None
+      self.stats = None
+      hist = np.zeros(0x10000, dtype=np.int64)
+      try:
+        for row_start, frame in dalsa_teensy.read_out_rows(True):
+          # Binned profiles send smaller frames, the header has the geometry
+          h = frame.header
+          if self.header is None:
+            raw_frame = np.zeros((h.rows, h.cols), dtype=np.uint16)
+          self.header = h
+          raw_frame[row_start:row_start + h.region_rows] = frame.pixels
+
+          # Active columns only, like the histogram on the device. The window firms up as the rows come in.
+          col_start = DalsaTeensy.ACTIVE_COL_START // h.binning
+          hist += np.bincount(frame.pixels[:, col_start:col_start + DalsaTeensy.ACTIVE_COLS // h.binning].ravel(), minlength=0x10000)
+          cumulative = np.cumsum(hist)
+          display_window = tuple(int(np.searchsorted(cumulative, f * cumulative[-1])) for f in (0.001, 0.999))
+
+          self.progress.emit(int((row_start + h.region_rows) / h.rows * 100))
+          self.rows.emit(row_start, h.region_rows)
+
+        self.stats = dalsa_teensy.get_stats(self.header.slot, rows=False)
+        display_window = (DalsaTeensy.histogram_percentile(self.stats, 0.001), DalsaTeensy.histogram_percentile(self.stats, 0.999))
+      except DalsaReadoutAborted:
+        # The slot is freed already, the rows that came in stay on screen
+        self.header = None
+      finally:
+        self.done.emit()
+
+  class StackThread(QThread):
+    done = Signal()
+    progress = Signal(str)
+    stacked = Signal()
 
-      dalsa_teensy.start_readout(True)
-      state = dalsa_teensy.get_state()
-      while not state['done']:
-        state = dalsa_teensy.get_state()
-        self.progress.emit(int(state['row'] / 1032 * 100))
-        time.sleep(0.1)
-      frame = dalsa_teensy.get_frame()
-      assert len(frame) == 2150688, "Frame is not of the expected size"
-      raw_frame = np.frombuffer(frame, dtype=np.uint16).reshape((DalsaTeensy.FRAME_WIDTH, DalsaTeensy.FRAME_HEIGHT))
+    def __init__(self, frames, rejection, parent=None):
+      super().__init__(parent)
+      self.frames = frames
+      self.rejection = rejection
+
+    def wait_ready(self):
+      # In short steps so an abort gets through even if its ERROR event doesn't, None when it never came
+      deadline = time.monotonic() + DalsaTeensy.READOUT_TIMEOUT
+      while not self.isInterruptionRequested() and time.monotonic() < deadline:
+        event = dalsa_teensy.wait_for_event((DalsaTeensy.EVENT_FRAME_READY, DalsaTeensy.EVENT_ERROR), 0.2)
+        if event is not None:
+          return event
+      return None
 
+    def run(self):
+      # Fires and reads out frames one after the other, the stack so far replaces raw_frame after each
+      global raw_frame
+      global display_window
+
+      self.stack = None
+      self.header = None
+      for i in range(self.frames):
+        if self.isInterruptionRequested():
+          break
+        self.progress.emit(f"Stacking... exposing {i + 1}/{self.frames}")
+        dalsa_teensy.perform_faxitron_exposure()
+        self.progress.emit(f"Stacking... reading out {i + 1}/{self.frames}")
+        dalsa_teensy.clear_events()
+        dalsa_teensy.start_readout(True)
+        event = self.wait_ready()
+        if event is None or event['type'] != DalsaTeensy.EVENT_FRAME_READY:
+          break
+        frame = dalsa_teensy.fetch(event['arg0'])
+        self.header = frame.header
+        if self.stack is None:
+          self.stack = dalsa_native.Stack(frame.pixels.shape, self.rejection)
+        self.stack.add(frame.pixels)
+
+        stacked = self.stack.get()
+        col_start = DalsaTeensy.ACTIVE_COL_START // self.header.binning
+        hist = np.bincount(stacked[:, col_start:col_start + DalsaTeensy.ACTIVE_COLS // self.header.binning].ravel(), minlength=0x10000)
+        cumulative = np.cumsum(hist)
+        display_window = tuple(int(np.searchsorted(cumulative, f * cumulative[-1])) for f in (0.001, 0.999))
+        raw_frame = stacked
+        self.stacked.emit()
       self.done.emit()
 
+  def stack(self):
+    def stack_done():
+      self.readout_button.setEnabled(True)
+      self.stack_button.setEnabled(True)
+      self.stack_button.setText("Fire and stack")
+      self.abort_button.setEnabled(False)
+      header = self.stack_thread.header
+      if self.stack_thread.stack is None:
+        self.frame_label.setText("Stack: aborted")
+        return
+      self.frame_label.setText(f"Stack of {self.stack_thread.stack.frames} ({dalsa_native.STACK_REJECTIONS[self.stack_thread.rejection]}): {header.faxitron_kv} kV, {header.faxitron_exposure_ds / 10}s")
+
+    self.readout_button.setEnabled(False)
+    self.stack_button.setEnabled(False)
+    self.abort_button.setEnabled(True)
+    self.stack_thread = self.StackThread(self.stack_frames_box.value(), self.rejection_box.currentIndex())
+    self.stack_thread.done.connect(stack_done)
+    self.stack_thread.progress.connect(self.stack_button.setText)
+    self.stack_thread.stacked.connect(self.new_frame)
+    self.stack_thread.start()
+
   def readout(self):
     def readout_done():
       self.readout_button.setEnabled(True)
       self.readout_button.setText("Read out")
+      self.abort_button.setEnabled(False)
+      header = self.readout_thread.header
+      if header is None:
+        self.frame_label.setText("Frame: aborted")
+        return
+      if self.readout_thread.stats is None:
+        self.frame_label.setText("Frame: readout failed")
+        return
+      hist = self.readout_thread.stats['histogram']
+      saturated = hist[-1] / max(sum(hist), 1) * 100
+      self.frame_label.setText(f"Frame #{header.sequence}: {header.faxitron_kv} kV, {header.faxitron_exposure_ds / 10}s, {'high' if header.high_gain else 'low'} gain, {saturated:.2f}% saturated")
+      self.update_profile_label()
       self.new_frame.emit()
 
     self.readout_button.setEnabled(False)
+    self.abort_button.setEnabled(True)
     self.readout_thread = self.ReadoutThread()
     self.readout_thread.done.connect(readout_done)
     self.readout_thread.progress.connect(lambda p: self.readout_button.setText(f"Reading out... ({p}%)"))
+    self.readout_thread.rows.connect(self.new_rows)
     self.readout_thread.start()
 
+  def abort(self):
+    if self.stack_thread is not None:
+      self.stack_thread.requestInterruption()
+    try:
+      dalsa_teensy.abort_readout()
+    except Exception as e:
+      print(e)
+
   def __init__(self, parent=None):
     super().__init__("Dalsa", parent)
 
+    self.stack_thread = None
     layout = QVBoxLayout()
 
     self.readout_button = QPushButton("Read out")
     self.readout_button.clicked.connect(self.readout)
     layout.addWidget(self.readout_button)
 
+    # The first rows show up within a second, no need to wait out a misplaced sample
+    self.abort_button = QPushButton("Abort")
+    self.abort_button.setEnabled(False)
+    self.abort_button.clicked.connect(self.abort)
+    layout.addWidget(self.abort_button)
+
+    # X-ray hits land somewhere else in every frame, rejecting per pixel outliers keeps them out of the stack
+    stack_row = QHBoxLayout()
+    stack_row.addWidget(QLabel("Stack"))
+    self.stack_frames_box = QSpinBox()
+    self.stack_frames_box.setRange(2, 100)
+    self.stack_frames_box.setValue(8)
+    stack_row.addWidget(self.stack_frames_box)
+    self.rejection_box = QComboBox()
+    self.rejection_box.addItems(dalsa_native.STACK_REJECTIONS)
+    self.rejection_box.setCurrentIndex(dalsa_native.STACK_SIGMA)
+    stack_row.addWidget(self.rejection_box)
+    layout.addLayout(stack_row)
+
+    self.stack_button = QPushButton("Fire and stack")
+    self.stack_button.clicked.connect(self.stack)
+    layout.addWidget(self.stack_button)
+
+    self.frame_label = QLabel("Frame: N/A")
+    layout.addWidget(self.frame_label)
+
+    self.profile_box = QComboBox()
+    self.profile_box.addItems(DalsaTeensy.PROFILE_NAMES)
+    self.profile_box.setCurrentIndex(dalsa_teensy.get_readout_profiles()[0])
+    self.profile_box.currentIndexChanged.connect(self.profile_changed)
+    layout.addWidget(self.profile_box)
+
+    self.profile_label = QLabel("")
+    layout.addWidget(self.profile_label)
+    self.update_profile_label()
+
     self.setLayout(layout)
 
+  def profile_changed(self, index):
+    try:
+      dalsa_teensy.set_readout_profile(index)
+    except Exception as e:
+      print(e)
+    self.update_profile_label()
+
+  def update_profile_label(self):
+    current, profiles = dalsa_teensy.get_readout_profiles()
+    p = profiles[current]
+    measured = f"{p['frame_time']:.2f}s per frame, {p['noise']:.2f} LSB noise" if p['frames'] > 0 else "not measured yet"
+    self.profile_label.setText(f"{p['adc_resolution']}-bit, {p['binning']}x{p['binning']} binned: {measured}")
+
 class App(QWidget):
   def new_frame(self):
-    normalized_img = cv2.normalize(-1 * raw_frame, None, 0, 2**16, cv2.NORM_MINMAX, dtype=cv2.CV_16U)
-    self.image_label.setPixmap(QPixmap.fromImage(QImage(bytes(normalized_img), DalsaTeensy.FRAME_HEIGHT, DalsaTeensy.FRAME_WIDTH, QImage.Format_Grayscale16)))
+    self.frame_view.set_frame(raw_frame)
+    self.levels_changed()
+
+  def new_rows(self, row_start, row_count):
+    # A readout in progress: the first block brings a new frame, the auto window follows along
+    if row_start == 0 or self.frame_view.frame is not raw_frame:
+      self.frame_view.set_frame(raw_frame, rows=0)
+    self.levels_changed()
+    self.frame_view.add_rows(row_start, row_count)
+
+  def levels_changed(self):
+    if self.display_group_box.auto_button.isChecked():
+      low, high = display_window if display_window is not None else (int(raw_frame.min()), int(raw_frame.max()))
+      self.display_group_box.set_window((low, high))
+    self.frame_view.set_levels(self.display_group_box.window(), self.display_group_box.gamma_box.value())
 
   def __init__(self, parent=None):
     super().__init__(parent)
@@ -175,9 +537,8 @@ class App(QWidget):
     left_column = QVBoxLayout()
 
     # add left column stuff
-    self.image_label = QLabel()
-    self.new_frame()
-    left_column.addWidget(self.image_label)
+    self.frame_view = FrameView()
+    left_column.addWidget(self.frame_view)
 
     left_widget = QWidget()
     left_widget.setLayout(left_column)
@@ -190,8 +551,14 @@ class App(QWidget):
 
     self.dalsa_group_box = DalsaGroupBox()
     self.dalsa_group_box.new_frame.connect(self.new_frame)
+    self.dalsa_group_box.new_rows.connect(self.new_rows)
     right_column.addWidget(self.dalsa_group_box)
 
+    self.display_group_box = DisplayGroupBox()
+    self.display_group_box.levels_changed.connect(self.levels_changed)
+    right_column.addWidget(self.display_group_box)
+    self.new_frame()
+
     right_column.addStretch()
 
     # add right column stuff
@@ -0,0 +1,116 @@
+#!/usr/bin/env python3
+
+from dalsa_teensy import DalsaTeensy
+
+class AutoExposure:
+  # Closed-loop exposure: short pre-shots are read out but never transferred, only the on-device histogram
+  # and row stats come back. Exposure time is scaled to hit the target level, kV only moves once exposure
+  # time runs into the Faxitron limits. Pre-shots use the binned preview profile, which reads out in a
+  # fraction of the time; binning sums the charge of binning^2 pixels, so they are exposed that much
+  # shorter and their level is scaled back down to what a full resolution frame would see.
+  MIN_EXPOSURE_S = 0.1
+  MAX_EXPOSURE_S = 99.9
+  MIN_VOLTAGE_KV = 10
+  MAX_VOLTAGE_KV = 35
+  READOUT_TIMEOUT = 60
+
+  def __init__(self, dalsa_teensy, target_level=0.6, tolerance=0.1, saturation_limit=0.001, max_iterations=4,
+               pre_shot_exposure=0.5, high_gain=True, roi_rows=None, percentile=0.995, preview=True):
+    self.dalsa_teensy = dalsa_teensy
+    self.target_level = target_level           # Fraction of full scale the signal should land on
+    self.tolerance = tolerance                 # Relative, when to stop iterating
+    self.saturation_limit = saturation_limit   # Fraction of pixels allowed in the top histogram bin
+    self.max_iterations = max_iterations
+    self.pre_shot_exposure = pre_shot_exposure
+    self.high_gain = high_gain
+    self.roi_rows = roi_rows                   # (start, end) to meter on the row means instead of the histogram
+    self.percentile = percentile
+    self.preview = preview
+    self.binning = 1
+
+  def _pre_shot(self, exposure, voltage, progress):
+    # Returns the stats and the full resolution exposure the shot stands in for
+    gain = self.binning ** 2
+    shot_exposure = min(self.MAX_EXPOSURE_S, max(self.MIN_EXPOSURE_S, round(exposure / gain, 1)))
+    self.dalsa_teensy.set_faxitron_exposure_time(shot_exposure)
+    self.dalsa_teensy.set_faxitron_voltage(voltage)
+    progress(f"Pre-shot: {shot_exposure:.1f}s at {voltage} kV")
+    self.dalsa_teensy.perform_faxitron_exposure()
+
+    self.dalsa_teensy.clear_events()
+    self.dalsa_teensy.start_readout(self.high_gain)
+    event = self._wait_ready()
+    return self.dalsa_teensy.get_stats(event['arg0'], rows=(self.roi_rows is not None)), shot_exposure * gain
+
+  def _wait_ready(self):
+    while True:
+      event = self.dalsa_teensy.wait_for_event((DalsaTeensy.EVENT_FRAME_READY, DalsaTeensy.EVENT_ERROR), self.READOUT_TIMEOUT)
+      if event is None:
+        raise Exception("Pre-shot frame never became ready")
+      if event['type'] == DalsaTeensy.EVENT_FRAME_READY:
+        return event
+      if event['arg0'] == DalsaTeensy.ERROR_READOUT_ABORTED:
+        raise Exception("Pre-shot readout was aborted")
+
+  def _measure(self, stats):
+    hist = stats['histogram']
+    full_scale = len(hist) << stats['hist_shift']
+    total = max(sum(hist), 1)
+    saturated = hist[-1] / total
+
+    if self.roi_rows is not None:
+      start, end = (r // self.binning for r in self.roi_rows)
+      signal = sum(stats['row_sum'][start:end]) / (stats['cols'] * (end - start))
+    else:
+      signal = DalsaTeensy.histogram_percentile(stats, self.percentile)
+
+    # Dark level from the histogram floor, so the scaling only applies to the X-ray signal
+    dark = DalsaTeensy.histogram_percentile(stats, 0.001)
+    return (signal - dark) / full_scale, dark / full_scale, saturated
+
+  def run(self, progress=print):
+    previous = None
+    if self.preview:
+      previous, _ = self.dalsa_teensy.get_readout_profiles()
+      self.binning = self.dalsa_teensy.set_readout_profile(DalsaTeensy.PROFILE_PREVIEW)['binning']
+    try:
+      return self._run(progress)
+    finally:
+      if previous is not None:
+        self.dalsa_teensy.set_readout_profile(previous)
+      self.binning = 1
+
+  def _run(self, progress):
+    exposure = self.pre_shot_exposure
+    voltage = self.dalsa_teensy.get_faxitron_voltage()
+
+    for i in range(self.max_iterations):
+      stats, shot_exposure = self._pre_shot(exposure, voltage, progress)
+      level, dark, saturated = self._measure(stats)
+      # The shot is rounded to tenths of a second and clamped, so scale to the exposure being tried
+      level *= exposure / shot_exposure
+      progress(f"Iteration {i}: level {level:.3f}, dark {dark:.3f}, {saturated * 100:.2f}% saturated")
+
+      target = self.target_level - dark
+      if saturated > self.saturation_limit:
+        # Clipped, so the level underestimates the signal: back off hard and measure again
+        ratio = 0.25
+      elif level <= 0:
+        ratio = 10
+      else:
+        if abs(level - target) <= self.tolerance * target:
+          break
+        ratio = target / level
+
+      new_exposure = exposure * ratio
+      if new_exposure > self.MAX_EXPOSURE_S and voltage < self.MAX_VOLTAGE_KV:
+        # Signal goes roughly with kV squared
+        voltage = min(self.MAX_VOLTAGE_KV, int(voltage * (new_exposure / self.MAX_EXPOSURE_S) ** 0.5 + 1))
+      elif new_exposure < self.MIN_EXPOSURE_S and voltage > self.MIN_VOLTAGE_KV:
+        voltage = max(self.MIN_VOLTAGE_KV, int(voltage * (new_exposure / self.MIN_EXPOSURE_S) ** 0.5))
+      exposure = min(self.MAX_EXPOSURE_S, max(self.MIN_EXPOSURE_S, round(new_exposure, 1)))
+
+    self.dalsa_teensy.set_faxitron_exposure_time(exposure)
+    self.dalsa_teensy.set_faxitron_voltage(voltage)
+    progress(f"Auto exposure: {exposure:.1f}s at {voltage} kV")
+    return exposure, voltage
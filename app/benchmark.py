@@ -0,0 +1,92 @@
+#!/usr/bin/env python3
+
+import time
+import argparse
+import numpy as np
+
+from dalsa_teensy import DalsaTeensy
+
+PATTERNS = {
+  'ramp': DalsaTeensy.TEST_PATTERN_RAMP,
+  'checkerboard': DalsaTeensy.TEST_PATTERN_CHECKERBOARD,
+  'prng': DalsaTeensy.TEST_PATTERN_PRNG,
+}
+
+# Transfer modes, each a fetch() region as a function of the frame size
+MODES = {
+  'full': lambda rows, cols: {},
+  'stride2': lambda rows, cols: {'stride': 2},
+  'region': lambda rows, cols: {'row_start': rows // 4, 'row_count': rows // 2, 'col_start': cols // 4, 'col_count': cols // 2},
+  'rows': lambda rows, cols: {'row_start': rows - 64, 'row_count': 64},
+}
+
+def expected_pixels(frame, pattern, seed):
+  h = frame.header
+  full = DalsaTeensy.test_pattern(pattern, seed, h.rows, h.cols)
+  return full[h.row_start:h.row_start + h.region_rows * h.stride:h.stride, h.col_start:h.col_start + h.region_cols * h.stride:h.stride]
+
+def run_mode(dalsa_teensy, mode, pattern, seed, frames):
+  result = {'frames': 0, 'failed': 0, 'bytes': 0, 'pixels': 0, 'bad_pixels': 0, 'transfer_s': 0, 'readout_s': [], 'latency_s': []}
+  expected = None
+  for _ in range(frames):
+    dalsa_teensy.clear_events()
+    start = time.monotonic()
+    dalsa_teensy.start_readout()
+    event = dalsa_teensy.wait_for_event(DalsaTeensy.EVENT_FRAME_READY, 60)
+    if event is None:
+      raise Exception("Test pattern frame never became ready")
+    ready = time.monotonic()
+
+    caps = dalsa_teensy.capabilities
+    try:
+      frame = dalsa_teensy.fetch(event['arg0'], **MODES[mode](caps['rows'], caps['columns']))
+    except Exception as e:
+      print(f"  {mode}: transfer failed: {e}")
+      result['failed'] += 1
+      continue
+    done = time.monotonic()
+
+    if frame.header.readout_mode != DalsaTeensy.READOUT_MODE_TEST_PATTERN:
+      raise Exception("Got a sensor frame, is the test pattern selected?")
+    if expected is None or expected.shape != (frame.header.region_rows, frame.header.region_cols):
+      expected = expected_pixels(frame, pattern, seed)
+    received = frame.pixels
+
+    result['frames'] += 1
+    result['bytes'] += received.nbytes
+    result['pixels'] += received.size
+    result['bad_pixels'] += int(np.count_nonzero(received != expected))
+    result['transfer_s'] += done - ready
+    result['readout_s'].append(ready - start)
+    result['latency_s'].append(done - start)
+  return result
+
+if __name__ == "__main__":
+  parser = argparse.ArgumentParser(description="Benchmarks the USB transfer paths with firmware test patterns")
+  parser.add_argument("--pattern", choices=PATTERNS.keys(), default='prng')
+  parser.add_argument("--seed", type=lambda v: int(v, 0), default=0x12345678)
+  parser.add_argument("--row-rate", type=int, default=0, help="rows per second, 0 is as fast as the firmware goes")
+  parser.add_argument("--frames", type=int, default=10, help="per transfer mode")
+  parser.add_argument("--modes", nargs='+', choices=MODES.keys(), default=list(MODES.keys()))
+  args = parser.parse_args()
+
+  dalsa_teensy = DalsaTeensy()
+  dalsa_teensy.ping()
+  if not dalsa_teensy.get_capabilities()['capabilities'] & DalsaTeensy.CAP_TEST_PATTERN:
+    raise Exception("Firmware has no test pattern support")
+
+  pattern = PATTERNS[args.pattern]
+  dalsa_teensy.set_test_pattern(pattern, args.seed, args.row_rate)
+  try:
+    print(f"{'mode':>8} {'frames':>6} {'failed':>6} {'MB/s':>7} {'readout ms':>10} {'latency ms':>10} {'p95 ms':>7} {'pixel errors':>12}")
+    for mode in args.modes:
+      r = run_mode(dalsa_teensy, mode, pattern, args.seed, args.frames)
+      if r['frames'] == 0:
+        print(f"{mode:>8} {0:>6} {r['failed']:>6}")
+        continue
+      mb_s = r['bytes'] / r['transfer_s'] / 1e6
+      error_rate = r['bad_pixels'] / r['pixels']
+      print(f"{mode:>8} {r['frames']:>6} {r['failed']:>6} {mb_s:>7.1f} {np.mean(r['readout_s']) * 1e3:>10.1f} "
+            f"{np.mean(r['latency_s']) * 1e3:>10.1f} {np.percentile(r['latency_s'], 95) * 1e3:>7.1f} {error_rate:>12.2e}")
+  finally:
+    dalsa_teensy.set_test_pattern(DalsaTeensy.TEST_PATTERN_OFF)
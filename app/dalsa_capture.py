@@ -0,0 +1,195 @@
+#!/usr/bin/env python3
+
+import os
+import mmap
+import select
+import socket
+import struct
+import numpy as np
+from threading import Lock
+
+# Client side of the capture daemon (host/tools/dalsa_captured.cpp), which owns the USB interface so the app,
+# scripts and analysis tools can share the detector. DalsaTeensy(daemon=...) runs on top of it unchanged,
+# FrameRing reads the frames it captured straight out of shared memory.
+SOCKET_PATH = "/tmp/dalsa.sock"
+
+STRUCT_RING_HEADER = struct.Struct("<IIIIIIQ")
+STRUCT_RING_SLOT = struct.Struct("<QIIQ40x")
+RING_MAGIC = 0x474E5244
+RING_VERSION = 1
+
+class DaemonError(Exception):
+  pass
+
+class Connection:
+  # One socket to the daemon: request lines out, reply lines and the payloads behind them in
+  def __init__(self, path):
+    self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    self.sock.connect(path)
+    self._rx = bytearray()
+
+  def close(self):
+    self.sock.close()
+
+  def _fill(self, timeout=None):
+    if timeout is not None and len(select.select([self.sock], [], [], timeout)[0]) == 0:
+      return False
+    dat = self.sock.recv(1 << 16)
+    if len(dat) == 0:
+      raise DaemonError("Daemon closed the connection")
+    self._rx += dat
+    return True
+
+  def read_line(self, timeout=None):
+    # Split into words, None if nothing came in within timeout (seconds)
+    while b"\n" not in self._rx:
+      if not self._fill(timeout):
+        return None
+    end = self._rx.index(b"\n")
+    line = self._rx[:end].decode()
+    del self._rx[:end + 1]
+    return line.split()
+
+  def read_payload(self, length):
+    buf = bytearray(length)
+    n = min(length, len(self._rx))
+    buf[:n] = self._rx[:n]
+    del self._rx[:n]
+    view = memoryview(buf)
+    while n < length:
+      got = self.sock.recv_into(view[n:])
+      if got == 0:
+        raise DaemonError("Daemon closed the connection")
+      n += got
+    return buf
+
+  def request(self, line, data=b""):
+    self.sock.sendall(line.encode() + b"\n" + bytes(data))
+    reply = self.read_line()
+    if reply[0] == "error":
+      raise DaemonError(" ".join(reply[1:]))
+    return reply
+
+class RingFrame:
+  # A frame in place in the ring: header copied out, pixels a read-only view of shared memory. The daemon
+  # overwrites it after `slots` newer frames, so check valid() once done with the pixels, or copy them.
+  def __init__(self, ring, index, header, pixels, captured_us):
+    self.ring = ring
+    self.index = index
+    self.header = header
+    self.pixels = pixels
+    self.captured_us = captured_us
+
+  def valid(self):
+    return self.ring.holds(self.index)
+
+class FrameRing:
+  def __init__(self, name):
+    with open("/dev/shm/" + name.lstrip("/"), "rb") as f:
+      self._map = mmap.mmap(f.fileno(), 0, prot=mmap.PROT_READ)
+    magic, version, self.slots, self.slot_len, self.data_offset, self.pid, _ = STRUCT_RING_HEADER.unpack_from(self._map)
+    assert magic == RING_MAGIC and version == RING_VERSION, "Not a frame ring of this version"
+
+  @classmethod
+  def open(cls, path=SOCKET_PATH):
+    # Asks the daemon where its ring is
+    conn = Connection(path)
+    try:
+      return cls(conn.request("info")[1])
+    finally:
+      conn.close()
+
+  def frames(self):
+    # Published so far, the newest is frames() - 1
+    return STRUCT_RING_HEADER.unpack_from(self._map)[6]
+
+  def _slot_pos(self, index):
+    return self.data_offset + (index % self.slots) * self.slot_len
+
+  def holds(self, index):
+    return struct.unpack_from("<Q", self._map, self._slot_pos(index))[0] == 2 * index + 2
+
+  def view(self, index):
+    # Zero copy RingFrame, None if the frame isn't (or no longer) there
+    from dalsa_teensy import FrameHeader, DalsaTeensy
+    pos = self._slot_pos(index)
+    sequence, length, _, captured_us = STRUCT_RING_SLOT.unpack_from(self._map, pos)
+    if sequence != 2 * index + 2:
+      return None
+    data = memoryview(self._map)[pos + STRUCT_RING_SLOT.size:pos + STRUCT_RING_SLOT.size + length]
+    header = FrameHeader.from_buffer_copy(data[:DalsaTeensy.FRAME_HEADER_LEN])
+    pixels = np.frombuffer(data, dtype=np.uint16, count=header.region_rows * header.region_cols, offset=DalsaTeensy.FRAME_HEADER_LEN)
+    frame = RingFrame(self, index, header, pixels.reshape(header.region_rows, header.region_cols), captured_us)
+    return frame if frame.valid() else None
+
+  def latest(self):
+    n = self.frames()
+    return self.view(n - 1) if n > 0 else None
+
+  def copy(self, index):
+    # Header and pixels in a buffer of their own, like a fetch, None if the frame was overwritten meanwhile
+    pos = self._slot_pos(index)
+    sequence, length, _, _ = STRUCT_RING_SLOT.unpack_from(self._map, pos)
+    if sequence != 2 * index + 2:
+      return None
+    start = pos + STRUCT_RING_SLOT.size
+    buf = bytearray(self._map[start:start + length])
+    return buf if self.holds(index) else None
+
+class DaemonClient:
+  # Stands in for the native client (dalsa_native.Client) inside DalsaTeensy. Commands, streams and events
+  # each get a connection, so a long fetch doesn't hold up the commands of other threads.
+  def __init__(self, path=SOCKET_PATH):
+    self._commands = Connection(path)
+    self._streams = Connection(path)
+    self._command_lock = Lock()
+    self._stream_lock = Lock()
+    self._results = {}
+    self._next_tag = 0
+    self.ring = FrameRing(self._commands.request("info")[1])
+    self._events = Connection(path)
+    self._events.request("subscribe")
+
+  def close(self):
+    for conn in (self._commands, self._streams, self._events):
+      conn.close()
+
+  def submit(self, commands):
+    # The daemon answers each command as it comes, the results wait here until they're collected
+    tags = []
+    with self._command_lock:
+      for cmd, data in commands:
+        _, status, length = self._commands.request(f"command {cmd} {len(data)}", data)
+        tag = self._next_tag
+        self._next_tag = (self._next_tag + 1) & 0xFFFF
+        self._results[tag] = (int(status), bytes(self._commands.read_payload(int(length))))
+        tags.append(tag)
+    return tags
+
+  def collect(self, tag):
+    with self._command_lock:
+      return self._results.pop(tag)
+
+  def bulk_read(self, size, timeout):
+    with self._stream_lock:
+      _, length = self._streams.request(f"bulk {size} {timeout}")
+      return bytes(self._streams.read_payload(int(length)))
+
+  def fetch(self, slot, row_start, row_count, col_start, col_count, stride):
+    with self._stream_lock:
+      reply = self._streams.request(f"fetch {slot} {stride} {row_start} {row_count} {col_start} {col_count}")
+      if reply[0] == "ring":
+        buf = self.ring.copy(int(reply[1]))
+        if buf is None:
+          raise DaemonError("Frame was overwritten in the ring before it could be copied")
+        return buf
+      return self._streams.read_payload(int(reply[1]))
+
+  def wait_event(self, timeout):
+    # Raw event like the device sends it, None after timeout ms. Frame notices are skipped, FrameRing has those.
+    while True:
+      line = self._events.read_line(timeout / 1000)
+      if line is None:
+        return None
+      if line[0] == "event":
+        return struct.pack("<BBHIII", *(int(x) for x in line[1:7]))
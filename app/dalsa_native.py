@@ -0,0 +1,450 @@
+#!/usr/bin/env python3
+
+import os
+import sys
+import ctypes
+import numpy as np
+
+# Native helpers from host/ (libdalsa), build with: cmake -S host -B host/build && cmake --build host/build
+LIB_NAME = "libdalsa.so"
+SEARCH_PATHS = [
+  os.environ.get("DALSA_NATIVE_LIB"),
+  os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "host", "build", LIB_NAME),
+]
+
+_lib = None
+for path in SEARCH_PATHS:
+  if path is not None and os.path.exists(path):
+    _lib = ctypes.CDLL(path)
+    break
+
+# The libusb client module (dalsa_client) sits next to the library when libusb and pybind11 were found.
+# DALSA_NATIVE_CLIENT=0 keeps DalsaTeensy on python-libusb1.
+Client = None
+if _lib is not None and os.environ.get("DALSA_NATIVE_CLIENT", "1") != "0":
+  sys.path.insert(0, os.path.dirname(os.path.abspath(path)))
+  try:
+    from dalsa_client import Client
+  except ImportError:
+    pass
+
+BAD_PIXEL_COLUMN = 0xFFFF
+GAIN_SHIFT = 12
+
+MASTER_MEAN = 0
+MASTER_CLIPPED = 1
+MASTER_MEDIAN = 2
+MASTER_SIGMA = 3
+MASTER_MAX_WARMUP = 15
+DEFECT_HOT = (1 << 0)
+DEFECT_DEAD = (1 << 1)
+DEFECT_NOISY = (1 << 2)
+
+STACK_MEAN = 0
+STACK_MINMAX = 1
+STACK_SIGMA = 2
+STACK_REJECTIONS = ('mean', 'min/max', 'sigma')
+
+class Correction(ctypes.Structure):
+  # Mirrors dalsa_correction_t in host/include/dalsa/correct.h
+  _fields_ = [
+    ('dark', ctypes.c_void_p),
+    ('gain', ctypes.c_void_p),
+    ('pedestal', ctypes.c_uint16),
+    ('bad_pixels', ctypes.c_void_p),
+    ('bad_pixel_count', ctypes.c_uint32),
+    ('window_low', ctypes.c_uint16),
+    ('window_high', ctypes.c_uint16),
+    ('invert', ctypes.c_uint8),
+    ('output_bits', ctypes.c_uint8),
+    ('threads', ctypes.c_uint16),
+  ]
+
+class MasterConfig(ctypes.Structure):
+  # Mirrors dalsa_master_config_t in host/include/dalsa/master.h
+  _fields_ = [
+    ('clip_sigma', ctypes.c_float),
+    ('clip_warmup', ctypes.c_uint16),
+    ('threads', ctypes.c_uint16),
+  ]
+
+class DefectConfig(ctypes.Structure):
+  # Mirrors dalsa_defect_config_t
+  _fields_ = [
+    ('hot_sigma', ctypes.c_float),
+    ('dead_fraction', ctypes.c_float),
+    ('noisy_factor', ctypes.c_float),
+    ('column_fraction', ctypes.c_float),
+  ]
+
+class StackConfig(ctypes.Structure):
+  # Mirrors dalsa_stack_config_t in host/include/dalsa/stack.h
+  _fields_ = [
+    ('rejection', ctypes.c_uint8),
+    ('clip_sigma', ctypes.c_float),
+    ('threads', ctypes.c_uint16),
+  ]
+
+if _lib is not None:
+  _lib.dalsa_crc32.argtypes = [ctypes.c_void_p, ctypes.c_size_t]
+  _lib.dalsa_crc32.restype = ctypes.c_uint32
+  _lib.dalsa_correct_frame.argtypes = [ctypes.c_void_p, ctypes.c_uint32, ctypes.c_uint32, ctypes.POINTER(Correction),
+                                       ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t]
+  _lib.dalsa_correct_frame.restype = None
+  _lib.dalsa_apply_lut.argtypes = [ctypes.c_void_p, ctypes.c_uint32, ctypes.c_uint32, ctypes.c_void_p, ctypes.c_uint8,
+                                   ctypes.c_void_p, ctypes.c_size_t, ctypes.c_uint16]
+  _lib.dalsa_apply_lut.restype = None
+  _lib.dalsa_master_create.argtypes = [ctypes.c_uint32, ctypes.c_uint32, ctypes.POINTER(MasterConfig)]
+  _lib.dalsa_master_create.restype = ctypes.c_void_p
+  _lib.dalsa_master_destroy.argtypes = [ctypes.c_void_p]
+  _lib.dalsa_master_destroy.restype = None
+  _lib.dalsa_master_add.argtypes = [ctypes.c_void_p, ctypes.c_void_p]
+  _lib.dalsa_master_add.restype = None
+  _lib.dalsa_master_frames.argtypes = [ctypes.c_void_p]
+  _lib.dalsa_master_frames.restype = ctypes.c_uint32
+  _lib.dalsa_master_get.argtypes = [ctypes.c_void_p, ctypes.c_uint8, ctypes.c_void_p]
+  _lib.dalsa_master_get.restype = None
+  _lib.dalsa_master_defects.argtypes = [ctypes.c_void_p, ctypes.POINTER(DefectConfig), ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint32]
+  _lib.dalsa_master_defects.restype = ctypes.c_uint32
+  _lib.dalsa_stack_create.argtypes = [ctypes.c_uint32, ctypes.c_uint32, ctypes.POINTER(StackConfig)]
+  _lib.dalsa_stack_create.restype = ctypes.c_void_p
+  _lib.dalsa_stack_destroy.argtypes = [ctypes.c_void_p]
+  _lib.dalsa_stack_destroy.restype = None
+  _lib.dalsa_stack_add.argtypes = [ctypes.c_void_p, ctypes.c_void_p]
+  _lib.dalsa_stack_add.restype = None
+  _lib.dalsa_stack_frames.argtypes = [ctypes.c_void_p]
+  _lib.dalsa_stack_frames.restype = ctypes.c_uint32
+  _lib.dalsa_stack_get.argtypes = [ctypes.c_void_p, ctypes.c_void_p]
+  _lib.dalsa_stack_get.restype = None
+else:
+  print(f"{LIB_NAME} not found, falling back to the (slow) Python CRC")
+
+  _crc_table = []
+  for i in range(256):
+    crc = i << 24
+    for _ in range(8):
+      crc = ((crc << 1) ^ 0x04C11DB7) if (crc & 0x80000000) else (crc << 1)
+    _crc_table.append(crc & 0xFFFFFFFF)
+
+def crc32(buf, offset=0, length=None):
+  # CRC-32/MPEG-2 over buf[offset:offset + length], matching the DCP on the Teensy
+  if length is None:
+    length = len(buf) - offset
+
+  if _lib is None:
+    crc = 0xFFFFFFFF
+    for b in memoryview(buf)[offset:offset + length]:
+      crc = ((crc << 8) & 0xFFFFFFFF) ^ _crc_table[(crc >> 24) ^ b]
+    return crc
+
+  if isinstance(buf, bytes):
+    ptr = ctypes.cast(ctypes.c_char_p(buf), ctypes.c_void_p).value + offset
+    return _lib.dalsa_crc32(ptr, length)
+  c_buf = (ctypes.c_char * length).from_buffer(buf, offset)
+  return _lib.dalsa_crc32(ctypes.addressof(c_buf), length)
+
+def _correct_frame_numpy(frame, low, high, invert, output_bits, out, dark, gain, pedestal, bad_pixels, corrected):
+  v = frame.astype(np.int32)
+  if dark is not None or gain is not None:
+    diff = np.clip(frame.view(np.int16).astype(np.int32) - (dark.view(np.int16) if dark is not None else 0), -32768, 32767)
+    g = gain.view(np.int16).astype(np.int32) if gain is not None else 1 << GAIN_SHIFT
+    v = np.clip((diff * g + (pedestal << GAIN_SHIFT)) >> GAIN_SHIFT, 0, 0xFFFF)
+  if bad_pixels is not None and len(bad_pixels) > 0:
+    cols = frame.shape[1]
+    bad_columns = set(int(c) for r, c in bad_pixels if r == BAD_PIXEL_COLUMN)
+    row_pixels = {}
+    for r, c in bad_pixels:
+      if r != BAD_PIXEL_COLUMN:
+        row_pixels.setdefault(int(r), set()).add(int(c))
+    # Neighbours are never defects themselves, so rows with single defects can just redo their bad columns
+    def neighbours(col, bad):
+      left, right = col - 1, col + 1
+      while left >= 0 and left in bad:
+        left -= 1
+      while right < cols and right in bad:
+        right += 1
+      return left, right
+    def patch(rows, col, bad):
+      left, right = neighbours(col, bad)
+      if left >= 0 and right < cols:
+        v[rows, col] = (v[rows, left] + v[rows, right] + 1) // 2
+      elif left >= 0 or right < cols:
+        v[rows, col] = v[rows, left if left >= 0 else right]
+    for col in sorted(bad_columns):
+      patch(slice(None), col, bad_columns)
+    for row in sorted(row_pixels):
+      bad = bad_columns | row_pixels[row]
+      for col in sorted(bad):
+        patch(row, col, bad)
+  if corrected is not None:
+    corrected[...] = v
+
+  full, shift = (0xFF, 23) if output_bits == 8 else (0xFFFF, 15)
+  mul = (full << shift) // max(high - low, 1)
+  x = ((np.clip(v, low, high) - low).astype(np.uint64) * mul + (1 << (shift - 1))) >> shift
+  out[...] = full - x if invert else x
+
+def correct_frame(frame, window, invert=False, output_bits=16, out=None, dark=None, gain=None, pedestal=0,
+                  bad_pixels=None, corrected=None, threads=0):
+  # Dark, gain (Q3.12 like on the device), bad pixels and window/level to 8 or 16 bits, in one native pass
+  # over the frame. out is reused when given, bad_pixels are (row, col) with BAD_PIXEL_COLUMN rows for whole
+  # columns. corrected, if given, also gets the corrected 16-bit frame. Returns out.
+  frame = np.ascontiguousarray(frame, dtype=np.uint16)
+  rows, cols = frame.shape
+  out_dtype = np.uint8 if output_bits == 8 else np.uint16
+  if out is None:
+    out = np.empty((rows, cols), dtype=out_dtype)
+  assert out.shape == frame.shape and out.dtype == out_dtype and out.strides[1] == out.itemsize, "Unsuitable output buffer"
+  maps = [np.ascontiguousarray(m, dtype=np.uint16) if m is not None else None for m in (dark, gain)]
+  for m in maps:
+    assert m is None or m.size == frame.size, "Map does not match the frame size"
+  if bad_pixels is not None:
+    bad_pixels = np.ascontiguousarray(bad_pixels, dtype=np.uint16).reshape(-1, 2)
+  if corrected is not None:
+    assert corrected.shape == frame.shape and corrected.dtype == np.uint16 and corrected.flags.c_contiguous
+  low, high = sorted((int(window[0]), int(window[1])))
+  low, high = max(low, 0), min(high, 0xFFFF)
+
+  if _lib is None:
+    _correct_frame_numpy(frame, low, high, invert, output_bits, out, maps[0], maps[1], pedestal, bad_pixels, corrected)
+    return out
+
+  config = Correction(
+    dark=maps[0].ctypes.data if maps[0] is not None else None,
+    gain=maps[1].ctypes.data if maps[1] is not None else None,
+    pedestal=pedestal,
+    bad_pixels=bad_pixels.ctypes.data if bad_pixels is not None else None,
+    bad_pixel_count=len(bad_pixels) if bad_pixels is not None else 0,
+    window_low=low,
+    window_high=high,
+    invert=invert,
+    output_bits=output_bits,
+    threads=threads,
+  )
+  _lib.dalsa_correct_frame(frame.ctypes.data, rows, cols, ctypes.byref(config),
+                           corrected.ctypes.data if corrected is not None else None, out.ctypes.data, out.strides[0])
+  return out
+
+def window_lut(window, gamma=1.0, invert=False, output_bits=8):
+  # 65536 entry display table: window[0] maps to black and window[1] to white, with gamma applied in between
+  low, high = sorted((int(window[0]), int(window[1])))
+  full = 0xFF if output_bits == 8 else 0xFFFF
+  x = np.clip((np.arange(0x10000, dtype=np.float32) - low) / max(high - low, 1), 0, 1)
+  if gamma != 1.0:
+    x **= 1 / gamma
+  if invert:
+    x = 1 - x
+  return np.rint(x * full).astype(np.uint8 if output_bits == 8 else np.uint16)
+
+def apply_lut(frame, lut, out=None, threads=0):
+  # out = lut[frame], rows of out can be padded (e.g. a QImage's scanlines). Returns out.
+  frame = np.ascontiguousarray(frame, dtype=np.uint16)
+  rows, cols = frame.shape
+  assert lut.shape == (0x10000,) and lut.dtype in (np.uint8, np.uint16) and lut.flags.c_contiguous, "Unsuitable LUT"
+  if out is None:
+    out = np.empty((rows, cols), dtype=lut.dtype)
+  assert out.shape == frame.shape and out.dtype == lut.dtype and out.strides[1] == out.itemsize, "Unsuitable output buffer"
+
+  if _lib is None:
+    np.take(lut, frame, out=out)
+    return out
+
+  _lib.dalsa_apply_lut(frame.ctypes.data, rows, cols, lut.ctypes.data, lut.itemsize * 8, out.ctypes.data, out.strides[0], threads)
+  return out
+
+class _MasterNumpy:
+  # Same streaming statistics as host/src/master.cpp, in float32
+  MIN_SIGMA = np.float32(0.5)
+  MEDIAN_GAIN = np.float32(1.2533141)
+
+  def __init__(self, shape, clip_sigma, clip_warmup):
+    self.clip_sigma = np.float32(clip_sigma)
+    self.clip_warmup = clip_warmup
+    self.frames = 0
+    self.noise = self.MIN_SIGMA
+    self.mean, self.m2, self.clip_mean, self.clip_m2, self.clip_n, self.median = (np.zeros(shape, np.float32) for _ in range(6))
+    self.warmup = []
+
+  def _sigma(self, m2, n):
+    return np.maximum(np.sqrt(m2 / np.maximum(n - 1, 1)), self.noise)
+
+  def _seed(self, planes=None):
+    v = np.sort(np.stack(self.warmup).astype(np.float32), axis=0)
+    median = np.median(v, axis=0).astype(np.float32)
+    spread = np.float32(1.4826) * np.median(np.abs(v - median), axis=0).astype(np.float32)
+    noise = max(np.float32(np.partition(spread.ravel(), spread.size // 2)[spread.size // 2]), self.MIN_SIGMA)
+    # Welford over the frames in the order they came, like seed_clip(), so the clip decisions after it match
+    limit = self.clip_sigma * np.maximum(spread, noise)
+    n, mean, m2 = (np.zeros(median.shape, np.float32) for _ in range(3))
+    for frame in self.warmup:
+      x = frame.astype(np.float32)
+      keep = (np.abs(x - median) <= limit) | (self.clip_sigma <= 0)
+      n += keep
+      d = x - mean
+      mean += np.where(keep, d / np.maximum(n, 1), 0)
+      m2 += np.where(keep, d * (x - mean), 0)
+    return noise, mean, m2, n, median
+
+  def add(self, frame):
+    self.frames += 1
+    x = frame.astype(np.float32)
+    d = x - self.mean
+    self.mean += d * np.float32(1 / self.frames)
+    self.m2 += d * (x - self.mean)
+    if self.frames <= self.clip_warmup:
+      self.warmup.append(frame.copy())
+      if self.frames == self.clip_warmup:
+        self.noise, self.clip_mean, self.clip_m2, self.clip_n, self.median = self._seed()
+        self.warmup = []
+      return
+
+    dc = x - self.clip_mean
+    keep = (np.abs(dc) <= self.clip_sigma * self._sigma(self.clip_m2, self.clip_n)) | (self.clip_sigma <= 0)
+    self.clip_n += keep
+    self.clip_mean += np.where(keep, dc, 0) / self.clip_n
+    self.clip_m2 += np.where(keep, dc * (x - self.clip_mean), 0)
+    step = self.MEDIAN_GAIN / self.frames * self._sigma(self.clip_m2, self.clip_n)
+    self.median += np.sign(x - self.median) * step
+
+  def get(self, kind):
+    if kind == MASTER_MEAN:
+      return self.mean.copy()
+    if 0 < self.frames < self.clip_warmup:
+      _, clip_mean, clip_m2, clip_n, median = self._seed()
+    else:
+      clip_mean, clip_m2, clip_n, median = self.clip_mean, self.clip_m2, self.clip_n, self.median
+    if kind == MASTER_CLIPPED:
+      return clip_mean.copy()
+    if kind == MASTER_MEDIAN:
+      return median.copy()
+    return np.where(clip_n > 1, np.sqrt(clip_m2 / np.maximum(clip_n - 1, 1)), 0).astype(np.float32)
+
+class MasterBuilder:
+  # Master dark or flat in one streaming pass, see host/include/dalsa/master.h. Memory stays the same however
+  # many frames are added.
+  def __init__(self, shape, clip_sigma=3.0, clip_warmup=5, threads=0):
+    self.shape = tuple(shape)
+    clip_warmup = min(max(clip_warmup, 3), MASTER_MAX_WARMUP)
+    self._handle = None
+    self._numpy = None
+    if _lib is None:
+      self._numpy = _MasterNumpy(self.shape, clip_sigma, clip_warmup)
+    else:
+      config = MasterConfig(clip_sigma=clip_sigma, clip_warmup=clip_warmup, threads=threads)
+      self._handle = _lib.dalsa_master_create(self.shape[0], self.shape[1], ctypes.byref(config))
+
+  def __del__(self):
+    if self._handle is not None:
+      _lib.dalsa_master_destroy(self._handle)
+      self._handle = None
+
+  @property
+  def frames(self):
+    return self._numpy.frames if self._handle is None else _lib.dalsa_master_frames(self._handle)
+
+  def add(self, frame):
+    frame = np.ascontiguousarray(frame, dtype=np.uint16)
+    assert frame.shape == self.shape, "Frame does not match the master size"
+    if self._handle is None:
+      self._numpy.add(frame)
+    else:
+      _lib.dalsa_master_add(self._handle, frame.ctypes.data)
+
+  def get(self, kind=MASTER_CLIPPED):
+    # float32 master, one of MASTER_*
+    if self._handle is None:
+      return self._numpy.get(kind)
+    out = np.empty(self.shape, dtype=np.float32)
+    _lib.dalsa_master_get(self._handle, kind, out.ctypes.data)
+    return out
+
+  def defects(self, hot_sigma=6.0, dead_fraction=0.0, noisy_factor=4.0, column_fraction=0.5):
+    # (map, bad_pixels): DEFECT_* flags per pixel, and (row, col) entries as correct_frame() and
+    # DalsaTeensy.set_bad_pixels() take them, BAD_PIXEL_COLUMN rows for whole columns
+    config = DefectConfig(hot_sigma=hot_sigma, dead_fraction=dead_fraction, noisy_factor=noisy_factor, column_fraction=column_fraction)
+    if self._handle is not None:
+      flags = np.empty(self.shape, dtype=np.uint8)
+      count = _lib.dalsa_master_defects(self._handle, ctypes.byref(config), flags.ctypes.data, None, 0)
+      bad_pixels = np.empty((count, 2), dtype=np.uint16)
+      _lib.dalsa_master_defects(self._handle, ctypes.byref(config), None, bad_pixels.ctypes.data, count)
+      return flags, bad_pixels
+
+    value, sigma = self.get(MASTER_CLIPPED), self.get(MASTER_SIGMA)
+    level = np.float32(np.partition(value.ravel(), value.size // 2)[value.size // 2])
+    deviation = np.abs(value - level).ravel()
+    spread = max(np.float32(1.4826) * np.partition(deviation, deviation.size // 2)[deviation.size // 2], 0.5)
+    noise = max(np.partition(sigma.ravel(), sigma.size // 2)[sigma.size // 2], 0.5)
+    flags = np.zeros(self.shape, dtype=np.uint8)
+    if hot_sigma > 0:
+      flags |= np.where(value > level + hot_sigma * spread, DEFECT_HOT, 0).astype(np.uint8)
+    if dead_fraction > 0:
+      flags |= np.where(value < dead_fraction * level, DEFECT_DEAD, 0).astype(np.uint8)
+    if noisy_factor > 0:
+      flags |= np.where(sigma > noisy_factor * noise, DEFECT_NOISY, 0).astype(np.uint8)
+    bad = flags != 0
+    columns = np.nonzero(bad.sum(axis=0) > column_fraction * self.shape[0])[0] if column_fraction > 0 else np.zeros(0, int)
+    bad[:, columns] = False
+    rows, cols = np.nonzero(bad)
+    bad_pixels = np.concatenate([np.stack([np.full(len(columns), BAD_PIXEL_COLUMN), columns], axis=1), np.stack([rows, cols], axis=1)])
+    return flags, bad_pixels.astype(np.uint16)
+
+class Stack:
+  # Stacks frames with per pixel outlier rejection (STACK_*), see host/include/dalsa/stack.h. get() is cheap
+  # enough to show the stack after every frame.
+  def __init__(self, shape, rejection=STACK_MINMAX, clip_sigma=3.0, threads=0):
+    self.shape = tuple(shape)
+    self.rejection = rejection
+    self._handle = None
+    self._master = None
+    if _lib is not None:
+      config = StackConfig(rejection=rejection, clip_sigma=clip_sigma, threads=threads)
+      self._handle = _lib.dalsa_stack_create(self.shape[0], self.shape[1], ctypes.byref(config))
+    elif rejection == STACK_SIGMA:
+      self._master = MasterBuilder(self.shape, clip_sigma, MASTER_MAX_WARMUP)
+    else:
+      self._frames = 0
+      self._sum = np.zeros(self.shape, dtype=np.uint32)
+      self._min = np.full(self.shape, 0xFFFF, dtype=np.uint16)
+      self._max = np.zeros(self.shape, dtype=np.uint16)
+
+  def __del__(self):
+    if self._handle is not None:
+      _lib.dalsa_stack_destroy(self._handle)
+      self._handle = None
+
+  @property
+  def frames(self):
+    if self._handle is not None:
+      return _lib.dalsa_stack_frames(self._handle)
+    return self._master.frames if self._master is not None else self._frames
+
+  def add(self, frame):
+    frame = np.ascontiguousarray(frame, dtype=np.uint16)
+    assert frame.shape == self.shape, "Frame does not match the stack size"
+    if self._handle is not None:
+      _lib.dalsa_stack_add(self._handle, frame.ctypes.data)
+    elif self._master is not None:
+      self._master.add(frame)
+    else:
+      self._frames += 1
+      self._sum += frame
+      np.minimum(self._min, frame, out=self._min)
+      np.maximum(self._max, frame, out=self._max)
+
+  def get(self, out=None):
+    # uint16 like a single frame
+    if out is None:
+      out = np.empty(self.shape, dtype=np.uint16)
+    assert out.shape == self.shape and out.dtype == np.uint16 and out.flags.c_contiguous, "Unsuitable output buffer"
+    if self._handle is not None:
+      _lib.dalsa_stack_get(self._handle, out.ctypes.data)
+    elif self._master is not None:
+      out[...] = np.clip(np.rint(self._master.get(MASTER_CLIPPED)), 0, 0xFFFF) if self.frames > 0 else 0
+    elif self._frames == 0:
+      out[...] = 0
+    else:
+      minmax = self.rejection == STACK_MINMAX and self._frames >= 3
+      n = self._frames - 2 if minmax else self._frames
+      total = self._sum - self._min - self._max if minmax else self._sum
+      out[...] = (total + n // 2) // n
+    return out
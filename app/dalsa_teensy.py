@@ -1,16 +1,220 @@
 #!/usr/bin/env python3
 
+import os
 import usb1
+import time
+import ctypes
 import struct
-from threading import Lock
+import queue
+import numpy as np
+from collections import deque
+from concurrent.futures import Future
+from threading import Lock, Condition, Thread
+
+import dalsa_native
+import dalsa_capture
+
+class DalsaCommandError(Exception):
+  def __init__(self, cmd, status):
+    super().__init__(f"Command 0x{cmd:02x} failed with status 0x{status:02x}")
+    self.cmd = cmd
+    self.status = status
+
+class DalsaReadoutAborted(Exception):
+  pass
+
+class _Request:
+  # One command on its way through the dispatcher, the tag is assigned once it's packed into a frame
+  __slots__ = ('cmd', 'data', 'tag', 'future')
+
+  def __init__(self, cmd, data, tag=None):
+    self.cmd = cmd
+    self.data = data
+    self.tag = tag
+    self.future = Future()
+
+class FrameHeader(ctypes.LittleEndianStructure):
+  # Mirrors frame_header_t in the firmware, parsed in place over the fetch buffer
+  _pack_ = 1
+  _fields_ = [
+    ('magic', ctypes.c_uint32),
+    ('header_len', ctypes.c_uint16),
+    ('header_version', ctypes.c_uint16),
+    ('sequence', ctypes.c_uint32),
+    ('slot', ctypes.c_uint8),
+    ('high_gain', ctypes.c_uint8),
+    ('readout_mode', ctypes.c_uint8),
+    ('timing_profile', ctypes.c_uint8),
+    ('rows', ctypes.c_uint16),
+    ('cols', ctypes.c_uint16),
+    ('row_start', ctypes.c_uint16),
+    ('col_start', ctypes.c_uint16),
+    ('region_rows', ctypes.c_uint16),
+    ('region_cols', ctypes.c_uint16),
+    ('stride', ctypes.c_uint8),
+    ('adc_resolution', ctypes.c_uint8),
+    ('adc_averaging', ctypes.c_uint8),
+    ('faxitron_state', ctypes.c_uint8),
+    ('faxitron_kv', ctypes.c_uint16),
+    ('faxitron_exposure_ds', ctypes.c_uint16),
+    ('readout_start_ms', ctypes.c_uint32),
+    ('readout_start_us', ctypes.c_uint32),
+    ('readout_end_us', ctypes.c_uint32),
+    ('stream_start_us', ctypes.c_uint32),
+    ('frame_crc', ctypes.c_uint32),
+    ('frame_crc_valid', ctypes.c_uint8),
+    ('corrections', ctypes.c_uint8),
+    ('binning', ctypes.c_uint8),
+    ('reserved', ctypes.c_uint8 * 5),
+  ]
+
+class DalsaFrame:
+  # Header and pixel data share one buffer, neither is copied out of it
+  def __init__(self, buf):
+    self.buffer = buf
+    self.header = FrameHeader.from_buffer(buf)
+    self.data = memoryview(buf)[ctypes.sizeof(FrameHeader):]
+
+  def __len__(self):
+    return len(self.data)
+
+  @property
+  def pixels(self):
+    # (region_rows, region_cols) uint16 view, still over the same buffer
+    h = self.header
+    return np.frombuffer(self.data, dtype=np.uint16, count=h.region_rows * h.region_cols).reshape(h.region_rows, h.region_cols)
 
 class DalsaTeensy:
   DALSA_INTERFACE = 2
   CONTROL_OUT_ENDPOINT = 5
   CONTROL_IN_ENDPOINT = 6
   BULK_IN_ENDPOINT = 7
+  EVENT_IN_ENDPOINT = 5
+
+  PROTOCOL_VERSION = 2
+  STATUS_OK = 0x00
+  STATUS_BUSY = 0x05
+  STATUS_NO_MEMORY = 0x08
 
+  # Until capabilities are known, stay within what every firmware / link speed supports
+  DEFAULT_MAX_FRAME_LEN = 64
+  DEFAULT_MAX_RESPONSE_LEN = 16384
+
+  STRUCT_REQ_HEADER = struct.Struct("<BBHI")
+  STRUCT_RESP_HEADER = struct.Struct("<BBHI")
+  STRUCT_CAPABILITIES = struct.Struct("<BBHIIHH")
   STRUCT_STATE = struct.Struct("<IIIB???")
+  STRUCT_EVENT = struct.Struct("<BBHIII")
+  STRUCT_FETCH_REQ = struct.Struct("<BBHHHHII")
+  STRUCT_FETCH_RESP = struct.Struct("<IHHIIB")
+  STRUCT_CHUNK_HEADER = struct.Struct("<IHHIIII8x")
+  FETCH_RESP_FIELDS = ('len', 'rows', 'cols', 'stream_len', 'frame_crc', 'frame_crc_valid')
+  CHUNK_MAGIC = 0x4B484344
+  FRAME_MAGIC = 0x4D524644
+  FRAME_HEADER_LEN = ctypes.sizeof(FrameHeader)
+
+  STRUCT_STATS_RESP = struct.Struct("<IBBHHHHH")
+  STATS_INCLUDE_HISTOGRAM = (1 << 0)
+  STATS_INCLUDE_ROWS = (1 << 1)
+
+  CAP_FAXITRON_SERIAL = (1 << 0)
+  CAP_EVENTS = (1 << 1)
+  CAP_RANGED_FETCH = (1 << 2)
+  CAP_CRC = (1 << 3)
+  CAP_STATS = (1 << 4)
+  CAP_BAD_PIXELS = (1 << 5)
+  CAP_CALIBRATION = (1 << 6)
+  CAP_PROFILES = (1 << 7)
+  CAP_SLOTS = (1 << 8)
+  CAP_SD_LOG = (1 << 9)
+  CAP_TRACE = (1 << 10)
+  CAP_TIMING = (1 << 11)
+  CAP_TEST_PATTERN = (1 << 12)
+  CAP_PARTIAL_FETCH = (1 << 13)
+
+  SLOT_LATEST = 0xFF
+  SLOT_STATES = ('free', 'reading', 'ready', 'transfer', 'calibration')
+  STRUCT_SLOT_INFO = struct.Struct("<B3xI")
+  READOUT_STARTED = 0x00
+  READOUT_QUEUED = 0x01
+
+  STRUCT_SD_LOG_INFO = struct.Struct("<BBBxIII")
+  STRUCT_DOWNLOAD_REQ = struct.Struct("<III")
+  STRUCT_DOWNLOAD_RESP = struct.Struct("<IIII")
+  SD_LOG_OP_START = 0x00
+  SD_LOG_OP_STOP = 0x01
+  SD_LOG_OP_INFO = 0x02
+  SD_LOG_HEADER_LEN = 512
+  SD_LOG_TIMEOUT = 30 # Preallocating a large log takes a while
+
+  STRUCT_TRACE_RESP = struct.Struct("<IIIH2x")
+  STRUCT_TRACE_ENTRY = struct.Struct("<IBBHII")
+
+  STRUCT_TIMING_STATS = struct.Struct("<BBBBIIIIiiIII8I")
+  TIMING_OP_PRIORITIES = 0x00
+  TIMING_OP_STRESS = 0x01
+  TIMING_OP_RESULTS = 0x02
+  TIMING_OP_SAMPLE = 0x03
+
+  READOUT_MODE_SENSOR = 0x00
+  READOUT_MODE_TEST_PATTERN = 0x01
+  STRUCT_TEST_PATTERN = struct.Struct("<B3xII")
+  TEST_PATTERN_OFF = 0x00
+  TEST_PATTERN_RAMP = 0x01
+  TEST_PATTERN_CHECKERBOARD = 0x02
+  TEST_PATTERN_PRNG = 0x03
+
+  CORRECTION_BAD_PIXELS = (1 << 0)
+  CORRECTION_DARK = (1 << 1)
+  CORRECTION_GAIN = (1 << 2)
+
+  STRUCT_BAD_PIXELS_INFO = struct.Struct("<HHHBB")
+  BAD_PIXELS_INFO_FIELDS = ('count', 'staged', 'max_count', 'enabled', 'pending')
+  BAD_PIXEL_COLUMN = 0xFFFF
+  BAD_PIXELS_OP_CLEAR = 0x00
+  BAD_PIXELS_OP_ADD = 0x01
+  BAD_PIXELS_OP_COMMIT = 0x02
+  BAD_PIXELS_OP_READ = 0x03
+  BAD_PIXELS_OP_ENABLE = 0x04
+  BAD_PIXELS_COMMIT_TIMEOUT = 2
+
+  STRUCT_CALIBRATION_INFO = struct.Struct("<BBBBHH")
+  CALIBRATION_MAP_DARK = 0
+  CALIBRATION_MAP_GAIN = 1
+  CALIBRATION_MAP_STATES = ('empty', 'loading', 'verifying', 'valid', 'crc_error')
+  CALIBRATION_OP_BEGIN = 0x00
+  CALIBRATION_OP_WRITE = 0x01
+  CALIBRATION_OP_COMMIT = 0x02
+  CALIBRATION_OP_CONFIGURE = 0x03
+  CALIBRATION_OP_INFO = 0x04
+  CALIBRATION_GAIN_MAX = 0x7FFF
+  CALIBRATION_VERIFY_TIMEOUT = 2
+
+  STRUCT_PROFILE_INFO = struct.Struct("<BBBBIHHIII")
+  PROFILE_INFO_FIELDS = ('id', 'adc_resolution', 'adc_averaging', 'binning', 'half_pixel_ns', 'rows', 'cols', 'frames', 'frame_us', 'noise_mlsb')
+  PROFILE_STANDARD = 0
+  PROFILE_PREVIEW = 1
+  PROFILE_QUALITY = 2
+  PROFILE_NAMES = ('standard', 'preview', 'quality')
+
+  EVENT_READOUT_STARTED = 0x01
+  EVENT_ROW_PROGRESS = 0x02
+  EVENT_FRAME_READY = 0x03
+  EVENT_FAXITRON_STATE = 0x04
+  EVENT_ERROR = 0x05
+
+  ERROR_READOUT_BUSY = 0x01
+  ERROR_FAXITRON_TIMEOUT = 0x02
+  ERROR_INVALID_COMMAND = 0x03
+  ERROR_SD_LOG = 0x04
+  ERROR_READOUT_ABORTED = 0x05
+
+  EVENT_QUEUE_LEN = 256
+  READOUT_TIMEOUT = 60
+  READOUT_EVENT_TIMEOUT = 2 # A readout that goes quiet this long gets checked with get_slots()
+
+  BULK_TIMEOUT_MS = 5000
+  FETCH_RETRIES = 3
 
   FAXITRON_STATE_WARMING_UP = "warming_up"
   FAXITRON_STATE_DOOR_OPEN = "door_open"
@@ -21,23 +225,165 @@ class DalsaTeensy:
 
   FRAME_WIDTH = 1024 + 8
   FRAME_HEIGHT = 1024 + 18
+  ACTIVE_COL_START = 4 + 4 # Junk and dark columns in front of the image, unbinned
+  ACTIVE_COLS = 1024
 
-  def __init__(self):
+  def __init__(self, native=None, daemon=None):
+    # native: go through the libusb client from host/ (dalsa_native.Client), None uses it when it was built
+    # daemon: socket of the capture daemon to share the device through, None takes DALSA_DAEMON if it's set
+    self._native_client = dalsa_native.Client is not None if native is None else native
+    self._daemon = os.environ.get("DALSA_DAEMON") if daemon is None else daemon
+    self._native = None
     self._handle = None
     self._serial_lock = Lock()
+    self._stream_lock = Lock()
+    self._next_tag = 0
+    self._rx_data = b""
+    self._in_flight = {}
+    self._frames_in_flight = 0
+    self._dispatch_queue = queue.SimpleQueue()
+    self._dispatch_thread = None
+    self._events = deque(maxlen=self.EVENT_QUEUE_LEN)
+    self._event_cond = Condition()
+    self._event_callbacks = []
+    self._event_thread = None
+    self._event_thread_running = False
+    self.capabilities = None
     self.connect()
 
   def connect(self):
+    self._stop_event_thread()
+    self._stop_dispatcher()
     if self._handle is not None:
       self._handle.close()
+      self._handle = None
+    if isinstance(self._native, dalsa_capture.DaemonClient):
+      self._native.close()
+    self._native = None
 
-    self._handle = usb1.USBContext().openByVendorIDAndProductID(0x16c0, 0x0483)
-    assert self._handle is not None, "Could not find Dalsa Teensy. Make sure it's connected."
+    if self._daemon:
+      self._native = dalsa_capture.DaemonClient(self._daemon)
+    elif self._native_client:
+      assert dalsa_native.Client is not None, "Native client module not built"
+      self._native = dalsa_native.Client(timeout_ms=self.BULK_TIMEOUT_MS, retries=self.FETCH_RETRIES)
+    else:
+      self._handle = usb1.USBContext().openByVendorIDAndProductID(0x16c0, 0x0483)
+      assert self._handle is not None, "Could not find Dalsa Teensy. Make sure it's connected."
+      self._handle.claimInterface(DalsaTeensy.DALSA_INTERFACE)
+
+    self._rx_data = b""
+    self._in_flight = {}
+    self._frames_in_flight = 0
+    self.capabilities = None
+    if self._native is None:
+      self._dispatch_queue = queue.SimpleQueue()
+      self._dispatch_thread = Thread(target=self._dispatch_loop, daemon=True)
+      self._dispatch_thread.start()
+    self.capabilities = self.get_capabilities()
 
-    self._handle.claimInterface(DalsaTeensy.DALSA_INTERFACE)
+    if self.capabilities['capabilities'] & self.CAP_EVENTS:
+      self._event_thread_running = True
+      self._event_thread = Thread(target=self._event_loop, daemon=True)
+      self._event_thread.start()
 
     print("Connected to Dalsa Teensy")
 
+  def _stop_event_thread(self):
+    if self._event_thread is not None:
+      self._event_thread_running = False
+      self._event_thread.join()
+      self._event_thread = None
+
+  def _read_event(self, timeout):
+    if self._native is not None:
+      return self._native.wait_event(timeout)
+    try:
+      return self._handle.interruptRead(
+        endpoint=DalsaTeensy.EVENT_IN_ENDPOINT,
+        length=self.STRUCT_EVENT.size,
+        timeout=timeout,
+      )
+    except usb1.USBErrorTimeout:
+      return None
+
+  def _stop_dispatcher(self):
+    if self._dispatch_thread is not None:
+      self._dispatch_queue.put(None)
+      self._dispatch_thread.join()
+      self._dispatch_thread = None
+
+  def _dispatch_loop(self):
+    # Owns the control endpoints. Packs queued requests into frames, keeps up to max_outstanding frames in
+    # flight and hands every response to the future of the request with its tag. Callers on any thread
+    # only ever touch the queue and their own futures.
+    pending = deque()
+    running = True
+    while running or len(self._in_flight) > 0:
+      try:
+        batch = self._dispatch_queue.get(block=(len(pending) == 0 and self._frames_in_flight == 0))
+        while True:
+          if batch is None:
+            running = False
+          else:
+            pending.extend(batch)
+          batch = self._dispatch_queue.get_nowait()
+      except queue.Empty:
+        pass
+
+      if not running:
+        self._fail_requests(pending, Exception("Disconnected from Dalsa Teensy"))
+      try:
+        while len(pending) > 0 and self._frames_in_flight < self._max_outstanding():
+          self._send_frame(self._next_frame(pending))
+        if self._frames_in_flight > 0:
+          self._receive_responses()
+      except Exception as e:
+        # Nothing that's in flight will be answered anymore, the callers get the error instead
+        self._fail_requests(list(self._in_flight.values()) + list(pending), e)
+        self._in_flight = {}
+        self._frames_in_flight = 0
+        self._rx_data = b""
+
+  @staticmethod
+  def _fail_requests(requests, exception):
+    for request in requests:
+      if not request.future.done():
+        request.future.set_exception(exception)
+    if isinstance(requests, deque):
+      requests.clear()
+
+  def _next_frame(self, pending):
+    # Takes requests off the front of the queue until the next one doesn't fit
+    frame = b""
+    while len(pending) > 0 and len(frame) + self.STRUCT_REQ_HEADER.size + len(pending[0].data) <= self._max_frame_len():
+      request = pending.popleft()
+      request.tag = self._next_tag
+      self._next_tag = (self._next_tag + 1) & 0xFFFF
+      frame += self.STRUCT_REQ_HEADER.pack(self.PROTOCOL_VERSION, request.cmd, request.tag, len(request.data)) + request.data
+      self._in_flight[request.tag] = request
+    return frame
+
+  def _event_loop(self):
+    while self._event_thread_running:
+      dat = self._read_event(100)
+      if dat is None or len(dat) != self.STRUCT_EVENT.size:
+        continue
+
+      dat_unpacked = self.STRUCT_EVENT.unpack(dat)
+      event = {
+        'type': dat_unpacked[0],
+        'dropped': dat_unpacked[1],
+        'sequence': dat_unpacked[2],
+        'timestamp_us': dat_unpacked[3],
+        'arg0': dat_unpacked[4],
+        'arg1': dat_unpacked[5],
+      }
+      with self._event_cond:
+        self._events.append(event)
+        self._event_cond.notify_all()
+      for callback in list(self._event_callbacks):
+        callback(event)
+
   def _control_out(self, data):
     return self._handle.bulkWrite(
       endpoint=DalsaTeensy.CONTROL_OUT_ENDPOINT,
@@ -50,22 +396,78 @@ class DalsaTeensy:
       length=size,
     )
 
-  def _bulk_in(self, size):
+  def _bulk_in(self, size, timeout=0):
+    if self._native is not None:
+      # Returns what arrived before the timeout instead of raising
+      return self._native.bulk_read(size, timeout)
     return self._handle.bulkRead(
       endpoint=DalsaTeensy.BULK_IN_ENDPOINT,
       length=size,
+      timeout=timeout,
     )
 
+  def _max_frame_len(self):
+    return self.capabilities['max_frame_len'] if self.capabilities is not None else self.DEFAULT_MAX_FRAME_LEN
+
+  def _max_response_len(self):
+    return self.capabilities['max_response_len'] if self.capabilities is not None else self.DEFAULT_MAX_RESPONSE_LEN
+
+  def _max_outstanding(self):
+    return self.capabilities['max_outstanding'] if self.capabilities is not None else 1
+
+  def _send_frame(self, frame):
+    # Dispatcher only, the device takes up to max_outstanding frames before a response has to be read
+    self._control_out(frame)
+    self._frames_in_flight += 1
+
+  def _submit(self, commands):
+    # Queues the requests for the dispatcher, which packs as many per command frame as fit. Returns the
+    # requests to collect the responses with, from any thread.
+    if self._native is not None:
+      # The native client multiplexes callers itself
+      tags = self._native.submit([(cmd, bytes(data)) for cmd, data in commands])
+      return [_Request(cmd, None, tag) for tag, (cmd, _) in zip(tags, commands)]
+    requests = []
+    for cmd, data in commands:
+      request = _Request(cmd, bytes(data))
+      req_len = self.STRUCT_REQ_HEADER.size + len(request.data)
+      assert req_len <= self._max_frame_len(), f"Request too large: {req_len} > {self._max_frame_len()}"
+      requests.append(request)
+    self._dispatch_queue.put(requests)
+    return requests
+
+  def _receive_responses(self):
+    # Dispatcher only. Every IN transfer carries the responses to exactly one command frame.
+    self._rx_data += self._control_in(self._max_response_len())
+    self._frames_in_flight -= 1
+    while len(self._rx_data) >= self.STRUCT_RESP_HEADER.size:
+      version, status, tag, data_len = self.STRUCT_RESP_HEADER.unpack_from(self._rx_data)
+      if version != self.PROTOCOL_VERSION:
+        self._rx_data = b""
+        raise Exception("Invalid response version", version)
+      end = self.STRUCT_RESP_HEADER.size + data_len
+      if len(self._rx_data) < end:
+        break
+      request = self._in_flight.pop(tag, None)
+      if request is not None:
+        request.future.set_result((status, self._rx_data[self.STRUCT_RESP_HEADER.size:end]))
+      self._rx_data = self._rx_data[end:]
+
+  def _collect(self, request):
+    if self._native is not None:
+      status, data = self._native.collect(request.tag)
+    else:
+      status, data = request.future.result()
+    if status != self.STATUS_OK:
+      raise DalsaCommandError(request.cmd, status)
+    return data
+
   def _command(self, cmd, data):
-    self._control_out(struct.pack("<BI", cmd, len(data)) + data)
-    resp = self._control_in(512)
-    if len(resp) < 4:
-      raise Exception("Invalid response length", len(resp))
-    resp_len = struct.unpack("<I", resp[:4])[0]
-    resp = resp[4:]
-    while len(resp) < resp_len:
-      resp += self._control_in(resp_len - len(resp))
-    return resp
+    return self._collect(self._submit([(cmd, data)])[0])
+
+  def _command_batch(self, commands):
+    # Sends all commands back-to-back before waiting on any of the responses
+    return [self._collect(request) for request in self._submit(commands)]
 
   def _faxitron_serial_command(self, data, no_lock=False):
     if no_lock:
@@ -79,6 +481,50 @@ class DalsaTeensy:
     assert len(dat) == 1, "Response does not match expected size"
     assert dat[0] == 0xA5, "Invalid ping response"
 
+  def add_event_callback(self, callback):
+    # Callbacks run on the event thread, keep them short
+    self._event_callbacks.append(callback)
+
+  def remove_event_callback(self, callback):
+    self._event_callbacks.remove(callback)
+
+  def clear_events(self):
+    with self._event_cond:
+      self._events.clear()
+
+  def wait_for_event(self, event_types=None, timeout=None):
+    # Pops the oldest queued event of one of the given types, waiting for one if there is none yet
+    if isinstance(event_types, int):
+      event_types = (event_types, )
+    deadline = None if timeout is None else time.monotonic() + timeout
+    with self._event_cond:
+      while True:
+        for event in self._events:
+          if event_types is None or event['type'] in event_types:
+            self._events.remove(event)
+            return event
+        remaining = None if deadline is None else deadline - time.monotonic()
+        if remaining is not None and remaining <= 0:
+          return None
+        self._event_cond.wait(remaining)
+
+  def configure_events(self, progress_rows):
+    self._command(0x05, struct.pack("<H", progress_rows))
+
+  def get_capabilities(self):
+    dat = self._command(0x04, b"")
+    assert len(dat) == self.STRUCT_CAPABILITIES.size, f"Response does not match expected struct size: {len(dat)} != {self.STRUCT_CAPABILITIES.size}"
+    dat_unpacked = self.STRUCT_CAPABILITIES.unpack(dat)
+    return {
+      'protocol_version': dat_unpacked[0],
+      'max_outstanding': dat_unpacked[1],
+      'max_frame_len': dat_unpacked[2],
+      'max_response_len': dat_unpacked[3],
+      'capabilities': dat_unpacked[4],
+      'rows': dat_unpacked[5],
+      'columns': dat_unpacked[6],
+    }
+
   def get_state(self):
     dat = self._command(0x01, b"")
     assert len(dat) == self.STRUCT_STATE.size, f"Response does not match expected struct size: {len(dat)} != {self.STRUCT_STATE.size}"
@@ -93,28 +539,488 @@ class DalsaTeensy:
     }
 
   def get_frame(self):
-    dat = self._command(0x02, b"")
-    assert len(dat) == 4, "Response does not match expected size"
-    frame_len = struct.unpack("<I", dat[:4])[0]
-    return self._bulk_in(frame_len)
+    return self.fetch().data
+
+  def get_slots(self):
+    dat = self._command(0x0B, b"")
+    return [{'state': self.SLOT_STATES[state], 'sequence': sequence} for state, sequence in self.STRUCT_SLOT_INFO.iter_unpack(dat)]
+
+  @staticmethod
+  def _missing_ranges(start, length, covered):
+    missing = []
+    pos = start
+    for offset, chunk_len in sorted(covered):
+      if offset > pos:
+        missing.append((pos, offset - pos))
+      pos = max(pos, offset + chunk_len)
+    if pos < start + length:
+      missing.append((pos, start + length - pos))
+    return missing
+
+  def _fetch_stream(self, region, offset, length, buf=None):
+    # Requests one byte range of a region into buf (frame header, then payload). Places every chunk that
+    # passes its CRC and returns the ranges that are still missing.
+    request = self._submit([(0x06, self.STRUCT_FETCH_REQ.pack(*region, offset, length))])[0]
+    dat = self._collect(request)
+    assert len(dat) == self.STRUCT_FETCH_RESP.size, "Response does not match expected size"
+    info = dict(zip(self.FETCH_RESP_FIELDS, self.STRUCT_FETCH_RESP.unpack(dat)))
+    if buf is None:
+      buf = bytearray(self.FRAME_HEADER_LEN + info['len'])
+
+    try:
+      stream = self._bulk_in(info['stream_len'], timeout=self.BULK_TIMEOUT_MS)
+    except usb1.USBErrorTimeout as e:
+      stream = getattr(e, 'received', b"")
+      print(f"Bulk fetch timed out at {len(stream)}/{info['stream_len']} bytes")
+
+    length = length if length != 0 else info['len']
+    if len(stream) < self.FRAME_HEADER_LEN or struct.unpack_from("<I", stream)[0] != self.FRAME_MAGIC:
+      return buf, [(offset, length)]
+    sequence = FrameHeader.from_buffer_copy(stream[:self.FRAME_HEADER_LEN]).sequence
+    current = FrameHeader.from_buffer_copy(buf[:self.FRAME_HEADER_LEN])
+    if current.magic != self.FRAME_MAGIC:
+      buf[:self.FRAME_HEADER_LEN] = stream[:self.FRAME_HEADER_LEN]
+    elif current.sequence != sequence:
+      raise Exception("Frame was replaced while fetching it")
+
+    covered = self._place_chunks(stream, self.FRAME_HEADER_LEN, request.tag, sequence, buf, self.FRAME_HEADER_LEN)
+    return buf, self._missing_ranges(offset, length, covered)
+
+  def _place_chunks(self, stream, pos, tag, sequence, buf, base):
+    # Copies every chunk that passes its CRC to base + its offset in buf, returns the (offset, length) covered
+    covered = []
+    while pos + self.STRUCT_CHUNK_HEADER.size <= len(stream):
+      magic, chunk_tag, _, chunk_offset, chunk_len, crc, chunk_sequence = self.STRUCT_CHUNK_HEADER.unpack_from(stream, pos)
+      if magic != self.CHUNK_MAGIC or chunk_tag != tag or chunk_sequence != sequence:
+        break # lost track of the stream, whatever is left gets requested again
+      pos += self.STRUCT_CHUNK_HEADER.size
+      dst = base + chunk_offset
+      if pos + chunk_len > len(stream) or dst + chunk_len > len(buf):
+        break
+      buf[dst:dst + chunk_len] = stream[pos:pos + chunk_len]
+      if dalsa_native.crc32(buf, dst, chunk_len) == crc:
+        covered.append((chunk_offset, chunk_len))
+      else:
+        print(f"CRC mismatch in chunk at {chunk_offset}, retrying")
+      pos += chunk_len
+    return covered
+
+  def fetch(self, slot=SLOT_LATEST, row_start=0, row_count=0, col_start=0, col_count=0, stride=1):
+    # Fetches a (strided) region of a frame slot, re-requesting every chunk that went missing or failed its CRC
+    # One bulk stream at a time, a new fetch would abort the one that's running
+    with self._stream_lock:
+      if self._native is not None:
+        # Same retries and CRC checks, natively, straight into a pooled buffer with the GIL released
+        return DalsaFrame(self._native.fetch(slot, row_start, row_count, col_start, col_count, stride))
+      region = (slot, stride, row_start, row_count, col_start, col_count)
+      buf, missing = self._fetch_stream(region, 0, 0)
+      header = FrameHeader.from_buffer(buf)
+      if header.magic == self.FRAME_MAGIC:
+        # Retries go to the same slot, even if a newer frame completes in the meantime
+        region = (header.slot, ) + region[1:]
+      for _ in range(self.FETCH_RETRIES):
+        if len(missing) == 0:
+          break
+        still_missing = []
+        for offset, length in missing:
+          _, m = self._fetch_stream(region, offset, length, buf)
+          still_missing += m
+        missing = still_missing
+      if len(missing) > 0:
+        raise Exception("Failed to fetch frame, missing ranges:", missing)
+
+      frame = DalsaFrame(buf)
+      if frame.header.magic != self.FRAME_MAGIC:
+        raise Exception("Did not receive a frame header")
+      whole_frame = (stride == 1 and row_start == 0 and row_count == 0 and col_start == 0 and col_count == 0)
+      if whole_frame and frame.header.frame_crc_valid and dalsa_native.crc32(buf, self.FRAME_HEADER_LEN) != frame.header.frame_crc:
+        raise Exception("Frame CRC mismatch")
+      return frame
+
+  def get_stats(self, slot=SLOT_LATEST, histogram=True, rows=True):
+    # A few KB of statistics gathered during readout, instead of the whole frame
+    include = (self.STATS_INCLUDE_HISTOGRAM if histogram else 0) | (self.STATS_INCLUDE_ROWS if rows else 0)
+    dat = self._command(0x07, struct.pack("<BB", slot, include))
+    sequence, valid, hist_shift, hist_bins, n_rows, col_start, cols, _ = self.STRUCT_STATS_RESP.unpack_from(dat)
+    view = memoryview(dat)[self.STRUCT_STATS_RESP.size:]
+    hist_len = hist_bins * 4
+    assert len(view) == hist_len + n_rows * 8, "Response does not match expected size"
+    row_stats = list(zip(*struct.iter_unpack("<HHI", view[hist_len:]))) if n_rows > 0 else [(), (), ()]
+    return {
+      'sequence': sequence,
+      'valid': bool(valid),
+      'hist_shift': hist_shift,
+      'col_start': col_start,
+      'cols': cols,
+      'histogram': view[:hist_len].cast('I'),
+      'row_min': row_stats[0],
+      'row_max': row_stats[1],
+      'row_sum': row_stats[2],
+    }
+
+  @staticmethod
+  def histogram_percentile(stats, fraction):
+    # Pixel value below which `fraction` of the active pixels fall
+    hist = stats['histogram']
+    target = fraction * sum(hist)
+    count = 0
+    for i, n in enumerate(hist):
+      count += n
+      if count >= target:
+        return i << stats['hist_shift']
+    return (len(hist) - 1) << stats['hist_shift']
+
+  def _bad_pixels_command(self, op, data=b""):
+    dat = self._command(0x08, bytes([op]) + data)
+    info = dict(zip(self.BAD_PIXELS_INFO_FIELDS, self.STRUCT_BAD_PIXELS_INFO.unpack_from(dat)))
+    return info, memoryview(dat)[self.STRUCT_BAD_PIXELS_INFO.size:]
+
+  def get_bad_pixels(self):
+    # Returns the active map as ([(row, col), ...], [col, ...])
+    info, entries = self._bad_pixels_command(self.BAD_PIXELS_OP_READ, struct.pack("<H", 0))
+    dat = bytes(entries)
+    while len(dat) < info['count'] * 4:
+      _, entries = self._bad_pixels_command(self.BAD_PIXELS_OP_READ, struct.pack("<H", len(dat) // 4))
+      assert len(entries) > 0, "Bad pixel map changed while reading it"
+      dat += bytes(entries)
+    entries = list(struct.iter_unpack("<HH", dat))
+    pixels = [e for e in entries if e[0] != self.BAD_PIXEL_COLUMN]
+    columns = [e[1] for e in entries if e[0] == self.BAD_PIXEL_COLUMN]
+    return pixels, columns
+
+  def set_bad_pixels(self, pixels, columns=()):
+    # Replaces the map on the device, which stores it in EEPROM. It takes effect from the next frame.
+    entries = [struct.pack("<HH", row, col) for row, col in pixels] + [struct.pack("<HH", self.BAD_PIXEL_COLUMN, col) for col in columns]
+    per_request = (self._max_frame_len() - self.STRUCT_REQ_HEADER.size - 1) // 4
+    commands = [(0x08, bytes([self.BAD_PIXELS_OP_CLEAR]))]
+    for i in range(0, len(entries), per_request):
+      commands.append((0x08, bytes([self.BAD_PIXELS_OP_ADD]) + b"".join(entries[i:i + per_request])))
+    commands.append((0x08, bytes([self.BAD_PIXELS_OP_COMMIT])))
+    self._command_batch(commands)
+
+    deadline = time.monotonic() + self.BAD_PIXELS_COMMIT_TIMEOUT
+    while True:
+      info, _ = self._bad_pixels_command(self.BAD_PIXELS_OP_READ, struct.pack("<H", 0xFFFF))
+      if not info['pending']:
+        return info
+      if time.monotonic() > deadline:
+        raise Exception("Bad pixel map was not activated, is a readout stuck?")
+      time.sleep(0.05)
+
+  def set_bad_pixel_correction(self, enabled):
+    info, _ = self._bad_pixels_command(self.BAD_PIXELS_OP_ENABLE, b"\x01" if enabled else b"\x00")
+    return info
+
+  def _calibration_command(self, op, data=b""):
+    dat = self._command(0x09, bytes([op]) + data)
+    dark_state, gain_state, active, gain_shift, pedestal, _ = self.STRUCT_CALIBRATION_INFO.unpack(dat)
+    return {
+      'dark': self.CALIBRATION_MAP_STATES[dark_state],
+      'gain': self.CALIBRATION_MAP_STATES[gain_state],
+      'dark_active': bool(active & self.CORRECTION_DARK),
+      'gain_active': bool(active & self.CORRECTION_GAIN),
+      'gain_shift': gain_shift,
+      'pedestal': pedestal,
+    }
+
+  def get_calibration(self):
+    return self._calibration_command(self.CALIBRATION_OP_INFO)
+
+  def _upload_calibration_map(self, map_id, data):
+    data = np.ascontiguousarray(data, dtype='<u2').ravel()
+    assert len(data) == self.capabilities['rows'] * self.capabilities['columns'], "Map does not match the frame size"
+    dat = data.tobytes()
+
+    # Maps are allocated on their first upload. With 8 MB of PSRAM only one fits next to the frame slots, the
+    # other one takes over a frame slot (get_slots() shows it as 'calibration') and readouts make do with one.
+    # Older firmware fails with NO_MEMORY instead.
+    key = ('dark', 'gain')[map_id]
+    try:
+      self._command(0x09, bytes([self.CALIBRATION_OP_BEGIN, map_id]))
+    except DalsaCommandError as e:
+      if e.status == self.STATUS_NO_MEMORY:
+        raise Exception(f"Not enough PSRAM left for the {key} map") from e
+      raise
+
+    per_request = (self._max_frame_len() - self.STRUCT_REQ_HEADER.size - 6) // 2 * 2
+    commands = []
+    for offset in range(0, len(dat), per_request):
+      commands.append((0x09, bytes([self.CALIBRATION_OP_WRITE, map_id]) + struct.pack("<I", offset // 2) + dat[offset:offset + per_request]))
+    commands.append((0x09, bytes([self.CALIBRATION_OP_COMMIT, map_id]) + struct.pack("<I", dalsa_native.crc32(dat))))
+    self._command_batch(commands)
+
+    # The device checks the CRC between frames
+    deadline = time.monotonic() + self.CALIBRATION_VERIFY_TIMEOUT
+    while True:
+      info = self.get_calibration()
+      if info[key] == 'valid':
+        return info
+      if info[key] != 'verifying' or time.monotonic() > deadline:
+        raise Exception(f"Failed to upload {key} map: {info[key]}")
+      time.sleep(0.05)
+
+  def set_dark_map(self, dark):
+    # Raw ADC counts, whole frame including the dark and junk columns
+    return self._upload_calibration_map(self.CALIBRATION_MAP_DARK, dark)
+
+  def set_gain_map(self, gain):
+    # Float gain per pixel, 1.0 leaves a pixel as is
+    shift = self.get_calibration()['gain_shift']
+    fixed = np.clip(np.rint(np.asarray(gain, dtype=np.float64) * (1 << shift)), 0, self.CALIBRATION_GAIN_MAX)
+    return self._upload_calibration_map(self.CALIBRATION_MAP_GAIN, fixed.astype('<u2'))
+
+  def configure_calibration(self, dark=True, gain=True, pedestal=0):
+    # Pedestal is added after the dark subtraction, so noise around zero doesn't get clipped
+    enabled = (self.CORRECTION_DARK if dark else 0) | (self.CORRECTION_GAIN if gain else 0)
+    return self._calibration_command(self.CALIBRATION_OP_CONFIGURE, struct.pack("<BH", enabled, pedestal))
+
+  def _profiles_command(self, data):
+    dat = self._command(0x0A, data)
+    current, count = dat[0], dat[1]
+    profiles = []
+    for fields in self.STRUCT_PROFILE_INFO.iter_unpack(dat[2:2 + count * self.STRUCT_PROFILE_INFO.size]):
+      profile = dict(zip(self.PROFILE_INFO_FIELDS, fields))
+      profile['name'] = self.PROFILE_NAMES[profile['id']] if profile['id'] < len(self.PROFILE_NAMES) else str(profile['id'])
+      profile['frame_time'] = profile['frame_us'] / 1e6
+      profile['noise'] = profile['noise_mlsb'] / 1000
+      profiles.append(profile)
+    return current, profiles
+
+  def get_readout_profiles(self):
+    # Returns (current profile id, [profile, ...]), frame time and noise are from the last frame read with each
+    return self._profiles_command(b"")
+
+  def set_readout_profile(self, profile):
+    if isinstance(profile, str):
+      profile = self.PROFILE_NAMES.index(profile)
+    current, profiles = self._profiles_command(bytes([profile]))
+    return profiles[current]
+
+  def _sd_log_command(self, op, data=b""):
+    card, active, pending, capacity, count, record_len = self.STRUCT_SD_LOG_INFO.unpack(self._command(0x0C, bytes([op]) + data))
+    return {'card': bool(card), 'active': bool(active), 'pending': pending, 'capacity': capacity, 'count': count, 'record_len': record_len}
+
+  def get_sd_log(self):
+    return self._sd_log_command(self.SD_LOG_OP_INFO)
+
+  def _wait_sd_log(self, active):
+    deadline = time.monotonic() + self.SD_LOG_TIMEOUT
+    while True:
+      info = self.get_sd_log()
+      if info['active'] == active and (active or info['pending'] == 0):
+        return info
+      if time.monotonic() > deadline:
+        raise Exception("SD log did not " + ("start, is there a card?" if active else "stop"))
+      time.sleep(0.1)
+
+  def start_sd_log(self, capacity=0):
+    # Every frame read out from now on is also written to the card. Capacity 0 appends to the existing log.
+    self._sd_log_command(self.SD_LOG_OP_START, struct.pack("<I", capacity))
+    return self._wait_sd_log(True)
+
+  def stop_sd_log(self):
+    self._sd_log_command(self.SD_LOG_OP_STOP)
+    return self._wait_sd_log(False)
+
+  def _download_stream(self, record, offset, length, buf):
+    request = self._submit([(0x0D, self.STRUCT_DOWNLOAD_REQ.pack(record, offset, length))])[0]
+    info = dict(zip(('len', 'stream_len', 'count', 'record_len'), self.STRUCT_DOWNLOAD_RESP.unpack(self._collect(request))))
+    if buf is None:
+      buf = bytearray(info['record_len'])
+    try:
+      stream = self._bulk_in(info['stream_len'], timeout=self.BULK_TIMEOUT_MS)
+    except usb1.USBErrorTimeout as e:
+      stream = getattr(e, 'received', b"")
+    covered = self._place_chunks(stream, 0, request.tag, record, buf, 0)
+    return buf, self._missing_ranges(offset, length if length != 0 else info['len'], covered)
+
+  def download_log_record(self, record):
+    with self._stream_lock:
+      buf, missing = self._download_stream(record, 0, 0, None)
+      for _ in range(self.FETCH_RETRIES):
+        if len(missing) == 0:
+          break
+        still_missing = []
+        for offset, length in missing:
+          _, m = self._download_stream(record, offset, length, buf)
+          still_missing += m
+        missing = still_missing
+      if len(missing) > 0:
+        raise Exception(f"Failed to download record {record}, missing ranges:", missing)
+
+      # Records pad the header to a whole sector, frames have the pixels right behind it
+      header = FrameHeader.from_buffer_copy(buf[:self.FRAME_HEADER_LEN])
+      if header.magic != self.FRAME_MAGIC:
+        raise Exception(f"Record {record} has no frame header")
+      data_len = header.rows * header.cols * 2
+      frame = DalsaFrame(bytearray(buf[:self.FRAME_HEADER_LEN]) + buf[self.SD_LOG_HEADER_LEN:self.SD_LOG_HEADER_LEN + data_len])
+      if frame.header.frame_crc_valid and dalsa_native.crc32(frame.buffer, self.FRAME_HEADER_LEN) != frame.header.frame_crc:
+        raise Exception(f"Frame CRC mismatch in record {record}")
+      return frame
+
+  def download_log(self):
+    # Yields every logged frame, oldest first
+    for record in range(self.get_sd_log()['count']):
+      yield self.download_log_record(record)
+
+  def read_trace(self):
+    # Drains the firmware trace ring, dalsa_trace.py turns the entries into a timeline
+    dat = self._command(0x0E, b"")
+    first, lost, now_us, count = self.STRUCT_TRACE_RESP.unpack_from(dat)
+    entries = [
+      {'timestamp_us': timestamp_us, 'id': event_id, 'phase': phase, 'arg0': arg0, 'arg1': arg1}
+      for timestamp_us, event_id, phase, _, arg0, arg1 in self.STRUCT_TRACE_ENTRY.iter_unpack(dat[self.STRUCT_TRACE_RESP.size:])
+    ]
+    assert len(entries) == count
+    return {'first': first, 'lost': lost, 'now_us': now_us, 'entries': entries}
+
+  def _timing_command(self, op, data=b""):
+    dat = self.STRUCT_TIMING_STATS.unpack(self._command(0x0F, bytes([op]) + data))
+    keys = ('pixel_priority', 'usb_priority', 'stress', 'sampled', 'period_cycles', 'edges', 'late_edges', 'dropped_edges',
+            'jitter_min_cycles', 'jitter_max_cycles', 'nak_samples', 'stall_samples', 'bulk_bytes')
+    stats = dict(zip(keys, dat))
+    stats['stress'] = bool(stats['stress'])
+    stats['sampled'] = bool(stats['sampled'])
+    stats['jitter_hist'] = list(dat[len(keys):])
+    return stats
+
+  def set_irq_priorities(self, pixel_priority, usb_priority):
+    # NVIC priorities, lower preempts higher. Only the top 4 bits count.
+    return self._timing_command(self.TIMING_OP_PRIORITIES, bytes([pixel_priority, usb_priority]))
+
+  def set_timing_sampling(self, enabled):
+    # Times the pixel edges of every readout from now on, stress runs always are. Costs pixel ISR time.
+    return self._timing_command(self.TIMING_OP_SAMPLE, bytes([enabled]))
+
+  def get_timing_stats(self):
+    # Pixel clock timing of the last readout
+    return self._timing_command(self.TIMING_OP_RESULTS)
+
+  def run_timing_stress(self, stream_len=256 << 20, high_gain=True, timeout=60):
+    # Reads out a frame while pulling stream_len bytes of bulk data as fast as possible
+    with self._stream_lock:
+      self.clear_events()
+      self._timing_command(self.TIMING_OP_STRESS, struct.pack("<BI", high_gain, stream_len))
+      start = time.monotonic()
+      try:
+        received = len(self._bulk_in(stream_len, timeout=timeout * 1000))
+      except usb1.USBErrorTimeout as e:
+        received = len(getattr(e, 'received', b""))
+      elapsed = time.monotonic() - start
+      if self.wait_for_event(self.EVENT_FRAME_READY, timeout) is None:
+        raise Exception("Stress readout did not finish")
+
+      stats = self.get_timing_stats()
+      stats['host_bytes'] = received
+      stats['host_mb_s'] = received / elapsed / 1e6
+      return stats
+
+  def _test_pattern_command(self, data=b""):
+    pattern, seed, row_rate = self.STRUCT_TEST_PATTERN.unpack(self._command(0x11, data))
+    return {'pattern': pattern, 'seed': seed, 'row_rate': row_rate}
+
+  def get_test_pattern(self):
+    return self._test_pattern_command()
+
+  def set_test_pattern(self, pattern, seed=0, row_rate=0):
+    # Readouts generate this pattern instead of reading the CCD, TEST_PATTERN_OFF goes back to the sensor.
+    # row_rate paces them in rows per second, 0 is as fast as the firmware can.
+    return self._test_pattern_command(self.STRUCT_TEST_PATTERN.pack(pattern, seed, row_rate))
+
+  @staticmethod
+  def test_pattern(pattern, seed, rows, cols):
+    # What the firmware generates, see firmware/include/test_pattern.h
+    row = np.arange(rows, dtype=np.uint32)[:, None]
+    col = np.arange(cols, dtype=np.uint32)[None, :]
+    if pattern == DalsaTeensy.TEST_PATTERN_RAMP:
+      return (row * cols + col + seed).astype(np.uint16)
+    if pattern == DalsaTeensy.TEST_PATTERN_CHECKERBOARD:
+      return np.where(((row >> 3) + (col >> 3) + seed) & 1, 0xA5A5, 0x5A5A).astype(np.uint16)
+    if pattern == DalsaTeensy.TEST_PATTERN_PRNG:
+      x = (np.uint32(seed) + row[:, 0] * np.uint32(0x9E3779B9)) | np.uint32(1)
+      out = np.empty((rows, cols), dtype=np.uint16)
+      for c in range(cols):
+        x ^= x << np.uint32(13)
+        x ^= x >> np.uint32(17)
+        x ^= x << np.uint32(5)
+        out[:, c] = x
+      return out
+    return np.zeros((rows, cols), dtype=np.uint16)
 
   def start_readout(self, high_gain=False):
+    # Returns READOUT_STARTED, or READOUT_QUEUED if it starts once the current readout is done
     dat = self._command(0x03, b"\x01" if high_gain else b"\x00")
     assert len(dat) == 1, "Response does not match expected size"
-    if dat[0] != 0:
-      raise Exception("Failed to start readout, is another readout in progress?")
+    if dat[0] not in (self.READOUT_STARTED, self.READOUT_QUEUED):
+      raise Exception("Failed to start readout, is another readout already queued?")
+    return dat[0]
+
+  def abort_readout(self):
+    # Drops the frame being read out and a queued readout, EVENT_ERROR with ERROR_READOUT_ABORTED follows
+    self._command(0x12, b"")
+
+  def read_out_rows(self, high_gain=False):
+    # Starts a readout and yields (row_start, frame) for blocks of rows as the device finishes them, so they
+    # can be shown while the rest is still being read out. The last block is fetched once the frame is ready.
+    # Raises DalsaReadoutAborted when the readout gets aborted, after the blocks that came in before.
+    # Older firmware can't fetch the frame being read out, it then comes in one piece at the end
+    partial = self.get_capabilities()['capabilities'] & self.CAP_PARTIAL_FETCH
+    self.clear_events()
+    self.start_readout(high_gain)
+    deadline = time.monotonic() + self.READOUT_TIMEOUT
+
+    slot = None
+    rows_done = 0
+    while True:
+      event = self.wait_for_event((self.EVENT_READOUT_STARTED, self.EVENT_ROW_PROGRESS, self.EVENT_FRAME_READY, self.EVENT_ERROR),
+                                  self.READOUT_EVENT_TIMEOUT)
+      if event is None or event['dropped'] > 0:
+        # Events got lost or the readout went quiet, the slots tell where it stands
+        slots = self.get_slots()
+        if slot is None and event is not None:
+          # READOUT_STARTED may have been among them
+          slot = next((i for i, s in enumerate(slots) if s['state'] == 'reading'), None)
+        if slot is not None and slots[slot]['state'] in ('ready', 'transfer'):
+          yield rows_done, self.fetch(slot, row_start=rows_done)
+          return
+        if slot is not None and slots[slot]['state'] == 'free':
+          raise DalsaReadoutAborted()
+        if event is None:
+          if time.monotonic() > deadline:
+            raise Exception("Readout did not finish")
+          continue
+
+      if event['type'] == self.EVENT_READOUT_STARTED:
+        slot = event['arg0']
+        continue
+      if event['type'] == self.EVENT_ERROR:
+        if event['arg0'] == self.ERROR_READOUT_ABORTED:
+          raise DalsaReadoutAborted()
+        continue
+      if event['type'] == self.EVENT_FRAME_READY:
+        yield rows_done, self.fetch(event['arg0'], row_start=rows_done)
+        return
+
+      # Only the newest progress counts when fetching fell behind
+      rows = event['arg0']
+      while (event := self.wait_for_event(self.EVENT_ROW_PROGRESS, timeout=0)) is not None:
+        rows = max(rows, event['arg0'])
+      if partial and slot is not None and rows > rows_done:
+        yield rows_done, self.fetch(slot, row_start=rows_done, row_count=rows - rows_done)
+        rows_done = rows
+
+  @classmethod
+  def faxitron_state_name(cls, state):
+    # The character after "?S", also what EVENT_FAXITRON_STATE carries in arg0
+    return {'R': cls.FAXITRON_STATE_READY, 'D': cls.FAXITRON_STATE_DOOR_OPEN, 'W': cls.FAXITRON_STATE_WARMING_UP}.get(chr(state))
 
   def get_faxitron_state(self):
     dat = self._faxitron_serial_command(b"?S").decode()
     assert len(dat) == 3, "Response does not match expected size"
-    if dat == "?SR":
-      return self.FAXITRON_STATE_READY
-    elif dat == "?SD":
-      return self.FAXITRON_STATE_DOOR_OPEN
-    elif dat == "?SW":
-      return self.FAXITRON_STATE_WARMING_UP
-    print(dat)
-    return None
+    state = self.faxitron_state_name(ord(dat[2]))
+    if state is None:
+      print(dat)
+    return state
 
   def get_faxitron_exposure_time(self):
     dat = self._faxitron_serial_command(b"?T").decode()
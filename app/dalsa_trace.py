@@ -0,0 +1,135 @@
+#!/usr/bin/env python3
+
+import sys
+import json
+import time
+import argparse
+
+from dalsa_teensy import DalsaTeensy
+
+PHASE_INSTANT = 0
+PHASE_BEGIN = 1
+PHASE_END = 2
+PHASE_COUNTER = 3
+
+# id: (name, track, arg0 name, arg1 name), keep in sync with firmware/core_patches/dalsa_trace.h
+TRACE_EVENTS = {
+  0x01: ("usb frame", "usb", "len", None),
+  0x02: ("command", "usb", "command", "tag"),
+  0x03: ("bad frame", "usb", "status", "value"),
+  0x04: ("usb configured", "usb", "high_speed", None),
+  0x05: ("event dropped", "usb", "type", "arg0"),
+  0x06: ("bulk stream", "bulk", "aborted", None),
+  0x07: ("bulk chunk", "bulk", "len", "in_flight"),
+  0x10: ("readout", "readout", "slot", "high_gain"),
+  0x11: ("rows read", "readout", "rows", None),
+  0x12: ("rows processed", "pipeline", "rows", None),
+  0x13: ("frame crc", "pipeline", "slot", "crc"),
+  0x14: ("readout queued", "readout", "high_gain", None),
+  0x20: ("faxitron command", "faxitron", "command", "response_len"),
+  0x21: ("faxitron state", "faxitron", "state", None),
+  0x30: ("sd log record", "sd", "slot", "sequence"),
+  0x40: ("error", "errors", "error", "detail"),
+  0x41: ("dcp error", "errors", "channel", "status"),
+  0x42: ("dcp fallback", "errors", "crc", None),
+}
+
+# Ends of spans that report something else than their begin
+END_ARGS = {
+  0x01: ("response_len", None),
+  0x02: ("status", "response_len"),
+  0x10: ("slot", "rows"),
+  0x30: ("slot", "written"),
+}
+
+HOST_EVENTS = {
+  DalsaTeensy.EVENT_READOUT_STARTED: "readout started",
+  DalsaTeensy.EVENT_ROW_PROGRESS: "row progress",
+  DalsaTeensy.EVENT_FRAME_READY: "frame ready",
+  DalsaTeensy.EVENT_FAXITRON_STATE: "faxitron state",
+  DalsaTeensy.EVENT_ERROR: "error",
+}
+
+TRACKS = ("usb", "bulk", "readout", "pipeline", "faxitron", "sd", "errors", "events")
+
+class TraceDecoder:
+  # Turns drained trace entries and USB events, both stamped with the device micros(), into
+  # Chrome trace / Perfetto JSON. micros() wraps every 71 minutes, so timestamps are unwrapped
+  # against the previous one seen.
+  def __init__(self):
+    self.trace_events = [
+      {'name': 'thread_name', 'ph': 'M', 'pid': 0, 'tid': tid, 'args': {'name': track}}
+      for tid, track in enumerate(TRACKS)
+    ]
+    self.lost = 0
+    self._wraps = 0
+    self._last_us = None
+
+  def _unwrap(self, timestamp_us):
+    if self._last_us is not None and timestamp_us < self._last_us and self._last_us - timestamp_us > (1 << 31):
+      self._wraps += 1
+    self._last_us = timestamp_us
+    return timestamp_us + (self._wraps << 32)
+
+  def add_trace(self, trace):
+    self.lost += trace['lost']
+    if trace['lost'] > 0:
+      self.trace_events.append({'name': f"{trace['lost']} entries lost", 'ph': 'i', 's': 'g', 'pid': 0, 'tid': 0,
+                                'ts': self._unwrap(trace['entries'][0]['timestamp_us']) if trace['entries'] else 0})
+
+    for entry in trace['entries']:
+      name, track, arg0_name, arg1_name = TRACE_EVENTS.get(entry['id'], (f"0x{entry['id']:02x}", "errors", "arg0", "arg1"))
+      event = {'name': name, 'pid': 0, 'tid': TRACKS.index(track), 'ts': self._unwrap(entry['timestamp_us'])}
+      if entry['phase'] == PHASE_COUNTER:
+        event.update({'ph': 'C', 'args': {arg0_name: entry['arg0']}})
+      else:
+        event['ph'] = {PHASE_INSTANT: 'i', PHASE_BEGIN: 'B', PHASE_END: 'E'}[entry['phase']]
+        if event['ph'] == 'i':
+          event['s'] = 't'
+        elif event['ph'] == 'E':
+          arg0_name, arg1_name = END_ARGS.get(entry['id'], (arg0_name, arg1_name))
+        event['args'] = {k: v for k, v in ((arg0_name, entry['arg0']), (arg1_name, entry['arg1'])) if k is not None}
+      self.trace_events.append(event)
+
+  def add_event(self, event):
+    self.trace_events.append({
+      'name': HOST_EVENTS.get(event['type'], f"event 0x{event['type']:02x}"), 'ph': 'i', 's': 't', 'pid': 0,
+      'tid': TRACKS.index("events"), 'ts': self._unwrap(event['timestamp_us']),
+      'args': {'arg0': event['arg0'], 'arg1': event['arg1'], 'dropped': event['dropped']},
+    })
+
+  def to_json(self):
+    # Trace entries and events come in separately, the viewers want them in time order per track
+    return json.dumps({'traceEvents': sorted(self.trace_events, key=lambda e: e.get('ts', -1)), 'displayTimeUnit': 'ms'})
+
+if __name__ == "__main__":
+  parser = argparse.ArgumentParser(description="Record the firmware trace, open the output in ui.perfetto.dev or chrome://tracing")
+  parser.add_argument("--seconds", type=float, default=10)
+  parser.add_argument("--interval", type=float, default=0.2, help="seconds between drains, the ring holds 2048 entries")
+  parser.add_argument("--readout", action="store_true", help="start a readout at the beginning")
+  parser.add_argument("-o", "--output", default="trace.json")
+  args = parser.parse_args()
+
+  dalsa_teensy = DalsaTeensy()
+  dalsa_teensy.ping()
+  if not dalsa_teensy.get_capabilities()['capabilities'] & DalsaTeensy.CAP_TRACE:
+    sys.exit("Firmware has no trace support")
+
+  decoder = TraceDecoder()
+  events = []
+  dalsa_teensy.add_event_callback(events.append)
+  if args.readout:
+    dalsa_teensy.start_readout(True)
+
+  deadline = time.monotonic() + args.seconds
+  while time.monotonic() < deadline:
+    decoder.add_trace(dalsa_teensy.read_trace())
+    time.sleep(args.interval)
+  decoder.add_trace(dalsa_teensy.read_trace())
+  dalsa_teensy.remove_event_callback(events.append)
+  for event in events:
+    decoder.add_event(event)
+
+  with open(args.output, "w") as f:
+    f.write(decoder.to_json())
+  print(f"{len(decoder.trace_events)} trace events written to {args.output}, {decoder.lost} entries lost")
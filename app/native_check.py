@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+
+# Checks the native master builder and stacking from host/ on synthetic dark frames, like
+# host/tools/correct_bench does for the correction: the AVX2 and scalar paths have to agree exactly, and both
+# have to match the numpy fallback in dalsa_native to within float32 rounding. Exits non-zero on a mismatch.
+
+import os
+import sys
+import time
+import argparse
+import numpy as np
+
+import dalsa_native
+
+ROWS = 1024 + 18
+COLS = 1024 + 8
+NUMPY_TOLERANCE = 0.01 # DN, the numpy fallback rounds a few steps differently
+
+def synthetic_frames(count, rows, cols, seed):
+  # A fixed pattern with read noise, and a few X-ray hits per frame for the clipping to throw out
+  rng = np.random.default_rng(seed)
+  level = rng.normal(900, 40, (rows, cols))
+  frames = []
+  for _ in range(count):
+    frame = level + rng.normal(0, 12, (rows, cols))
+    hits = rng.integers(0, frame.size, frame.size // 2000)
+    frame.ravel()[hits] += rng.uniform(2000, 20000, hits.size)
+    frames.append(np.clip(np.rint(frame), 0, 0xFFFF).astype(np.uint16))
+  return frames
+
+def run(make, frames, get, avx2=True):
+  # get(obj) after adding all frames, and the time per frame in ms. DALSA_NO_AVX2 is read on every add.
+  if not avx2:
+    os.environ["DALSA_NO_AVX2"] = "1"
+  try:
+    obj = make()
+    start = time.monotonic()
+    for frame in frames:
+      obj.add(frame)
+    elapsed = time.monotonic() - start
+    return get(obj), elapsed / len(frames) * 1000
+  finally:
+    os.environ.pop("DALSA_NO_AVX2", None)
+
+def compare(name, results, numpy_result, ms):
+  # results are the native {label: [arrays]}, all of them are checked against numpy_result
+  failures = 0
+  labels = list(results)
+  for label in labels[1:]:
+    same = all(np.array_equal(a, b) for a, b in zip(results[labels[0]], results[label]))
+    failures += not same
+    print(f"  {name}, {label} vs {labels[0]}: {'identical' if same else 'MISMATCH'}")
+  for label in labels:
+    diff = max(float(np.abs(a.astype(np.float64) - b).max()) for a, b in zip(results[label], numpy_result))
+    failures += diff > NUMPY_TOLERANCE
+    print(f"  {name}, {label} vs numpy: max difference {diff:.5f}{'' if diff <= NUMPY_TOLERANCE else '  MISMATCH'}")
+  print("  " + ", ".join(f"{label} {t:.2f} ms" for label, t in ms.items()) + " per frame")
+  return failures
+
+def check_master(frames):
+  shape = frames[0].shape
+  get = lambda m: [m.get(kind) for kind in (dalsa_native.MASTER_MEAN, dalsa_native.MASTER_CLIPPED, dalsa_native.MASTER_MEDIAN, dalsa_native.MASTER_SIGMA)]
+  results, ms = {}, {}
+  results['avx2'], ms['avx2'] = run(lambda: dalsa_native.MasterBuilder(shape), frames, get)
+  results['scalar'], ms['scalar'] = run(lambda: dalsa_native.MasterBuilder(shape), frames, get, avx2=False)
+  numpy_result, ms['numpy'] = run(lambda: dalsa_native._MasterNumpy(shape, 3.0, 5), frames, get)
+  return compare("master", results, numpy_result, ms)
+
+def check_stack(frames, rejection):
+  # Without the library dalsa_native.Stack is the numpy fallback, swapped in for the reference run
+  shape = frames[0].shape
+  get = lambda s: [s.get()]
+  results, ms = {}, {}
+  results['avx2'], ms['avx2'] = run(lambda: dalsa_native.Stack(shape, rejection), frames, get)
+  results['scalar'], ms['scalar'] = run(lambda: dalsa_native.Stack(shape, rejection), frames, get, avx2=False)
+  lib, dalsa_native._lib = dalsa_native._lib, None
+  try:
+    numpy_result, ms['numpy'] = run(lambda: dalsa_native.Stack(shape, rejection), frames, get)
+  finally:
+    dalsa_native._lib = lib
+  return compare(f"stack ({dalsa_native.STACK_REJECTIONS[rejection]})", results, numpy_result, ms)
+
+if __name__ == "__main__":
+  parser = argparse.ArgumentParser(description="Check the native master builder and stacking against their scalar paths and numpy")
+  parser.add_argument("--frames", type=int, default=20)
+  parser.add_argument("--rows", type=int, default=ROWS)
+  parser.add_argument("--cols", type=int, default=COLS)
+  parser.add_argument("--seed", type=int, default=1234)
+  args = parser.parse_args()
+
+  if dalsa_native._lib is None:
+    sys.exit("libdalsa.so not found, build host/ first")
+  frames = synthetic_frames(args.frames, args.rows, args.cols, args.seed)
+  print(f"{args.cols} x {args.rows} frames, {args.frames} of them")
+  failures = check_master(frames)
+  for rejection in range(len(dalsa_native.STACK_REJECTIONS)):
+    failures += check_stack(frames, rejection)
+  sys.exit(failures != 0)
@@ -0,0 +1,268 @@
+#!/usr/bin/env python3
+
+import os
+import json
+import time
+import argparse
+import numpy as np
+from queue import Queue
+from threading import Thread, Semaphore
+
+import dalsa_native
+from dalsa_teensy import DalsaTeensy
+
+# A plan is JSON (or YAML, with PyYAML installed) like
+#
+#   {"output": "calibration", "high_gain": true, "steps": [
+#     {"type": "dark", "exposure": 2.0, "frames": 16},
+#     {"type": "flat", "kv": 25, "exposure": 2.0, "frames": 16},
+#     {"type": "exposure", "name": "sweep", "kv": [15, 20, 25, 30], "exposure": [1.0, 2.0]}]}
+#
+# Lists of kV and/or exposure make a sweep, one shot per combination and `frames` (default 1) frames per shot.
+# kV or exposure left out keep whatever the Faxitron is set to. Darks aren't fired, their exposure is how long
+# the sensor integrates after the previous readout. Darks and flats of the same name and settings are also
+# streamed into a master (sigma-clipped mean) and defect list, "save": false skips the individual frames.
+
+class Sequencer:
+  # Runs a plan in three stages side by side: the cabinet stage sets up the Faxitron, exposes and reads out,
+  # the transfer stage fetches finished frames and the processing stage saves them. The next shot's settings
+  # go over the 9600 baud link while the current frame is read out, frames are fetched and saved while the
+  # next one is being exposed.
+  STEP_TYPES = ('exposure', 'dark', 'flat')
+  READOUT_TIMEOUT = 60
+  TIMING_KEYS = ('settings_s', 'exposure_s', 'slot_wait_s', 'readout_s', 'transfer_s', 'process_s')
+  # Darks show hot and noisy pixels, flats dead ones and those that respond far too strongly
+  DEFECTS = {
+    'dark': {'hot_sigma': 6.0, 'dead_fraction': 0.0, 'noisy_factor': 4.0},
+    'flat': {'hot_sigma': 6.0, 'dead_fraction': 0.5, 'noisy_factor': 0.0},
+  }
+
+  def __init__(self, dalsa_teensy, plan, output=None):
+    self.dalsa_teensy = dalsa_teensy
+    self.plan = plan
+    self.output = output if output is not None else plan.get('output', 'sequence')
+    self.shots = self.expand(plan)
+    self.log = [None] * len(self.shots)
+    self.masters = {} # Master file name to (type, MasterBuilder)
+    self.kv = None
+    self.exposure = None
+
+  @staticmethod
+  def load(path):
+    with open(path) as f:
+      if path.endswith(('.yaml', '.yml')):
+        import yaml
+        return yaml.safe_load(f)
+      return json.load(f)
+
+  @classmethod
+  def expand(cls, plan):
+    def values(v):
+      return [None] if v is None else (list(v) if isinstance(v, (list, tuple)) else [v])
+
+    shots = []
+    for i, step in enumerate(plan['steps']):
+      kind = step.get('type', 'exposure')
+      assert kind in cls.STEP_TYPES, f"Unknown step type: {kind}"
+      for kv in values(None if kind == 'dark' else step.get('kv')):
+        for exposure in values(step.get('exposure')):
+          for _ in range(step.get('frames', 1)):
+            shots.append({
+              'step': i,
+              'type': kind,
+              'name': step.get('name', kind),
+              'kv': kv,
+              'exposure': None if exposure is None else round(exposure, 1),
+              'high_gain': step.get('high_gain', plan.get('high_gain', True)),
+              'save': step.get('save', True),
+            })
+    return shots
+
+  def file_name(self, index, shot):
+    name = shot['name'] if index is None else f"{index:04d}_{shot['name']}"
+    if shot['kv'] is not None:
+      name += f"_{shot['kv']}kV"
+    if shot['exposure'] is not None:
+      name += f"_{shot['exposure']}s"
+    return os.path.join(self.output, name + ".npy")
+
+  def _apply_settings(self, shot):
+    # Only what changed goes out, every setting is a round trip over the serial link
+    start = time.monotonic()
+    if shot['kv'] is not None and shot['kv'] != self.kv:
+      self.dalsa_teensy.set_faxitron_voltage(shot['kv'])
+      self.kv = shot['kv']
+    if shot['type'] != 'dark' and shot['exposure'] is not None and shot['exposure'] != self.exposure:
+      self.dalsa_teensy.set_faxitron_exposure_time(shot['exposure'])
+      self.exposure = shot['exposure']
+    return time.monotonic() - start
+
+  def _read_out(self, high_gain):
+    self.dalsa_teensy.start_readout(high_gain)
+    return self._wait_ready()
+
+  def _wait_ready(self):
+    while True:
+      event = self.dalsa_teensy.wait_for_event((DalsaTeensy.EVENT_FRAME_READY, DalsaTeensy.EVENT_ERROR), self.READOUT_TIMEOUT)
+      if event is None:
+        raise Exception("Frame never became ready")
+      if event['type'] == DalsaTeensy.EVENT_FRAME_READY:
+        return event
+      if event['arg0'] == DalsaTeensy.ERROR_READOUT_ABORTED:
+        raise Exception("Readout was aborted")
+
+  def _transfer(self, ready, fetched, credits):
+    while (item := ready.get()) is not None:
+      index, slot, crc, timing = item
+      start = time.monotonic()
+      frame = None
+      try:
+        frame = self.dalsa_teensy.fetch(slot)
+        # Also catches the slot having been read out again before it was fetched
+        if frame.header.frame_crc_valid and frame.header.frame_crc != crc:
+          raise Exception("Fetched frame is not the one that was read out")
+      except Exception as e:
+        frame = None
+        timing['error'] = str(e)
+      finally:
+        credits.release()
+      timing['transfer_s'] = time.monotonic() - start
+      fetched.put((index, frame, timing))
+    fetched.put(None)
+
+  def process(self, index, shot, frame):
+    # Runs on the processing stage, returns what goes into the log for this frame
+    entry = {}
+    if shot['save']:
+      path = self.file_name(index, shot)
+      np.save(path, frame.pixels)
+      entry['file'] = os.path.basename(path)
+    if shot['type'] in self.DEFECTS:
+      master = "master_" + os.path.basename(self.file_name(None, shot))
+      if master not in self.masters:
+        self.masters[master] = (shot['type'], dalsa_native.MasterBuilder(frame.pixels.shape))
+      self.masters[master][1].add(frame.pixels)
+      entry['master'] = master
+    h = frame.header
+    return entry | {
+      'sequence': h.sequence,
+      'faxitron_kv': h.faxitron_kv,
+      'faxitron_exposure_s': h.faxitron_exposure_ds / 10,
+      'readout_start_ms': h.readout_start_ms,
+      'readout_us': h.readout_end_us - h.readout_start_us,
+    }
+
+  def _process(self, fetched, progress):
+    while (item := fetched.get()) is not None:
+      index, frame, timing = item
+      shot = self.shots[index]
+      start = time.monotonic()
+      entry = dict(shot)
+      if frame is not None:
+        try:
+          entry.update(self.process(index, shot, frame))
+        except Exception as e:
+          timing['error'] = str(e)
+      timing['process_s'] = time.monotonic() - start
+      entry['timing'] = timing
+      self.log[index] = entry
+      if 'error' in timing:
+        progress(f"Frame {index + 1}/{len(self.shots)} failed: {timing['error']}")
+
+  def summary(self, wall_s):
+    # Per step totals of each stage, and what running the stages back to back would have taken
+    entries = [e for e in self.log if e is not None]
+    steps = []
+    for i in sorted(set(e['step'] for e in entries)):
+      timings = [e['timing'] for e in entries if e['step'] == i]
+      step = {key: sum(t.get(key, 0) for t in timings) for key in self.TIMING_KEYS}
+      step.update({'step': i, 'frames': len(timings), 'failed': sum('error' in t for t in timings)})
+      steps.append(step)
+    return {
+      'frames': len(entries),
+      'failed': sum(s['failed'] for s in steps),
+      'wall_s': wall_s,
+      'serial_s': sum(s[key] for s in steps for key in self.TIMING_KEYS),
+      'steps': steps,
+    }
+
+  def run(self, progress=print):
+    os.makedirs(self.output, exist_ok=True)
+    self.kv = self.dalsa_teensy.get_faxitron_voltage()
+    self.exposure = self.dalsa_teensy.get_faxitron_exposure_time()
+
+    # A readout overwrites the oldest frame that isn't being fetched, so at most slots - 1 may wait to be
+    credits = Semaphore(max(1, len(self.dalsa_teensy.get_slots()) - 1))
+    ready = Queue()
+    fetched = Queue()
+    stages = [Thread(target=self._transfer, args=(ready, fetched, credits)), Thread(target=self._process, args=(fetched, progress))]
+    for stage in stages:
+      stage.start()
+
+    start = time.monotonic()
+    try:
+      self.dalsa_teensy.clear_events()
+      last_ready = None
+      settings_s = self._apply_settings(self.shots[0]) if len(self.shots) > 0 else 0
+      for i, shot in enumerate(self.shots):
+        timing = {'settings_s': settings_s}
+        t = time.monotonic()
+        if shot['type'] == 'dark':
+          if last_ready is None:
+            # Clears the charge the sensor has been collecting since who knows when
+            with credits:
+              self._read_out(shot['high_gain'])
+            last_ready = time.monotonic()
+          time.sleep(max(0, (shot['exposure'] or 0) - (time.monotonic() - last_ready)))
+        else:
+          progress(f"Frame {i + 1}/{len(self.shots)}: exposing {self.exposure}s at {self.kv} kV")
+          self.dalsa_teensy.perform_faxitron_exposure()
+        timing['exposure_s'] = time.monotonic() - t
+
+        t = time.monotonic()
+        credits.acquire()
+        timing['slot_wait_s'] = time.monotonic() - t
+
+        t = time.monotonic()
+        self.dalsa_teensy.start_readout(shot['high_gain'])
+        settings_s = self._apply_settings(self.shots[i + 1]) if i + 1 < len(self.shots) else 0
+        try:
+          event = self._wait_ready()
+        except Exception:
+          credits.release()
+          raise
+        last_ready = time.monotonic()
+        timing['readout_s'] = last_ready - t
+        ready.put((i, event['arg0'], event['arg1'], timing))
+    finally:
+      ready.put(None)
+      for stage in stages:
+        stage.join()
+
+    for name, (kind, builder) in self.masters.items():
+      np.save(os.path.join(self.output, name), builder.get(dalsa_native.MASTER_CLIPPED))
+      _, bad_pixels = builder.defects(**self.DEFECTS[kind])
+      np.save(os.path.join(self.output, name.replace("master_", "defects_")), bad_pixels)
+      progress(f"{name}: {builder.frames} frames, {len(bad_pixels)} defects")
+
+    summary = self.summary(time.monotonic() - start)
+    with open(os.path.join(self.output, "sequence.json"), "w") as f:
+      json.dump({'plan': self.plan, 'summary': summary, 'frames': [e for e in self.log if e is not None]}, f, indent=2)
+    progress(f"{summary['frames']} frames ({summary['failed']} failed) in {summary['wall_s']:.1f}s, {summary['serial_s']:.1f}s back to back")
+    return summary
+
+if __name__ == "__main__":
+  parser = argparse.ArgumentParser(description="Runs an acquisition plan of exposures, darks and flats")
+  parser.add_argument("plan", help="JSON or YAML plan")
+  parser.add_argument("--output", help="directory for the frames and sequence.json, overrides the plan's")
+  parser.add_argument("--list", action="store_true", help="only list the shots of the plan")
+  args = parser.parse_args()
+
+  plan = Sequencer.load(args.plan)
+  if args.list:
+    for i, shot in enumerate(Sequencer.expand(plan)):
+      print(f"{i:>4} step {shot['step']:>2} {shot['type']:>8} {str(shot['kv']):>4} kV {str(shot['exposure']):>5} s")
+  else:
+    dalsa_teensy = DalsaTeensy()
+    dalsa_teensy.ping()
+    Sequencer(dalsa_teensy, plan, args.output).run()
@@ -0,0 +1,47 @@
+#!/usr/bin/env python3
+
+import argparse
+
+from dalsa_teensy import DalsaTeensy
+
+# (pixel timer, USB) NVIC priorities to compare, the firmware default comes first
+PRIORITIES = ((16, 128), (128, 128), (128, 16))
+CPU_MHZ = 600 # Teensy 4.1 default clock
+
+if __name__ == "__main__":
+  parser = argparse.ArgumentParser(description="Reads out frames under bulk load with different interrupt priorities")
+  parser.add_argument("--stream-mb", type=int, default=256, help="bulk data pulled during each readout")
+  parser.add_argument("--no-stress", action="store_true", help="plain readouts, for a baseline")
+  parser.add_argument("--profiles", default=",".join(DalsaTeensy.PROFILE_NAMES), help="readout profiles to measure, binned ones load the pixel ISR differently")
+  args = parser.parse_args()
+
+  dalsa_teensy = DalsaTeensy()
+  dalsa_teensy.ping()
+  if not dalsa_teensy.get_capabilities()['capabilities'] & DalsaTeensy.CAP_TIMING:
+    raise Exception("Firmware has no timing support")
+
+  previous, _ = dalsa_teensy.get_readout_profiles()
+  dalsa_teensy.set_timing_sampling(True)
+  print(f"{'profile':>8} {'pixel':>5} {'usb':>5} {'edges':>9} {'late':>7} {'dropped':>7} {'jitter ns':>15} {'nak %':>6} {'stall':>5} {'MB/s':>6}")
+  try:
+    for profile in args.profiles.split(","):
+      dalsa_teensy.set_readout_profile(profile)
+      for pixel_priority, usb_priority in PRIORITIES:
+        dalsa_teensy.set_irq_priorities(pixel_priority, usb_priority)
+        if args.no_stress:
+          dalsa_teensy.clear_events()
+          dalsa_teensy.start_readout(True)
+          dalsa_teensy.wait_for_event(DalsaTeensy.EVENT_FRAME_READY, 60)
+          stats = dalsa_teensy.get_timing_stats()
+          stats['host_mb_s'] = 0
+        else:
+          stats = dalsa_teensy.run_timing_stress(args.stream_mb << 20)
+
+        jitter = f"{stats['jitter_min_cycles'] * 1000 / CPU_MHZ:.0f}..{stats['jitter_max_cycles'] * 1000 / CPU_MHZ:.0f}"
+        nak = 100 * stats['nak_samples'] / max(stats['edges'], 1)
+        print(f"{profile:>8} {pixel_priority:>5} {usb_priority:>5} {stats['edges']:>9} {stats['late_edges']:>7} {stats['dropped_edges']:>7} "
+              f"{jitter:>15} {nak:>6.2f} {stats['stall_samples']:>5} {stats['host_mb_s']:>6.1f}")
+  finally:
+    dalsa_teensy.set_irq_priorities(*PRIORITIES[0])
+    dalsa_teensy.set_timing_sampling(False)
+    dalsa_teensy.set_readout_profile(previous)
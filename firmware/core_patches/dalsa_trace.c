@@ -0,0 +1,56 @@
+#include "dalsa_trace.h"
+#include "imxrt.h"
+#include "core_pins.h" // for micros()
+#include <string.h>
+
+#define TRACE_NUM 2048 // power of two, 32 KB
+
+static dalsa_trace_t trace_ring[TRACE_NUM];
+static volatile uint32_t trace_head = 0; // next stream position to hand out
+static uint32_t trace_tail = 0;          // next position the reader wants
+
+void dalsa_trace(uint8_t id, uint8_t phase, uint32_t arg0, uint32_t arg1) {
+  // Claiming a position is the only shared step, an interrupting writer simply gets the next one
+  uint32_t position = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+  dalsa_trace_t *entry = &trace_ring[position & (TRACE_NUM - 1)];
+  entry->timestamp_us = micros();
+  entry->id = id;
+  entry->phase = phase;
+  entry->arg0 = arg0;
+  entry->arg1 = arg1;
+  __atomic_store_n(&entry->index, (uint16_t) position, __ATOMIC_RELEASE);
+}
+
+uint32_t dalsa_trace_read(dalsa_trace_t *dst, uint32_t max, uint32_t *first, uint32_t *lost) {
+  uint32_t head = trace_head;
+  *lost = 0;
+  if (head - trace_tail > TRACE_NUM) {
+    *lost = head - trace_tail - TRACE_NUM;
+    trace_tail = head - TRACE_NUM;
+  }
+
+  uint32_t count = 0;
+  while (count < max && trace_tail + count != head) {
+    uint32_t position = trace_tail + count;
+    dalsa_trace_t *entry = &trace_ring[position & (TRACE_NUM - 1)];
+    // A writer we interrupted hasn't finished this one yet, it goes out with the next read
+    if (__atomic_load_n(&entry->index, __ATOMIC_ACQUIRE) != (uint16_t) position) {
+      break;
+    }
+    memcpy(&dst[count], entry, sizeof(dalsa_trace_t));
+    count++;
+  }
+
+  // Writers may have lapped the ring while copying, whatever they reached is garbage
+  uint32_t overwritten = trace_head - TRACE_NUM;
+  *first = trace_tail;
+  if ((int32_t) (overwritten - trace_tail) > 0) {
+    uint32_t skip = overwritten - trace_tail < count ? overwritten - trace_tail : count;
+    memmove(dst, &dst[skip], (count - skip) * sizeof(dalsa_trace_t));
+    count -= skip;
+    *lost += skip;
+    *first += skip;
+  }
+  trace_tail = *first + count;
+  return count;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdint.h>
+
+// Binary trace of what the firmware is doing, cheap enough to record from any ISR.
+// Entries go into a RAM ring that overwrites the oldest ones, the host drains it over USB and
+// turns it into a timeline (app/dalsa_trace.py).
+
+#define DALSA_TRACE_INSTANT 0
+#define DALSA_TRACE_BEGIN 1
+#define DALSA_TRACE_END 2
+#define DALSA_TRACE_COUNTER 3
+
+// Event IDs, keep in sync with TRACE_EVENTS in app/dalsa_trace.py
+#define TRACE_USB_FRAME 0x01        // arg0: command frame length
+#define TRACE_USB_COMMAND 0x02      // arg0: command, arg1: tag
+#define TRACE_USB_BAD_FRAME 0x03    // arg0: status, arg1: offending value
+#define TRACE_USB_CONFIGURED 0x04   // arg0: high speed
+#define TRACE_EVENT_DROPPED 0x05    // arg0: event type
+#define TRACE_BULK_STREAM 0x06      // bulk stream running
+#define TRACE_BULK_CHUNK 0x07       // arg0: chunk length, arg1: chunks in flight
+#define TRACE_READOUT 0x10          // arg0: slot, arg1: high gain
+#define TRACE_ROWS_READ 0x11        // counter, arg0: rows read out
+#define TRACE_ROWS_PROCESSED 0x12   // counter, arg0: rows through the correction pipeline
+#define TRACE_FRAME_CRC 0x13        // arg0: slot, arg1: CRC on end
+#define TRACE_READOUT_QUEUED 0x14   // arg0: high gain
+#define TRACE_FAXITRON_COMMAND 0x20 // arg0: first two command bytes, arg1: response length
+#define TRACE_FAXITRON_STATE 0x21   // arg0: state character
+#define TRACE_SD_LOG_RECORD 0x30    // arg0: slot, arg1: frame sequence
+#define TRACE_ERROR 0x40            // arg0: error code, arg1: detail
+#define TRACE_DCP_ERROR 0x41        // arg0: channel, arg1: channel status
+#define TRACE_DCP_FALLBACK 0x42     // arg0: CRC the self-test got
+
+typedef struct __attribute__((__packed__)) {
+  uint32_t timestamp_us;
+  uint8_t id;
+  uint8_t phase;
+  uint16_t index; // low bits of the entry's position in the stream, written last
+  uint32_t arg0;
+  uint32_t arg1;
+} dalsa_trace_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+  // Can be called from any context, including the pixel timer ISR
+  void dalsa_trace(uint8_t id, uint8_t phase, uint32_t arg0, uint32_t arg1);
+
+  // Single reader. Copies up to max entries from the oldest unread one on and returns how many were copied.
+  // *first is the stream position of the first one, *lost counts entries overwritten before they were read.
+  uint32_t dalsa_trace_read(dalsa_trace_t *dst, uint32_t max, uint32_t *first, uint32_t *lost);
+#ifdef __cplusplus
+}
+#endif
+
+#define TRACE_INSTANT(id, arg0, arg1) dalsa_trace((id), DALSA_TRACE_INSTANT, (arg0), (arg1))
+#define TRACE_BEGIN(id, arg0, arg1) dalsa_trace((id), DALSA_TRACE_BEGIN, (arg0), (arg1))
+#define TRACE_END(id, arg0, arg1) dalsa_trace((id), DALSA_TRACE_END, (arg0), (arg1))
+#define TRACE_COUNTER(id, value) dalsa_trace((id), DALSA_TRACE_COUNTER, (value), 0)
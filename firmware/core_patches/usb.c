@@ -880,6 +880,23 @@ void usb_receive(int endpoint_number, transfer_t *transfer) {
   schedule_transfer(endpoint, mask, transfer);
 }
 
+// Cancels every transfer queued on a transmit endpoint, their callbacks won't run
+void usb_flush_transmit(int endpoint_number) {
+  if (endpoint_number < 2 || endpoint_number > NUM_ENDPOINTS) return;
+  endpoint_t *endpoint = endpoint_queue_head + endpoint_number * 2 + 1;
+  uint32_t mask = 1 << (endpoint_number + 16);
+  __disable_irq();
+  do {
+    USB1_ENDPTFLUSH = mask;
+    while (USB1_ENDPTFLUSH & mask) ;
+  } while (USB1_ENDPTSTATUS & mask);
+  endpoint->next = 1;
+  endpoint->status = 0;
+  endpoint->first_transfer = NULL;
+  endpoint->last_transfer = NULL;
+  __enable_irq();
+}
+
 uint32_t usb_transfer_status(const transfer_t *transfer) {
 #if defined(USB_MTPDISK) || defined(USB_MTPDISK_SERIAL)
   uint32_t status, cmd;
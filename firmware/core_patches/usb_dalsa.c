@@ -1,102 +1,311 @@
 #include "usb_dev.h"
 #include "usb_serial.h"
-#include "debug/printf.h"
+#include "usb_dalsa.h"
+#include "dalsa_trace.h"
 #include "avr/pgmspace.h" // for PROGMEM, DMAMEM, FASTRUN
+#include "core_pins.h" // for micros()
 #include <string.h>
 
 #define RX_NUM  8
-#define DALSA_RX_SIZE 64
+#define DALSA_RX_SIZE_480 512
+#define DALSA_RX_SIZE_12 64
+#define DALSA_TX_SIZE 16384 // 4K aligned, so a single transfer descriptor covers a whole response frame
 
+static uint16_t rx_packet_size = 0;
 static uint16_t tx_packet_size = 0;
 static transfer_t tx_transfer[RX_NUM] __attribute__ ((used, aligned(32)));
 static transfer_t rx_transfer[RX_NUM] __attribute__ ((used, aligned(32)));
-DMAMEM static uint8_t rx_buffer[RX_NUM][DALSA_RX_SIZE] __attribute__ ((aligned(32)));
+DMAMEM static uint8_t rx_buffer[RX_NUM][DALSA_RX_SIZE_480] __attribute__ ((aligned(32)));
+DMAMEM static uint8_t tx_buffer[RX_NUM][DALSA_TX_SIZE] __attribute__ ((aligned(4096)));
 extern volatile uint8_t usb_high_speed;
 
-uint32_t (*control_handler)(uint8_t *control_data, uint32_t len, uint8_t *return_data, uint32_t max_return_len) = NULL;
+uint32_t (*control_handler)(control_req_t *req, uint8_t *return_data, uint32_t max_return_len, uint8_t *status) = NULL;
 
 static void rx_queue_transfer(int i) {
-	NVIC_DISABLE_IRQ(IRQ_USB1);
-	usb_prepare_transfer(&rx_transfer[i], &rx_buffer[i], DALSA_RX_SIZE, i);
-	arm_dcache_delete(&rx_buffer[i], DALSA_RX_SIZE);
-	usb_receive(DALSA_RX_ENDPOINT, &rx_transfer[i]);
-	NVIC_ENABLE_IRQ(IRQ_USB1);
+  NVIC_DISABLE_IRQ(IRQ_USB1);
+  usb_prepare_transfer(&rx_transfer[i], &rx_buffer[i], rx_packet_size, i);
+  arm_dcache_delete(&rx_buffer[i], rx_packet_size);
+  usb_receive(DALSA_RX_ENDPOINT, &rx_transfer[i]);
+  NVIC_ENABLE_IRQ(IRQ_USB1);
 }
 
-DMAMEM static uint8_t return_data[512] __attribute__ ((aligned(32)));
-static void rx_event(transfer_t *t) {
-	int len = DALSA_RX_SIZE - ((t->status >> 16) & 0x7FFF);
-	int i = t->callback_param;
-
-  uint32_t return_len = 0;
-  if(control_handler != NULL) {
-    return_len = control_handler(rx_buffer[i], len, &return_data[4], tx_packet_size - 4);
-    if (return_len > tx_packet_size - 4) {
-      printf("return_len > tx_packet_size\n");
-      return_len = tx_packet_size - 4;
+// Number of responses a command frame gets: one per request, up to and including the first malformed one
+static uint32_t count_requests(uint8_t *frame, uint32_t len) {
+  uint32_t offset = 0;
+  uint32_t count = 0;
+  while (offset < len) {
+    control_req_t *req = (control_req_t *) &frame[offset];
+    count++;
+    if (len - offset < sizeof(control_req_t) || req->version != DALSA_PROTOCOL_VERSION ||
+        req->data_len > len - offset - sizeof(control_req_t)) {
+      break;
     }
-    memcpy(return_data, &return_len, sizeof(uint32_t));
-  } else {
-    return_data[0] = 0x00;
-    return_len = 1;
-    printf("control_handler == NULL\n");
+    offset += sizeof(control_req_t) + req->data_len;
+  }
+  return count;
+}
+
+// Runs every request in a command frame, appending the responses to `out`. Returns the response frame length.
+// The headers of all responses are reserved up front, so every request is answered, with RESPONSE_OVERFLOW
+// once the data of the earlier ones has filled the frame.
+static uint32_t handle_frame(uint8_t *frame, uint32_t len, uint8_t *out) {
+  uint32_t offset = 0;
+  uint32_t out_len = 0;
+  uint32_t remaining = count_requests(frame, len);
+
+  // A receive buffer holds at most DALSA_RX_SIZE_480 / sizeof(control_req_t) requests, their headers always fit
+  while (remaining > 0) {
+    control_req_t *req = (control_req_t *) &frame[offset];
+    control_resp_t *resp = (control_resp_t *) &out[out_len];
+    uint32_t max_return_len = DALSA_TX_SIZE - out_len - remaining * sizeof(control_resp_t);
+    remaining--;
+
+    resp->version = DALSA_PROTOCOL_VERSION;
+    resp->status = DALSA_STATUS_OK;
+    resp->tag = 0;
+    resp->data_len = 0;
+    out_len += sizeof(control_resp_t);
+
+    // The rest of the frame can't be trusted after a malformed request, so stop parsing there
+    if (len - offset < sizeof(control_req_t)) {
+      TRACE_INSTANT(TRACE_USB_BAD_FRAME, DALSA_STATUS_INVALID_LENGTH, len - offset);
+      resp->status = DALSA_STATUS_INVALID_LENGTH;
+      break;
+    }
+    resp->tag = req->tag;
+    if (req->version != DALSA_PROTOCOL_VERSION) {
+      TRACE_INSTANT(TRACE_USB_BAD_FRAME, DALSA_STATUS_INVALID_VERSION, req->version);
+      resp->status = DALSA_STATUS_INVALID_VERSION;
+      break;
+    }
+    if (req->data_len > len - offset - sizeof(control_req_t)) {
+      TRACE_INSTANT(TRACE_USB_BAD_FRAME, DALSA_STATUS_INVALID_LENGTH, req->data_len);
+      resp->status = DALSA_STATUS_INVALID_LENGTH;
+      break;
+    }
+
+    if (control_handler != NULL) {
+      uint8_t status = DALSA_STATUS_OK;
+      TRACE_BEGIN(TRACE_USB_COMMAND, req->command, req->tag);
+      uint32_t return_len = control_handler(req, resp->data, max_return_len, &status);
+      TRACE_END(TRACE_USB_COMMAND, status, return_len);
+      if (return_len > max_return_len) {
+        TRACE_INSTANT(TRACE_USB_BAD_FRAME, DALSA_STATUS_RESPONSE_OVERFLOW, return_len);
+        return_len = max_return_len;
+        status = DALSA_STATUS_RESPONSE_OVERFLOW;
+      }
+      resp->status = status;
+      resp->data_len = return_len;
+      out_len += return_len;
+    } else {
+      resp->status = DALSA_STATUS_NO_HANDLER;
+      TRACE_INSTANT(TRACE_USB_BAD_FRAME, DALSA_STATUS_NO_HANDLER, req->command);
+    }
+
+    offset += sizeof(control_req_t) + req->data_len;
   }
 
-  // queue response transfer
+  return out_len;
+}
+
+static void rx_event(transfer_t *t) {
+  int len = rx_packet_size - ((t->status >> 16) & 0x7FFF);
+  int i = t->callback_param;
+
+  TRACE_BEGIN(TRACE_USB_FRAME, len, 0);
+  uint32_t return_len = handle_frame(rx_buffer[i], len, tx_buffer[i]);
+  TRACE_END(TRACE_USB_FRAME, return_len, 0);
+
+  // queue response transfer, the rx buffer gets put back in once it has been sent
   NVIC_DISABLE_IRQ(IRQ_USB1);
-  usb_prepare_transfer(&tx_transfer[i], return_data, return_len + 4, 0);
-  arm_dcache_flush_delete(return_data, return_len + 4);
+  usb_prepare_transfer(&tx_transfer[i], tx_buffer[i], return_len, i);
+  arm_dcache_flush_delete(tx_buffer[i], return_len);
   usb_transmit(DALSA_TX_ENDPOINT, &tx_transfer[i]);
   NVIC_ENABLE_IRQ(IRQ_USB1);
+}
 
-  // Put buffer back in
-  rx_queue_transfer(i);
+static void tx_event(transfer_t *t) {
+  // Response is out, so this slot can take a new command frame
+  rx_queue_transfer(t->callback_param);
 }
 
-void usb_dalsa_set_handler(uint32_t (*handler)(uint8_t *control_data, uint32_t len, uint8_t *return_data, uint32_t max_return_len)) {
+void usb_dalsa_set_handler(uint32_t (*handler)(control_req_t *req, uint8_t *return_data, uint32_t max_return_len, uint8_t *status)) {
   control_handler = handler;
 }
 
-static transfer_t bulk_transfer __attribute__ ((used, aligned(32)));
-static uint8_t *bulk_data __attribute__ ((aligned(32))) = NULL;
-static uint32_t bulk_len_remaining = 0;
+uint32_t usb_dalsa_max_frame_len(void) {
+  return rx_packet_size;
+}
+
+uint32_t usb_dalsa_max_response_len(void) {
+  return DALSA_TX_SIZE;
+}
+
+uint32_t usb_dalsa_max_outstanding(void) {
+  return RX_NUM;
+}
+
+#define EVENT_NUM 16
+
+static transfer_t event_transfer[EVENT_NUM] __attribute__ ((used, aligned(32)));
+DMAMEM static dalsa_event_t event_buffer[EVENT_NUM] __attribute__ ((aligned(32)));
+static volatile uint32_t event_head = 0; // next slot to fill
+static volatile uint32_t event_in_flight = 0;
+static volatile uint8_t event_dropped = 0;
+static volatile uint16_t event_sequence = 0;
+static volatile uint8_t event_configured = 0;
+
+// Can be called from any context, including the pixel timer ISR
+void usb_dalsa_post_event(uint8_t type, uint32_t arg0, uint32_t arg1) {
+  uint32_t primask;
+  __asm__ volatile("mrs %0, primask\n" : "=r" (primask)::);
+  __disable_irq();
+
+  if (!event_configured || event_in_flight >= EVENT_NUM) {
+    if (event_dropped < 0xFF) event_dropped++;
+    TRACE_INSTANT(TRACE_EVENT_DROPPED, type, arg0);
+    goto end;
+  }
+
+  {
+    uint32_t i = event_head;
+    dalsa_event_t *event = &event_buffer[i];
+    event->type = type;
+    event->dropped = event_dropped;
+    event->sequence = event_sequence++;
+    event->timestamp_us = micros();
+    event->arg0 = arg0;
+    event->arg1 = arg1;
+    event_dropped = 0;
+    event_head = (i + 1) % EVENT_NUM;
+    event_in_flight++;
+
+    usb_prepare_transfer(&event_transfer[i], event, sizeof(dalsa_event_t), i);
+    arm_dcache_flush_delete(event, sizeof(dalsa_event_t));
+    usb_transmit(DALSA_EVENT_ENDPOINT, &event_transfer[i]);
+  }
+
+end:
+  if (!primask) __enable_irq();
+}
+
+static void event_event(transfer_t *t) {
+  // Interrupt transfers complete in order, so this just frees up the oldest slot
+  event_in_flight--;
+}
 
-void usb_dalsa_init_bulk_transfer(uint8_t *buffer, uint32_t len) {
-  bulk_data = buffer;
-  bulk_len_remaining = len;
+#define BULK_NUM 2
+#define BULK_CHUNK_SIZE 16384
 
-  if (buffer == NULL || len == 0) {
-    return;
+static transfer_t bulk_transfer[BULK_NUM] __attribute__ ((used, aligned(32)));
+DMAMEM static uint8_t bulk_staging[BULK_NUM][BULK_CHUNK_SIZE] __attribute__ ((aligned(4096)));
+static uint32_t (*bulk_source)(uint8_t *staging, uint32_t max_len, uint8_t **data) = NULL;
+static volatile uint8_t bulk_in_flight = 0;
+static volatile uint8_t bulk_next = 0;
+static volatile uint8_t bulk_source_done = 0;
+static volatile uint32_t bulk_bytes = 0;
+
+// Keeps BULK_NUM chunks queued until the source runs dry. Runs from the USB ISR or with it disabled.
+static void bulk_queue_chunks(void) {
+  while (bulk_source != NULL && !bulk_source_done && bulk_in_flight < BULK_NUM) {
+    uint32_t i = bulk_next;
+    uint8_t *data = bulk_staging[i];
+    uint32_t len = bulk_source(bulk_staging[i], BULK_CHUNK_SIZE, &data);
+    if (len == 0) {
+      bulk_source_done = 1;
+      break;
+    }
+    TRACE_INSTANT(TRACE_BULK_CHUNK, len, bulk_in_flight);
+    bulk_bytes += len;
+
+    usb_prepare_transfer(&bulk_transfer[i], data, len, i);
+    arm_dcache_flush(data, len);
+    usb_transmit(DALSA_BULK_ENDPOINT, &bulk_transfer[i]);
+    bulk_next = (i + 1) % BULK_NUM;
+    bulk_in_flight++;
   }
 
-  // queue transfer
+  if (bulk_source_done && bulk_in_flight == 0) {
+    bulk_source = NULL;
+    TRACE_END(TRACE_BULK_STREAM, 0, 0);
+  }
+}
+
+// The source points *data at the next chunk of the stream, either in `staging` or straight at the source memory,
+// and returns its length. Every chunk but the last must be a multiple of the packet size, otherwise the host sees
+// a short packet and ends its read early. Starting a new stream aborts the one in progress.
+void usb_dalsa_start_bulk_stream(uint32_t (*source)(uint8_t *staging, uint32_t max_len, uint8_t **data)) {
+  usb_dalsa_abort_bulk_stream();
+
   NVIC_DISABLE_IRQ(IRQ_USB1);
-  uint32_t transfer_len = bulk_len_remaining > tx_packet_size ? tx_packet_size : bulk_len_remaining;
+  TRACE_BEGIN(TRACE_BULK_STREAM, 0, 0);
+  bulk_source = source;
+  bulk_queue_chunks();
+  NVIC_ENABLE_IRQ(IRQ_USB1);
+}
 
-  usb_prepare_transfer(&bulk_transfer, bulk_data, transfer_len, 0);
-  arm_dcache_flush_delete(return_data, transfer_len);
-  usb_transmit(DALSA_BULK_ENDPOINT, &bulk_transfer);
+void usb_dalsa_abort_bulk_stream(void) {
+  NVIC_DISABLE_IRQ(IRQ_USB1);
+  if (bulk_source != NULL) {
+    TRACE_END(TRACE_BULK_STREAM, 1, 0); // aborted
+  }
+  if (bulk_in_flight > 0) {
+    usb_flush_transmit(DALSA_BULK_ENDPOINT);
+  }
+  bulk_source = NULL;
+  bulk_source_done = 0;
+  bulk_in_flight = 0;
+  bulk_next = 0;
   NVIC_ENABLE_IRQ(IRQ_USB1);
+}
+
+uint8_t usb_dalsa_bulk_busy(void) {
+  return bulk_source != NULL;
+}
+
+uint32_t usb_dalsa_bulk_chunk_len(void) {
+  return BULK_CHUNK_SIZE;
+}
+
+// Bytes queued on the bulk endpoint since boot, wraps
+uint32_t usb_dalsa_bulk_bytes(void) {
+  return bulk_bytes;
+}
+
+// 1 if the controller NAKed an IN token on the bulk endpoint since the last call, i.e. the host was
+// waiting on us. Only one caller may sample this, reading clears it.
+uint8_t usb_dalsa_bulk_nak(void) {
+  uint32_t bit = 1 << (16 + DALSA_BULK_ENDPOINT);
+  if (!(USB1_ENDPTNAK & bit)) {
+    return 0;
+  }
+  USB1_ENDPTNAK = bit;
+  return 1;
+}
 
-  // update state
-  bulk_data += transfer_len;
-  bulk_len_remaining -= transfer_len;
+uint8_t usb_dalsa_bulk_stalled(void) {
+  return (*((volatile uint32_t *)&USB1_ENDPTCTRL0 + DALSA_BULK_ENDPOINT) & USB_ENDPTCTRL_TXS) != 0;
 }
 
 static void bulk_event(transfer_t *t) {
-  // queue next transfer
-  usb_dalsa_init_bulk_transfer(bulk_data, bulk_len_remaining);
+  bulk_in_flight--;
+  bulk_queue_chunks();
 }
 
 void usb_dalsa_configure (void) {
+  rx_packet_size = usb_high_speed ? DALSA_RX_SIZE_480 : DALSA_RX_SIZE_12;
   tx_packet_size = usb_high_speed ? 512 : 64;
 
-  usb_config_rx(DALSA_RX_ENDPOINT, DALSA_RX_SIZE, 0, rx_event);
-  usb_config_tx(DALSA_TX_ENDPOINT, tx_packet_size, 0, NULL);
+  usb_config_rx(DALSA_RX_ENDPOINT, rx_packet_size, 0, rx_event);
+  usb_config_tx(DALSA_TX_ENDPOINT, tx_packet_size, 1, tx_event); // ZLP terminates responses that fill whole packets
   usb_config_tx(DALSA_BULK_ENDPOINT, tx_packet_size, 0, bulk_event);
+  usb_config_tx(DALSA_EVENT_ENDPOINT, DALSA_EVENT_SIZE, 0, event_event);
+  event_head = 0;
+  event_in_flight = 0;
+  event_configured = 1;
 
   // init some rx transfers
   for (int i=0; i < RX_NUM; i++) rx_queue_transfer(i);
 
-  printf("Dalsa USB configured\n");
+  TRACE_INSTANT(TRACE_USB_CONFIGURED, usb_high_speed, 0);
 }
\ No newline at end of file
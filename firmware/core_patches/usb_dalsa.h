@@ -3,14 +3,72 @@
 #include "usb_desc.h"
 #include <stdint.h>
 
+#define DALSA_PROTOCOL_VERSION 2
+
+// Response status codes
+#define DALSA_STATUS_OK 0x00
+#define DALSA_STATUS_INVALID_VERSION 0x01
+#define DALSA_STATUS_INVALID_COMMAND 0x02
+#define DALSA_STATUS_INVALID_LENGTH 0x03
+#define DALSA_STATUS_INVALID_ARGUMENT 0x04
+#define DALSA_STATUS_BUSY 0x05
+#define DALSA_STATUS_RESPONSE_OVERFLOW 0x06
+#define DALSA_STATUS_NO_HANDLER 0x07
+#define DALSA_STATUS_NO_MEMORY 0x08
+
+// A command frame (one OUT packet) holds one or more requests back-to-back.
+// The matching IN transfer holds one response per request, in the same order.
+typedef struct __attribute__((__packed__)) {
+  uint8_t version;
+  uint8_t command;
+  uint16_t tag;
+  uint32_t data_len;
+  uint8_t data[];
+} control_req_t;
+
+typedef struct __attribute__((__packed__)) {
+  uint8_t version;
+  uint8_t status;
+  uint16_t tag;
+  uint32_t data_len;
+  uint8_t data[];
+} control_resp_t;
+
+// Events pushed on DALSA_EVENT_ENDPOINT
+#define DALSA_EVENT_READOUT_STARTED 0x01
+#define DALSA_EVENT_ROW_PROGRESS 0x02
+#define DALSA_EVENT_FRAME_READY 0x03
+#define DALSA_EVENT_FAXITRON_STATE 0x04
+#define DALSA_EVENT_ERROR 0x05
+
+typedef struct __attribute__((__packed__)) {
+  uint8_t type;
+  uint8_t dropped; // events lost since the previous one because the host wasn't reading
+  uint16_t sequence;
+  uint32_t timestamp_us;
+  uint32_t arg0;
+  uint32_t arg1;
+} dalsa_event_t;
+
 // C language implementation
 #ifdef __cplusplus
 extern "C" {
 #endif
   extern volatile uint8_t usb_high_speed;
   void usb_dalsa_configure (void);
-  void usb_dalsa_set_handler(uint32_t (*handler)(uint8_t *control_data, uint32_t len, uint8_t *return_data, uint32_t max_return_len));
-  void usb_dalsa_init_bulk_transfer(uint8_t *buffer, uint32_t len, uint8_t transfer_id);
+  void usb_dalsa_set_handler(uint32_t (*handler)(control_req_t *req, uint8_t *return_data, uint32_t max_return_len, uint8_t *status));
+  uint32_t usb_dalsa_max_frame_len(void);
+  uint32_t usb_dalsa_max_response_len(void);
+  uint32_t usb_dalsa_max_outstanding(void);
+  void usb_dalsa_post_event(uint8_t type, uint32_t arg0, uint32_t arg1);
+  void usb_dalsa_start_bulk_stream(uint32_t (*source)(uint8_t *staging, uint32_t max_len, uint8_t **data));
+  void usb_dalsa_abort_bulk_stream(void);
+  uint8_t usb_dalsa_bulk_busy(void);
+  uint32_t usb_dalsa_bulk_chunk_len(void);
+  uint32_t usb_dalsa_bulk_bytes(void);
+  uint8_t usb_dalsa_bulk_nak(void);
+  uint8_t usb_dalsa_bulk_stalled(void);
+  void usb_flush_transmit(int endpoint_number); // in usb.c
 #ifdef __cplusplus
 }
-#endif
\ No newline at end of file
+#endif
@@ -138,11 +138,13 @@ let me know?  http://forum.pjrc.com/forums/4-Suggestions-amp-Bug-Reports
 #define DALSA_RX_ENDPOINT 5
 #define DALSA_TX_ENDPOINT 6
 #define DALSA_BULK_ENDPOINT 7
+#define DALSA_EVENT_ENDPOINT 5
+#define DALSA_EVENT_SIZE 16
 
 #define ENDPOINT2_CONFIG	ENDPOINT_RECEIVE_UNUSED + ENDPOINT_TRANSMIT_INTERRUPT
 #define ENDPOINT3_CONFIG	ENDPOINT_RECEIVE_BULK + ENDPOINT_TRANSMIT_UNUSED
 #define ENDPOINT4_CONFIG  ENDPOINT_RECEIVE_UNUSED + ENDPOINT_TRANSMIT_BULK
-#define ENDPOINT5_CONFIG  ENDPOINT_RECEIVE_BULK + ENDPOINT_TRANSMIT_UNUSED
+#define ENDPOINT5_CONFIG  ENDPOINT_RECEIVE_BULK + ENDPOINT_TRANSMIT_INTERRUPT
 #define ENDPOINT6_CONFIG  ENDPOINT_RECEIVE_UNUSED + ENDPOINT_TRANSMIT_BULK
 #define ENDPOINT7_CONFIG  ENDPOINT_RECEIVE_UNUSED + ENDPOINT_TRANSMIT_BULK
 
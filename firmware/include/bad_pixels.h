@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+
+// Bad pixel / bad column map, persisted in EEPROM and patched out of every frame as its rows complete.
+// Defects are replaced by the mean of the nearest good neighbours in the same row.
+
+#define BAD_PIXELS_MAX 1024
+#define BAD_PIXEL_COLUMN 0xFFFF // row value of an entry that marks the whole column bad
+
+typedef struct __attribute__((__packed__)) {
+  uint16_t row;
+  uint16_t col;
+} bad_pixel_t;
+
+// Uploads go to a staging list, bad_pixels_commit() only marks it for use, the switch (and the EEPROM
+// write, which is slow) happens in bad_pixels_poll() from the main loop between frames
+// on a copy of the staging list, so the next upload can start as soon as bad_pixels_pending() clears
+void bad_pixels_load();
+void bad_pixels_stage_clear();
+bool bad_pixels_stage_add(const bad_pixel_t *entries, uint32_t count);
+void bad_pixels_commit();
+void bad_pixels_poll();
+
+uint32_t bad_pixels_count();
+uint32_t bad_pixels_staged();
+bool bad_pixels_pending();
+uint32_t bad_pixels_get(bad_pixel_t *entries, uint32_t start, uint32_t max_count);
+void bad_pixels_set_enabled(bool enabled);
+bool bad_pixels_enabled();
+
+// Rows have to be corrected in order, starting from row 0 after bad_pixels_start_frame()
+void bad_pixels_start_frame();
+void bad_pixels_correct_row(uint16_t *row, uint32_t row_index);
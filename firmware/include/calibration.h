@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+
+// Dark and gain (flat-field) correction: out = (raw - dark) * gain + pedestal, saturated to 16 bits.
+// Both maps cover the whole frame, live in PSRAM and are uploaded in pieces, then checked against a CRC.
+// PSRAM budget: the two frame slots take 4.3 MB and each map another 2.15 MB, allocated on its first upload.
+// An 8 MB PSRAM only has room for one of the maps: calibration_begin() then fails, and the caller can give
+// the map a frame slot with calibration_set_buffer() instead.
+// Gain is Q3.12, 4096 is unity, and has to stay below 0x8000 since the DSP multiplies treat it as signed.
+
+#define CALIBRATION_MAP_DARK 0
+#define CALIBRATION_MAP_GAIN 1
+#define CALIBRATION_MAPS 2
+#define CALIBRATION_GAIN_SHIFT 12
+
+#define CALIBRATION_MAP_EMPTY 0
+#define CALIBRATION_MAP_LOADING 1
+#define CALIBRATION_MAP_VERIFYING 2
+#define CALIBRATION_MAP_VALID 3
+#define CALIBRATION_MAP_CRC_ERROR 4
+
+void calibration_init();
+
+// Loading a map invalidates it until calibration_commit() and the CRC check in calibration_poll() pass.
+// The check runs on the DCP in the background, started and picked up from the main loop between frames.
+bool calibration_begin(uint8_t map);
+// SENSOR_ROWS x SENSOR_COLUMNS pixels the map lives in from now on, for a map that doesn't have memory yet
+void calibration_set_buffer(uint8_t map, uint16_t *buffer);
+bool calibration_write(uint8_t map, uint32_t offset, const uint16_t *data, uint32_t count);
+bool calibration_commit(uint8_t map, uint32_t crc);
+void calibration_poll();
+
+uint8_t calibration_map_state(uint8_t map);
+void calibration_configure(bool dark, bool gain, uint16_t pedestal);
+bool calibration_dark_active();
+bool calibration_gain_active();
+uint16_t calibration_pedestal();
+
+void calibration_correct_row(uint16_t *row, uint32_t row_index);
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+
+// CRC32 on the i.MX RT Data Co-Processor (DCP), so checksumming frames doesn't cost CPU time.
+// The DCP computes CRC-32/MPEG-2: polynomial 0x04C11DB7, init 0xFFFFFFFF, not reflected, no final XOR.
+// Channel 0 runs whole-frame checksums in the background, channel 1 is used synchronously for stream chunks
+// (from the USB ISR only) and channel 2 checks uploaded calibration maps in the background.
+
+// Returns false if the DCP doesn't reproduce the CRC-32/MPEG-2 check value, the CPU fallback is used then
+bool dcp_init();
+
+// Copies len bytes from src to dst and returns the CRC of the data, in a single pass over the source
+uint32_t dcp_copy_crc32(void *dst, const void *src, uint32_t len);
+uint32_t dcp_crc32(const void *data, uint32_t len);
+
+// Background CRC of a large buffer, poll dcp_crc32_done() until it returns true. Each job has its own channel.
+#define DCP_JOB_FRAME 0
+#define DCP_JOB_CHECK 1
+#define DCP_JOBS 2
+
+void dcp_crc32_start(uint8_t job, const void *data, uint32_t len);
+bool dcp_crc32_done(uint8_t job, uint32_t *crc);
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+
+// Frame log on the built-in SD card. One preallocated, contiguous file holds fixed size records, written with
+// raw multi-sector SDIO writes so there is no filesystem work per frame. A record is one sector with the frame
+// header, then the pixel data padded to whole sectors.
+
+#define SD_LOG_SECTOR_LEN 512
+#define SD_LOG_HEADER_LEN SD_LOG_SECTOR_LEN
+
+bool sd_log_init();
+bool sd_log_card();
+
+// Capacity 0 reopens the existing log and appends to it
+bool sd_log_open(uint32_t capacity, uint32_t record_data_len);
+void sd_log_close();
+bool sd_log_active();
+uint32_t sd_log_capacity();
+uint32_t sd_log_count();
+uint32_t sd_log_record_len();
+
+// Writes happen piecewise from sd_log_poll(), which returns true once the record is complete.
+// The data has to stay untouched until then.
+bool sd_log_begin_record(const void *header, uint32_t header_len, const void *data, uint32_t len);
+bool sd_log_writing();
+bool sd_log_poll();
+
+// Reads len bytes at a byte offset into the records, e.g. to stream the log back over USB
+bool sd_log_read(uint32_t offset, void *dst, uint32_t len);
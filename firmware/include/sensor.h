@@ -0,0 +1,11 @@
+#pragma once
+
+// Sensor definitions
+#define SENSOR_RESOLUTION 1024
+#define SENSOR_DARK_ROWS 4
+#define SENSOR_ROWS (SENSOR_RESOLUTION + 2 * (SENSOR_DARK_ROWS))
+#define SENSOR_JUNK_COLS_PRE 4
+#define SENSOR_DARK_COLS_PRE 4
+#define SENSOR_JUNK_COLS_POST 2
+#define SENSOR_DARK_COLS_POST 8
+#define SENSOR_COLUMNS (SENSOR_JUNK_COLS_PRE + SENSOR_DARK_COLS_PRE + SENSOR_RESOLUTION + SENSOR_DARK_COLS_POST + SENSOR_JUNK_COLS_POST)
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdint.h>
+
+// Deterministic frames that go through the row pipeline and every transfer path in place of the CCD,
+// so the host can check what it receives bit for bit. app/dalsa_teensy.py generates the same patterns.
+
+#define TEST_PATTERN_OFF 0
+#define TEST_PATTERN_RAMP 1         // (row * cols + col + seed) & 0xFFFF
+#define TEST_PATTERN_CHECKERBOARD 2 // 8x8 squares of 0xA5A5 / 0x5A5A, seed shifts them by whole squares
+#define TEST_PATTERN_PRNG 3         // xorshift32 per row, seeded from seed and the row
+#define TEST_PATTERNS 4
+
+void test_pattern_row(uint8_t pattern, uint32_t seed, uint32_t row, uint32_t cols, uint16_t *dst);
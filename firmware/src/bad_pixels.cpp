@@ -0,0 +1,206 @@
+#include <Arduino.h>
+#include <EEPROM.h>
+#include "bad_pixels.h"
+#include "sensor.h"
+
+#define EEPROM_MAGIC 0x58504244 // "DBPX"
+#define EEPROM_ADDR 0
+
+typedef struct {
+  uint32_t magic;
+  uint16_t count;
+  uint16_t reserved;
+} eeprom_header_t;
+static_assert(sizeof(eeprom_header_t) + BAD_PIXELS_MAX * sizeof(bad_pixel_t) <= 4284, "bad pixel map doesn't fit in EEPROM");
+
+// Active map: single pixels sorted by row then column, bad columns apart since they apply to every row
+static bad_pixel_t pixels[BAD_PIXELS_MAX];
+static uint32_t pixel_count = 0;
+static uint16_t columns[BAD_PIXELS_MAX];
+static uint32_t column_count = 0;
+static uint32_t column_mask[(SENSOR_COLUMNS + 31) / 32];
+static uint32_t cursor = 0;
+static bool enabled = true;
+
+static bad_pixel_t staged[BAD_PIXELS_MAX];
+static volatile uint32_t staged_count = 0;
+static volatile bool commit_pending = false;
+static bad_pixel_t committed[BAD_PIXELS_MAX]; // Staged list as committed, the USB ISR may stage again meanwhile
+
+static inline bool is_bad_column(uint32_t col) {
+  return column_mask[col / 32] & (1 << (col % 32));
+}
+
+static inline uint32_t sort_key(const bad_pixel_t *entry) {
+  return ((uint32_t) entry->row << 16) | entry->col;
+}
+
+static int compare(const void *a, const void *b) {
+  uint32_t ka = sort_key((const bad_pixel_t *) a);
+  uint32_t kb = sort_key((const bad_pixel_t *) b);
+  return (ka > kb) - (ka < kb);
+}
+
+// The entries (sorted in place) become the active map, columns end up at the back after sorting
+static void activate(bad_pixel_t *entries, uint32_t count) {
+  qsort(entries, count, sizeof(bad_pixel_t), compare);
+
+  pixel_count = 0;
+  column_count = 0;
+  memset(column_mask, 0, sizeof(column_mask));
+  for (uint32_t i = 0; i < count; i++) {
+    if (i > 0 && sort_key(&entries[i]) == sort_key(&entries[i - 1])) {
+      continue;
+    }
+    if (entries[i].row == BAD_PIXEL_COLUMN) {
+      columns[column_count++] = entries[i].col;
+      column_mask[entries[i].col / 32] |= (1 << (entries[i].col % 32));
+    } else {
+      pixels[pixel_count++] = entries[i];
+    }
+  }
+}
+
+static void save(const bad_pixel_t *entries, uint32_t count) {
+  eeprom_header_t header = { .magic = EEPROM_MAGIC, .count = (uint16_t) count, .reserved = 0 };
+  EEPROM.put(EEPROM_ADDR, header);
+  for (uint32_t i = 0; i < count; i++) {
+    EEPROM.put(EEPROM_ADDR + sizeof(header) + i * sizeof(bad_pixel_t), entries[i]);
+  }
+}
+
+void bad_pixels_load() {
+  eeprom_header_t header;
+  EEPROM.get(EEPROM_ADDR, header);
+  if (header.magic != EEPROM_MAGIC || header.count > BAD_PIXELS_MAX) {
+    staged_count = 0;
+  } else {
+    for (uint32_t i = 0; i < header.count; i++) {
+      EEPROM.get(EEPROM_ADDR + sizeof(header) + i * sizeof(bad_pixel_t), staged[i]);
+    }
+    staged_count = header.count;
+  }
+  activate(staged, staged_count);
+}
+
+void bad_pixels_stage_clear() {
+  staged_count = 0;
+}
+
+bool bad_pixels_stage_add(const bad_pixel_t *entries, uint32_t count) {
+  if (staged_count + count > BAD_PIXELS_MAX) {
+    return false;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    bool column = entries[i].row == BAD_PIXEL_COLUMN;
+    if (entries[i].col >= SENSOR_COLUMNS || (!column && entries[i].row >= SENSOR_ROWS)) {
+      return false;
+    }
+  }
+  memcpy(&staged[staged_count], entries, count * sizeof(bad_pixel_t));
+  staged_count += count;
+  return true;
+}
+
+void bad_pixels_commit() {
+  commit_pending = true;
+}
+
+void bad_pixels_poll() {
+  if (!commit_pending) {
+    return;
+  }
+  // The USB ISR stages uploads and reads the active map, so both change hands with it masked. Sorting
+  // takes well under a millisecond, the EEPROM write is slow and works from the copy with USB running.
+  NVIC_DISABLE_IRQ(IRQ_USB1);
+  uint32_t count = staged_count;
+  memcpy(committed, staged, count * sizeof(bad_pixel_t));
+  activate(committed, count);
+  commit_pending = false;
+  NVIC_ENABLE_IRQ(IRQ_USB1);
+  save(committed, count);
+}
+
+uint32_t bad_pixels_count() {
+  return pixel_count + column_count;
+}
+
+uint32_t bad_pixels_staged() {
+  return staged_count;
+}
+
+bool bad_pixels_pending() {
+  return commit_pending;
+}
+
+uint32_t bad_pixels_get(bad_pixel_t *entries, uint32_t start, uint32_t max_count) {
+  uint32_t n = 0;
+  for (uint32_t i = start; i < pixel_count + column_count && n < max_count; i++, n++) {
+    if (i < pixel_count) {
+      entries[n] = pixels[i];
+    } else {
+      entries[n].row = BAD_PIXEL_COLUMN;
+      entries[n].col = columns[i - pixel_count];
+    }
+  }
+  return n;
+}
+
+void bad_pixels_set_enabled(bool enable) {
+  enabled = enable;
+}
+
+bool bad_pixels_enabled() {
+  return enabled;
+}
+
+void bad_pixels_start_frame() {
+  cursor = 0;
+}
+
+// pixels[first..last) are the single defects of this row, sorted by column
+static inline bool is_bad(int32_t col, uint32_t first, uint32_t last) {
+  if (is_bad_column(col)) {
+    return true;
+  }
+  for (uint32_t i = first; i < last && pixels[i].col <= col; i++) {
+    if (pixels[i].col == col) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Neighbours that are defects themselves are skipped, whether corrected already or not
+static inline void interpolate(uint16_t *row, int32_t col, uint32_t first, uint32_t last) {
+  int32_t left = col - 1;
+  while (left >= 0 && is_bad(left, first, last)) left--;
+  int32_t right = col + 1;
+  while (right < SENSOR_COLUMNS && is_bad(right, first, last)) right++;
+
+  if (left >= 0 && right < SENSOR_COLUMNS) {
+    row[col] = (row[left] + row[right] + 1) / 2;
+  } else if (left >= 0) {
+    row[col] = row[left];
+  } else if (right < SENSOR_COLUMNS) {
+    row[col] = row[right];
+  }
+}
+
+void bad_pixels_correct_row(uint16_t *row, uint32_t row_index) {
+  if (!enabled) {
+    return;
+  }
+
+  // Rows come in order, so the cursor only moves forward: the cost is the defects in this row
+  while (cursor < pixel_count && pixels[cursor].row < row_index) cursor++;
+  uint32_t first = cursor;
+  while (cursor < pixel_count && pixels[cursor].row == row_index) cursor++;
+
+  for (uint32_t i = 0; i < column_count; i++) {
+    interpolate(row, columns[i], first, cursor);
+  }
+  for (uint32_t i = first; i < cursor; i++) {
+    interpolate(row, pixels[i].col, first, cursor);
+  }
+}
@@ -0,0 +1,167 @@
+#include <Arduino.h>
+#include "calibration.h"
+#include "dcp.h"
+#include "sensor.h"
+
+#define MAP_LEN (SENSOR_ROWS * SENSOR_COLUMNS * sizeof(uint16_t))
+static_assert((SENSOR_COLUMNS % 2) == 0, "rows are processed as pixel pairs");
+
+static uint16_t *maps[CALIBRATION_MAPS];
+static volatile uint8_t map_state[CALIBRATION_MAPS];
+static uint32_t map_crc[CALIBRATION_MAPS];
+static volatile uint32_t map_generation[CALIBRATION_MAPS]; // Bumped on every upload, from the USB ISR
+static int8_t checking_map = -1; // Map whose CRC is running on the DCP, and the upload it is of
+static uint32_t checking_generation = 0;
+
+static bool dark_enabled = true;
+static bool gain_enabled = true;
+static uint16_t pedestal = 0;
+
+// Stand-ins for a missing map, so the row loop doesn't branch per pixel
+static const uint16_t zero_row[SENSOR_COLUMNS] __attribute__ ((aligned(4))) = {0};
+static uint16_t unity_row[SENSOR_COLUMNS] __attribute__ ((aligned(4)));
+
+// Cortex-M7 DSP extension, two 16-bit lanes per 32-bit register
+static inline uint32_t qsub16(uint32_t a, uint32_t b) {
+  uint32_t out;
+  asm volatile("qsub16 %0, %1, %2" : "=r" (out) : "r" (a), "r" (b));
+  return out;
+}
+
+static inline int32_t smlabb(uint32_t a, uint32_t b, int32_t acc) {
+  int32_t out;
+  asm volatile("smlabb %0, %1, %2, %3" : "=r" (out) : "r" (a), "r" (b), "r" (acc));
+  return out;
+}
+
+static inline int32_t smlatt(uint32_t a, uint32_t b, int32_t acc) {
+  int32_t out;
+  asm volatile("smlatt %0, %1, %2, %3" : "=r" (out) : "r" (a), "r" (b), "r" (acc));
+  return out;
+}
+
+// Shift right by the gain format, then clamp to 0..65535
+static inline uint32_t usat16_asr12(int32_t a) {
+  uint32_t out;
+  asm volatile("usat %0, #16, %1, asr #12" : "=r" (out) : "r" (a));
+  return out;
+}
+
+static inline uint32_t pkhbt(uint32_t bottom, uint32_t top) {
+  uint32_t out;
+  asm volatile("pkhbt %0, %1, %2, lsl #16" : "=r" (out) : "r" (bottom), "r" (top));
+  return out;
+}
+static_assert(CALIBRATION_GAIN_SHIFT == 12, "usat16_asr12 hard-codes the gain format");
+
+void calibration_init() {
+  for (uint32_t col = 0; col < SENSOR_COLUMNS; col++) {
+    unity_row[col] = 1 << CALIBRATION_GAIN_SHIFT;
+  }
+}
+
+bool calibration_begin(uint8_t map) {
+  if (map >= CALIBRATION_MAPS) {
+    return false;
+  }
+  if (maps[map] == NULL) {
+    maps[map] = (uint16_t *) extmem_malloc(MAP_LEN);
+    if (maps[map] == NULL) {
+      return false;
+    }
+  }
+  map_generation[map]++;
+  map_state[map] = CALIBRATION_MAP_LOADING;
+  return true;
+}
+
+void calibration_set_buffer(uint8_t map, uint16_t *buffer) {
+  if (map < CALIBRATION_MAPS && maps[map] == NULL) {
+    maps[map] = buffer;
+  }
+}
+
+bool calibration_write(uint8_t map, uint32_t offset, const uint16_t *data, uint32_t count) {
+  if (map >= CALIBRATION_MAPS || map_state[map] != CALIBRATION_MAP_LOADING || (offset + count) * sizeof(uint16_t) > MAP_LEN) {
+    return false;
+  }
+  memcpy(&maps[map][offset], data, count * sizeof(uint16_t));
+  return true;
+}
+
+bool calibration_commit(uint8_t map, uint32_t crc) {
+  if (map >= CALIBRATION_MAPS || map_state[map] != CALIBRATION_MAP_LOADING) {
+    return false;
+  }
+  map_crc[map] = crc;
+  map_state[map] = CALIBRATION_MAP_VERIFYING;
+  return true;
+}
+
+void calibration_poll() {
+  uint32_t crc;
+  if (checking_map >= 0 && dcp_crc32_done(DCP_JOB_CHECK, &crc)) {
+    // Reloaded while the check ran, the new data gets a check of its own. Uploads come in from the USB ISR.
+    NVIC_DISABLE_IRQ(IRQ_USB1);
+    if (map_generation[checking_map] == checking_generation && map_state[checking_map] == CALIBRATION_MAP_VERIFYING) {
+      map_state[checking_map] = crc == map_crc[checking_map] ? CALIBRATION_MAP_VALID : CALIBRATION_MAP_CRC_ERROR;
+    }
+    NVIC_ENABLE_IRQ(IRQ_USB1);
+    checking_map = -1;
+  }
+  if (checking_map >= 0) {
+    return;
+  }
+  for (uint8_t map = 0; map < CALIBRATION_MAPS; map++) {
+    uint32_t generation = map_generation[map]; // before the state, an upload in between then fails the match
+    if (map_state[map] == CALIBRATION_MAP_VERIFYING) {
+      arm_dcache_flush(maps[map], MAP_LEN);
+      checking_map = map;
+      checking_generation = generation;
+      dcp_crc32_start(DCP_JOB_CHECK, maps[map], MAP_LEN);
+      break;
+    }
+  }
+}
+
+uint8_t calibration_map_state(uint8_t map) {
+  return map < CALIBRATION_MAPS ? map_state[map] : CALIBRATION_MAP_EMPTY;
+}
+
+void calibration_configure(bool dark, bool gain, uint16_t new_pedestal) {
+  dark_enabled = dark;
+  gain_enabled = gain;
+  pedestal = new_pedestal;
+}
+
+bool calibration_dark_active() {
+  return dark_enabled && map_state[CALIBRATION_MAP_DARK] == CALIBRATION_MAP_VALID;
+}
+
+bool calibration_gain_active() {
+  return gain_enabled && map_state[CALIBRATION_MAP_GAIN] == CALIBRATION_MAP_VALID;
+}
+
+uint16_t calibration_pedestal() {
+  return pedestal;
+}
+
+void calibration_correct_row(uint16_t *row, uint32_t row_index) {
+  bool dark_active = calibration_dark_active();
+  bool gain_active = calibration_gain_active();
+  if (!dark_active && !gain_active) {
+    return;
+  }
+  const uint32_t *dark = (const uint32_t *) (dark_active ? &maps[CALIBRATION_MAP_DARK][row_index * SENSOR_COLUMNS] : zero_row);
+  const uint32_t *gain = (const uint32_t *) (gain_active ? &maps[CALIBRATION_MAP_GAIN][row_index * SENSOR_COLUMNS] : unity_row);
+  uint32_t *pixels = (uint32_t *) row;
+  int32_t acc = (int32_t) pedestal << CALIBRATION_GAIN_SHIFT;
+
+  // The lanes are handled as signed: negative differences survive until the pedestal is added and only then
+  // get clamped. The difference saturates, so a stray dark value can't wrap it around (as the host does).
+  for (uint32_t i = 0; i < SENSOR_COLUMNS / 2; i++) {
+    uint32_t diff = qsub16(pixels[i], dark[i]);
+    uint32_t g = gain[i];
+    pixels[i] = pkhbt(usat16_asr12(smlabb(diff, g, acc)), usat16_asr12(smlatt(diff, g, acc)));
+  }
+}
@@ -0,0 +1,187 @@
+#include <Arduino.h>
+#include <dalsa_trace.h>
+#include "dcp.h"
+
+// Register map, i.MX RT1060 reference manual chapter 13 (DCP)
+#define DCP_BASE 0x402FC000
+#define DCP_REG(offset) (*(volatile uint32_t *)(DCP_BASE + (offset)))
+#define DCP_REG_CTRL DCP_REG(0x000)
+#define DCP_REG_CTRL_CLR DCP_REG(0x008)
+#define DCP_REG_STAT_CLR DCP_REG(0x018)
+#define DCP_REG_CHANNELCTRL DCP_REG(0x020)
+#define DCP_REG_CONTEXT DCP_REG(0x050)
+#define DCP_REG_CHCMDPTR(ch) DCP_REG(0x100 + (ch) * 0x40)
+#define DCP_REG_CHSEMA(ch) DCP_REG(0x110 + (ch) * 0x40)
+#define DCP_REG_CHSTAT(ch) DCP_REG(0x120 + (ch) * 0x40)
+#define DCP_REG_CHSTAT_CLR(ch) DCP_REG(0x128 + (ch) * 0x40)
+
+#define DCP_CTRL_SFTRST (1 << 31)
+#define DCP_CTRL_CLKGATE (1 << 30)
+#define DCP_CTRL_GATHER_RESIDUAL_WRITES (1 << 23)
+#define DCP_CTRL_ENABLE_CONTEXT_CACHING (1 << 22)
+#define DCP_CTRL_ENABLE_CONTEXT_SWITCHING (1 << 21)
+
+#define DCP_CONTROL0_DECR_SEMAPHORE (1 << 1)
+#define DCP_CONTROL0_ENABLE_MEMCOPY (1 << 4)
+#define DCP_CONTROL0_ENABLE_HASH (1 << 6)
+#define DCP_CONTROL0_HASH_INIT (1 << 12)
+#define DCP_CONTROL0_HASH_TERM (1 << 13)
+#define DCP_CONTROL1_HASH_SELECT_CRC32 (1 << 16)
+
+#define DCP_CHSTAT_ERROR_MASK 0x7E
+#define DCP_SEMA_VALUE(sema) (((sema) >> 16) & 0xFF)
+
+#define CHANNEL_BACKGROUND 0
+#define CHANNEL_SYNC 1
+#define CHANNEL_CHECK 2
+#define CHANNELS 3
+
+#define CRC32_CHECK_VALUE 0x0376E6E7 // CRC-32/MPEG-2 of "123456789"
+
+typedef struct {
+  uint32_t next_cmd_addr;
+  uint32_t control0;
+  uint32_t control1;
+  uint32_t source_buffer;
+  uint32_t destination_buffer;
+  uint32_t buffer_size;
+  uint32_t payload_pointer;
+  uint32_t status;
+} dcp_packet_t;
+
+// These live in DTCM, which is uncached, so the DCP sees them without any cache maintenance
+static dcp_packet_t packets[CHANNELS] __attribute__ ((aligned(32)));
+static uint32_t payloads[CHANNELS][8] __attribute__ ((aligned(32)));
+static uint32_t context[52] __attribute__ ((aligned(32)));
+
+static bool use_dcp = false;
+static uint32_t crc_table[256];
+
+// Background job state, the buffer is kept for the CPU fallback
+typedef struct {
+  uint32_t channel;
+  const void *data;
+  uint32_t len;
+} background_job_t;
+
+static background_job_t jobs[DCP_JOBS] = {
+  { CHANNEL_BACKGROUND, NULL, 0 },
+  { CHANNEL_CHECK, NULL, 0 },
+};
+
+static uint32_t cpu_crc32(const void *data, uint32_t len) {
+  const uint8_t *bytes = (const uint8_t *) data;
+  uint32_t crc = 0xFFFFFFFF;
+  for (uint32_t i = 0; i < len; i++) {
+    crc = (crc << 8) ^ crc_table[(crc >> 24) ^ bytes[i]];
+  }
+  return crc;
+}
+
+static void submit(uint32_t channel, void *dst, const void *src, uint32_t len) {
+  dcp_packet_t *packet = &packets[channel];
+  packet->next_cmd_addr = 0;
+  packet->control0 = DCP_CONTROL0_DECR_SEMAPHORE | DCP_CONTROL0_ENABLE_HASH | DCP_CONTROL0_HASH_INIT | DCP_CONTROL0_HASH_TERM;
+  if (dst != NULL) {
+    packet->control0 |= DCP_CONTROL0_ENABLE_MEMCOPY;
+  }
+  packet->control1 = DCP_CONTROL1_HASH_SELECT_CRC32;
+  packet->source_buffer = (uint32_t) src;
+  packet->destination_buffer = (uint32_t) dst;
+  packet->buffer_size = len;
+  packet->payload_pointer = (uint32_t) payloads[channel];
+  packet->status = 0;
+
+  DCP_REG_CHSTAT_CLR(channel) = 0xFFFFFFFF;
+  DCP_REG_CHCMDPTR(channel) = (uint32_t) packet;
+  DCP_REG_CHSEMA(channel) = 1;
+}
+
+static bool finished(uint32_t channel) {
+  return DCP_SEMA_VALUE(DCP_REG_CHSEMA(channel)) == 0;
+}
+
+static uint32_t result(uint32_t channel) {
+  if (DCP_REG_CHSTAT(channel) & DCP_CHSTAT_ERROR_MASK) {
+    TRACE_INSTANT(TRACE_DCP_ERROR, channel, DCP_REG_CHSTAT(channel));
+  }
+  return payloads[channel][0];
+}
+
+bool dcp_init() {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i << 24;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : (crc << 1);
+    }
+    crc_table[i] = crc;
+  }
+
+  // Ungate the DCP clock (CCGR0 CG5) and take it out of reset
+  CCM_CCGR0 |= (3 << 10);
+  DCP_REG_CTRL_CLR = DCP_CTRL_SFTRST | DCP_CTRL_CLKGATE;
+  DCP_REG_CTRL = DCP_CTRL_GATHER_RESIDUAL_WRITES | DCP_CTRL_ENABLE_CONTEXT_CACHING | DCP_CTRL_ENABLE_CONTEXT_SWITCHING;
+  DCP_REG_STAT_CLR = 0xFFFFFFFF;
+  DCP_REG_CONTEXT = (uint32_t) context;
+  DCP_REG_CHANNELCTRL = (1 << CHANNEL_BACKGROUND) | (1 << CHANNEL_SYNC) | (1 << CHANNEL_CHECK);
+
+  static const char check[] = "123456789";
+  use_dcp = true;
+  uint32_t crc = dcp_crc32(check, sizeof(check) - 1);
+  if (crc != CRC32_CHECK_VALUE) {
+    TRACE_INSTANT(TRACE_DCP_FALLBACK, crc, 0); // self-test failed, using CPU CRC
+    use_dcp = false;
+  }
+  return use_dcp;
+}
+
+uint32_t dcp_copy_crc32(void *dst, const void *src, uint32_t len) {
+  if (!use_dcp) {
+    memcpy(dst, src, len);
+    arm_dcache_flush(dst, len);
+    return cpu_crc32(src, len);
+  }
+
+  // Nothing dirty may get evicted on top of what the DCP writes
+  arm_dcache_delete(dst, len);
+  submit(CHANNEL_SYNC, dst, src, len);
+  while (!finished(CHANNEL_SYNC));
+  return result(CHANNEL_SYNC);
+}
+
+uint32_t dcp_crc32(const void *data, uint32_t len) {
+  if (!use_dcp) {
+    return cpu_crc32(data, len);
+  }
+
+  arm_dcache_flush((void *) data, len);
+  submit(CHANNEL_SYNC, NULL, data, len);
+  while (!finished(CHANNEL_SYNC));
+  return result(CHANNEL_SYNC);
+}
+
+void dcp_crc32_start(uint8_t job, const void *data, uint32_t len) {
+  background_job_t *j = &jobs[job];
+  j->data = data;
+  j->len = len;
+  if (use_dcp) {
+    submit(j->channel, NULL, data, len);
+  }
+}
+
+bool dcp_crc32_done(uint8_t job, uint32_t *crc) {
+  background_job_t *j = &jobs[job];
+  if (j->data == NULL) {
+    return false;
+  }
+  if (use_dcp) {
+    if (!finished(j->channel)) {
+      return false;
+    }
+    *crc = result(j->channel);
+  } else {
+    *crc = cpu_crc32(j->data, j->len);
+  }
+  j->data = NULL;
+  return true;
+}
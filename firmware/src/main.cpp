@@ -1,6 +1,13 @@
 #include <Arduino.h>
 #include <ADC.h>
 #include <usb_dalsa.h>
+#include <dalsa_trace.h>
+#include "bad_pixels.h"
+#include "calibration.h"
+#include "dcp.h"
+#include "sd_log.h"
+#include "sensor.h"
+#include "test_pattern.h"
 
 // Pin definitions
 #define PIN_DRV_PH_V1 0
@@ -22,16 +29,6 @@
 #define PIN_LED2 30
 #define PIN_LED3 31
 
-// Sensor definitions
-#define SENSOR_RESOLUTION 1024
-#define SENSOR_DARK_ROWS 4
-#define SENSOR_ROWS (SENSOR_RESOLUTION + 2 * (SENSOR_DARK_ROWS))
-#define SENSOR_JUNK_COLS_PRE 4
-#define SENSOR_DARK_COLS_PRE 4
-#define SENSOR_JUNK_COLS_POST 2
-#define SENSOR_DARK_COLS_POST 8
-#define SENSOR_COLUMNS (SENSOR_JUNK_COLS_PRE + SENSOR_DARK_COLS_PRE + SENSOR_RESOLUTION + SENSOR_DARK_COLS_POST + SENSOR_JUNK_COLS_POST)
-
 // Macros
 #define PHASE_V(state1, state2) {digitalWrite(PIN_DRV_PH_V2, state2); digitalWrite(PIN_DRV_PH_V1, state1);}
 #define PHASE_H(state) {digitalWrite(PIN_DRV_PH_H1, state); digitalWrite(PIN_DRV_PH_H2, !state);}
@@ -43,8 +40,30 @@
 #define T_PH_V_POST_US 5
 #define T_PH_H_TOTAL_US (T_PH_V_PRE_US + 3 * T_PH_V_PULSE_US + T_PH_V_POST_US)
 
+// Error codes, reported through DALSA_EVENT_ERROR
+#define ERROR_READOUT_BUSY 0x01
+#define ERROR_FAXITRON_TIMEOUT 0x02
+#define ERROR_INVALID_COMMAND 0x03
+#define ERROR_SD_LOG 0x04
+#define ERROR_READOUT_ABORTED 0x05
+
+// Errors go to the host as events and into the trace
+void post_error(uint8_t error, uint32_t detail) {
+  TRACE_INSTANT(TRACE_ERROR, error, detail);
+  usb_dalsa_post_event(DALSA_EVENT_ERROR, error, detail);
+}
+
 ADC *adc = new ADC();
 bool pin_state = false;
+volatile uint16_t progress_rows = 64; // Rows between DALSA_EVENT_ROW_PROGRESS events, 0 disables them
+
+// Faxitron settings as last seen on the serial passthrough, 0 if unknown
+struct {
+  uint8_t state;
+  uint16_t kv;
+  uint16_t exposure_ds;
+  uint32_t last_command_ms; // Of the last host command, the host's multi-step sequences leave gaps below a second
+} faxitron;
 
 typedef struct __attribute__((__packed__)) {
   uint32_t row;
@@ -57,16 +76,494 @@ typedef struct __attribute__((__packed__)) {
 } readout_state;
 volatile readout_state state;
 
-EXTMEM uint16_t pixel_buffer[SENSOR_ROWS][SENSOR_COLUMNS]; // External RAM is neccesary to fit the buffer
+#define FRAME_SLOTS 2
+EXTMEM uint16_t pixel_buffer[FRAME_SLOTS][SENSOR_ROWS][SENSOR_COLUMNS]; // External RAM is neccesary to fit the buffer
+
+// Slot ownership: readout writes one slot while USB drains another. A new readout takes a free slot, or else
+// the oldest ready one, but never a slot that is being transferred; without one it gets queued.
+#define SLOT_FREE 0
+#define SLOT_READING 1  // Readout, row pipeline and frame CRC
+#define SLOT_READY 2
+#define SLOT_TRANSFER 3
+#define SLOT_CALIBRATION 4 // Holds a calibration map that didn't fit in PSRAM, readouts use the other slot
+#define SLOT_LATEST 0xFF // In requests, the most recent ready frame
+
+#define READOUT_STARTED 0x00
+#define READOUT_QUEUED 0x01
+#define READOUT_REJECTED 0xFF
+
+typedef struct __attribute__((__packed__)) {
+  uint8_t state;
+  uint8_t reserved[3];
+  uint32_t sequence;
+} slot_info_t;
+
+volatile uint8_t slot_state[FRAME_SLOTS];
+uint8_t readout_slot = 0;
+int8_t crc_slot = -1;       // Slot the background CRC runs on
+int8_t transfer_slot = -1;  // Slot the bulk stream reads from
+bool readout_queued = false;
+bool queued_high_gain = false;
+volatile bool abort_requested = false; // Set from the USB ISR, the main loop drops the readout
+
+// SD logging: completed frames wait in their slot until the logger has written them out
+#define SD_LOG_OP_START 0x00
+#define SD_LOG_OP_STOP 0x01
+#define SD_LOG_OP_INFO 0x02
+
+typedef struct __attribute__((__packed__)) {
+  uint8_t card;
+  uint8_t active;
+  uint8_t pending;     // Frames waiting to be written, or a start / stop waiting to be done
+  uint8_t reserved;
+  uint32_t capacity;
+  uint32_t count;
+  uint32_t record_len;
+} sd_log_info_t;
+
+typedef struct __attribute__((__packed__)) {
+  uint32_t record;
+  uint32_t offset;     // Within the record, to resume or retry part of it
+  uint32_t len;        // 0 = up to the end of the record
+} download_req_t;
+
+typedef struct __attribute__((__packed__)) {
+  uint32_t len;
+  uint32_t stream_len;
+  uint32_t count;      // Records in the log
+  uint32_t record_len;
+} download_resp_t;
+
+bool slot_log_pending[FRAME_SLOTS];
+int8_t log_slot = -1;
+volatile int8_t log_request = -1; // SD_LOG_OP_START / SD_LOG_OP_STOP, carried out from the main loop
+uint32_t log_request_capacity = 0;
+volatile bool download_active = false;
+
+// Readout profiles bundle the ADC setup, the pixel clock and on-chip binning
+typedef struct {
+  uint8_t adc_resolution;
+  uint8_t adc_averaging;
+  uint8_t binning;     // Square, summed on the output node before the ADC samples it
+  float half_pixel_us; // Pixel timer period
+  ADC_CONVERSION_SPEED conversion_speed;
+  ADC_SAMPLING_SPEED sampling_speed;
+} readout_profile_t;
+
+#define PROFILE_STANDARD 0
+#define PROFILE_PREVIEW 1
+#define PROFILE_QUALITY 2
+#define PROFILES 3
+
+// The pixel ISR has to fit in the period, or with its priority above USB it takes the whole CPU. A 4x binned
+// rising edge shifts three more columns onto the output node first (about 2.5 us with the conversion), so
+// preview runs a slower clock and still reads out about five times faster than standard.
+const readout_profile_t profiles[PROFILES] = {
+  { 10, 1, 1, T_HALF_PIXEL_US, ADC_CONVERSION_SPEED::HIGH_SPEED, ADC_SAMPLING_SPEED::HIGH_SPEED },           // Standard
+  { 8, 1, 4, 3 * T_HALF_PIXEL_US, ADC_CONVERSION_SPEED::VERY_HIGH_SPEED, ADC_SAMPLING_SPEED::VERY_HIGH_SPEED },  // Preview
+  { 12, 4, 1, 5 * T_HALF_PIXEL_US, ADC_CONVERSION_SPEED::MED_SPEED, ADC_SAMPLING_SPEED::MED_SPEED },        // Quality
+};
+
+// Measured on the last frame read out with each profile
+typedef struct {
+  uint32_t frames;
+  uint32_t frame_us;
+  uint32_t noise_mlsb; // Read noise in 1/1000 LSB
+} profile_result_t;
+
+typedef struct __attribute__((__packed__)) {
+  uint8_t id;
+  uint8_t adc_resolution;
+  uint8_t adc_averaging;
+  uint8_t binning;
+  uint32_t half_pixel_ns;
+  uint16_t rows;
+  uint16_t cols;
+  uint32_t frames;
+  uint32_t frame_us;
+  uint32_t noise_mlsb;
+} profile_info_t;
+
+uint8_t profile = PROFILE_STANDARD;
+profile_result_t profile_results[PROFILES];
+
+// Interrupt priorities, lower is more urgent. The pixel clock goes above USB by default, so command handling
+// in the USB ISR (Faxitron commands block on the serial port) can't stretch the pixel timing.
+#define PIXEL_TIMER_PRIORITY 16
+#define USB_PRIORITY 128
+
+#define TIMING_OP_PRIORITIES 0x00
+#define TIMING_OP_STRESS 0x01
+#define TIMING_OP_RESULTS 0x02
+#define TIMING_OP_SAMPLE 0x03
+#define TIMING_HIST_BINS 8
+
+// Pixel clock timing of the last readout, and how the bulk endpoint fared meanwhile
+typedef struct __attribute__((__packed__)) {
+  uint8_t pixel_priority;
+  uint8_t usb_priority;
+  uint8_t stress;          // A stress stream ran during the readout
+  uint8_t sampled;         // Edges were timed, only then are the edge and USB counts filled in
+  uint32_t period_cycles;  // Expected cycles between edges
+  uint32_t edges;
+  uint32_t late_edges;     // More than a quarter period late
+  uint32_t dropped_edges;  // Timer periods that passed without an edge
+  int32_t jitter_min_cycles;
+  int32_t jitter_max_cycles;
+  uint32_t nak_samples;    // Edges that saw the bulk endpoint NAK since the previous one
+  uint32_t stall_samples;
+  uint32_t bulk_bytes;
+  uint32_t jitter_hist[TIMING_HIST_BINS]; // |jitter| below 16 << bin cycles, the last bin takes the rest
+} timing_stats_t;
+
+timing_stats_t timing;
+uint8_t pixel_priority = PIXEL_TIMER_PRIORITY;
+uint8_t usb_priority = USB_PRIORITY;
+bool timing_sample = false; // Time the edges of every readout, not just stress runs
+uint32_t timing_last_cycles = 0;
+uint64_t timing_elapsed_cycles = 0;
+uint32_t timing_bulk_start = 0;
+
+// Stress test stream, raw slot memory over and over
+struct {
+  uint8_t *base;
+  uint32_t len;
+  uint32_t pos;
+  uint32_t end;
+} stress;
+
+// Geometry of the frame being read out, binned frames are packed at the start of the slot
+uint16_t *readout_base = &pixel_buffer[0][0][0];
+uint8_t binning = 1;
+uint32_t frame_rows = SENSOR_ROWS;
+uint32_t frame_cols = SENSOR_COLUMNS;
+uint32_t pixel_index = 0;
+volatile uint32_t rows_read = 0;
+
+typedef struct __attribute__((__packed__)) {
+  uint8_t slot;
+  uint8_t stride;      // Every stride'th row and column
+  uint16_t row_start;
+  uint16_t row_count;  // 0 = up to the last row
+  uint16_t col_start;
+  uint16_t col_count;  // 0 = up to the last column
+  uint32_t offset;     // Byte range within the resulting stream, to resume or retry part of it
+  uint32_t len;        // 0 = up to the end of the stream
+} fetch_req_t;
+
+typedef struct __attribute__((__packed__)) {
+  uint32_t len;        // Payload bytes
+  uint16_t rows;
+  uint16_t cols;
+  uint32_t stream_len; // Payload plus chunk headers, what the host should read
+  uint32_t frame_crc;  // CRC of the whole slot
+  uint8_t frame_crc_valid;
+} fetch_resp_t;
+
+// Every bulk chunk starts with this, exactly one cache line so the DCP can write the payload behind it
+#define CHUNK_MAGIC 0x4B484344 // "DCHK"
+typedef struct __attribute__((__packed__)) {
+  uint32_t magic;
+  uint16_t tag;    // Of the fetch request, chunks of an aborted stream can be told apart
+  uint16_t flags;
+  uint32_t offset; // Of the payload within the requested range
+  uint32_t len;
+  uint32_t crc;    // CRC-32/MPEG-2 of the payload
+  uint32_t sequence; // Of the frame the payload belongs to
+  uint8_t reserved[8];
+} chunk_header_t;
+
+// Readout conditions, captured per slot for the frame header
+typedef struct {
+  uint32_t sequence;
+  uint8_t high_gain;
+  uint8_t readout_mode;
+  uint8_t timing_profile;
+  uint8_t adc_resolution;
+  uint8_t adc_averaging;
+  uint32_t start_ms;
+  uint32_t start_us;
+  uint32_t end_us;
+  uint16_t faxitron_kv;
+  uint16_t faxitron_exposure_ds;
+  uint8_t faxitron_state;
+  uint8_t corrections;
+  uint8_t binning;
+  uint16_t rows;
+  uint16_t cols;
+} frame_meta_t;
+
+#define READOUT_MODE_SENSOR 0
+#define READOUT_MODE_TEST_PATTERN 1
+
+// Readouts generate a test pattern instead of touching the CCD while one is selected
+typedef struct __attribute__((__packed__)) {
+  uint8_t pattern;
+  uint8_t reserved[3];
+  uint32_t seed;
+  uint32_t row_rate;   // Rows per second, 0 = as fast as the loop gets to them
+} test_pattern_config_t;
+
+#define TEST_PATTERN_ROWS_PER_LOOP 64
+
+test_pattern_config_t test_pattern = { .pattern = TEST_PATTERN_OFF };
+bool test_pattern_active = false;
+
+// Corrections applied on the device, flags in the frame header
+#define CORRECTION_BAD_PIXELS (1 << 0)
+#define CORRECTION_DARK (1 << 1)
+#define CORRECTION_GAIN (1 << 2)
+
+// Sent in front of every bulk stream
+#define FRAME_MAGIC 0x4D524644 // "DFRM"
+#define FRAME_HEADER_VERSION 1
+typedef struct __attribute__((__packed__)) {
+  uint32_t magic;
+  uint16_t header_len;
+  uint16_t header_version;
+  uint32_t sequence;     // Frames read out since boot
+  uint8_t slot;
+  uint8_t high_gain;
+  uint8_t readout_mode;
+  uint8_t timing_profile;
+  uint16_t rows;         // Of the whole frame
+  uint16_t cols;
+  uint16_t row_start;    // Region in this stream
+  uint16_t col_start;
+  uint16_t region_rows;
+  uint16_t region_cols;
+  uint8_t stride;
+  uint8_t adc_resolution;
+  uint8_t adc_averaging;
+  uint8_t faxitron_state;
+  uint16_t faxitron_kv;
+  uint16_t faxitron_exposure_ds;
+  uint32_t readout_start_ms;
+  uint32_t readout_start_us;
+  uint32_t readout_end_us;
+  uint32_t stream_start_us;
+  uint32_t frame_crc;
+  uint8_t frame_crc_valid;
+  uint8_t corrections;
+  uint8_t binning;
+  uint8_t reserved[5];
+} frame_header_t;
+static_assert(sizeof(frame_header_t) % 32 == 0, "frame header must keep the payload cache line aligned");
+
+// Streaming statistics over the active area, updated by the row pipeline on the corrected rows
+#define STATS_HIST_BINS 1024
+#define STATS_COL_START (SENSOR_JUNK_COLS_PRE + SENSOR_DARK_COLS_PRE)
+#define STATS_INCLUDE_HISTOGRAM (1 << 0)
+#define STATS_INCLUDE_ROWS (1 << 1)
+
+typedef struct __attribute__((__packed__)) {
+  uint16_t min;
+  uint16_t max;
+  uint32_t sum;
+} row_stats_t;
+
+typedef struct {
+  bool valid;
+  uint8_t hist_shift; // bin = value >> hist_shift
+  uint16_t row_count; // Of the frame, binning scales these down
+  uint16_t col_start;
+  uint16_t cols;
+  uint16_t hist_row_start;
+  uint16_t hist_rows;
+  uint32_t histogram[STATS_HIST_BINS];
+  row_stats_t rows[SENSOR_ROWS];
+} frame_stats_t;
+
+typedef struct __attribute__((__packed__)) {
+  uint32_t sequence;
+  uint8_t valid;
+  uint8_t hist_shift;
+  uint16_t hist_bins;  // 0 if the histogram isn't included
+  uint16_t rows;       // 0 if the row stats aren't included
+  uint16_t col_start;  // Columns the row stats cover
+  uint16_t cols;
+  uint16_t reserved;
+} stats_resp_t;
+
+uint32_t frame_sequence = 0;
+frame_meta_t frame_meta[FRAME_SLOTS];
+frame_stats_t frame_stats[FRAME_SLOTS];
+uint32_t frame_crc[FRAME_SLOTS];
+bool frame_crc_valid[FRAME_SLOTS];
+
+// Rows the pixel ISR finished are corrected from the main loop, the frame is done after the last one
+uint32_t rows_processed = SENSOR_ROWS;
+
+// Read noise from the dark columns. Differences between consecutive rows of the same column cancel the
+// column offsets, their variance is twice the read noise variance.
+struct {
+  uint16_t prev[SENSOR_DARK_COLS_PRE + SENSOR_DARK_COLS_POST];
+  int64_t sum;
+  uint64_t sum_sq;
+  uint32_t count;
+} noise;
+
+typedef struct __attribute__((__packed__)) {
+  uint16_t count;     // Active entries
+  uint16_t staged;    // Entries uploaded since the last clear
+  uint16_t max_count;
+  uint8_t enabled;
+  uint8_t pending;    // Committed, activated between frames
+} bad_pixels_info_t;
+
+#define BAD_PIXELS_OP_CLEAR 0x00
+#define BAD_PIXELS_OP_ADD 0x01
+#define BAD_PIXELS_OP_COMMIT 0x02
+#define BAD_PIXELS_OP_READ 0x03
+#define BAD_PIXELS_OP_ENABLE 0x04
+
+typedef struct __attribute__((__packed__)) {
+  uint8_t dark_state;
+  uint8_t gain_state;
+  uint8_t active;     // CORRECTION_DARK | CORRECTION_GAIN, enabled and with a valid map
+  uint8_t gain_shift;
+  uint16_t pedestal;
+  uint16_t reserved;
+} calibration_info_t;
+
+#define CALIBRATION_OP_BEGIN 0x00
+#define CALIBRATION_OP_WRITE 0x01
+#define CALIBRATION_OP_COMMIT 0x02
+#define CALIBRATION_OP_CONFIGURE 0x03
+#define CALIBRATION_OP_INFO 0x04
+
+struct {
+  uint16_t tag;
+  uint8_t slot;
+  bool partial; // Rows of the frame being read out, the slot stays READING
+  bool header_sent;
+  uint32_t start_us;
+  uint16_t *base;
+  uint16_t frame_cols;
+  uint16_t row_start;
+  uint16_t col_start;
+  uint16_t rows;
+  uint16_t cols;
+  uint8_t stride;
+  uint32_t pos;
+  uint32_t end;
+} fetch;
 
 IntervalTimer pixelTimer;
 
+void stats_reset(frame_stats_t *stats, uint8_t adc_resolution) {
+  stats->valid = false;
+  stats->hist_shift = adc_resolution > 10 ? adc_resolution - 10 : 0;
+  stats->row_count = frame_rows;
+  stats->col_start = STATS_COL_START / binning;
+  stats->cols = SENSOR_RESOLUTION / binning;
+  stats->hist_row_start = SENSOR_DARK_ROWS / binning;
+  stats->hist_rows = SENSOR_RESOLUTION / binning;
+  memset(stats->histogram, 0, sizeof(stats->histogram));
+  for (uint32_t row = 0; row < SENSOR_ROWS; row++) {
+    stats->rows[row].min = 0xFFFF;
+    stats->rows[row].max = 0;
+    stats->rows[row].sum = 0;
+  }
+}
+
+void stats_add_row(frame_stats_t *stats, uint32_t row, const uint16_t *pixels) {
+  // Dark and junk columns would only pile up at the dark level, leave them out
+  row_stats_t *row_stats = &stats->rows[row];
+  bool histogram = row - stats->hist_row_start < stats->hist_rows;
+  uint16_t row_min = 0xFFFF;
+  uint16_t row_max = 0;
+  uint32_t row_sum = 0;
+  for (uint32_t col = stats->col_start; col < stats->col_start + stats->cols; col++) {
+    uint16_t value = pixels[col];
+    if (value < row_min) row_min = value;
+    if (value > row_max) row_max = value;
+    row_sum += value;
+    if (histogram) {
+      // Corrected values can go past the ADC range, they end up in the top bin
+      stats->histogram[min(value >> stats->hist_shift, STATS_HIST_BINS - 1)]++;
+    }
+  }
+  row_stats->min = row_min;
+  row_stats->max = row_max;
+  row_stats->sum = row_sum;
+}
+
+void noise_reset() {
+  noise.sum = 0;
+  noise.sum_sq = 0;
+  noise.count = 0;
+}
+
+void noise_add_row(uint32_t row, const uint16_t *pixels) {
+  static const uint16_t ranges[2][2] = {
+    { SENSOR_JUNK_COLS_PRE, STATS_COL_START },
+    { STATS_COL_START + SENSOR_RESOLUTION, STATS_COL_START + SENSOR_RESOLUTION + SENSOR_DARK_COLS_POST },
+  };
+  uint32_t n = 0;
+  for (uint32_t r = 0; r < 2; r++) {
+    for (uint32_t col = ranges[r][0] / binning; col < ranges[r][1] / binning; col++, n++) {
+      if (row > 0) {
+        int32_t diff = (int32_t) pixels[col] - noise.prev[n];
+        noise.sum += diff;
+        noise.sum_sq += (int64_t) diff * diff;
+        noise.count++;
+      }
+      noise.prev[n] = pixels[col];
+    }
+  }
+}
+
+uint32_t noise_mlsb() {
+  if (noise.count < 2) {
+    return 0;
+  }
+  double mean = (double) noise.sum / noise.count;
+  double variance = (double) noise.sum_sq / noise.count - mean * mean;
+  return (uint32_t) (sqrt(max(variance, 0.0) / 2) * 1000);
+}
+
+// Runs on every pixel timer edge of a sampled readout. It reads the USB controller too, which costs enough
+// to only do it when asked for.
+void timing_edge() {
+  uint32_t now = ARM_DWT_CYCCNT;
+  if (timing_last_cycles != 0) {
+    uint32_t delta = now - timing_last_cycles;
+    int32_t jitter = (int32_t) (delta - timing.period_cycles);
+    timing_elapsed_cycles += delta;
+    timing.edges++;
+    timing.jitter_min_cycles = min(timing.jitter_min_cycles, jitter);
+    timing.jitter_max_cycles = max(timing.jitter_max_cycles, jitter);
+    if (jitter > (int32_t) (timing.period_cycles / 4)) {
+      timing.late_edges++;
+    }
+    uint32_t magnitude = (uint32_t) abs(jitter) >> 4;
+    uint32_t bin = magnitude == 0 ? 0 : 32 - __builtin_clz(magnitude);
+    timing.jitter_hist[min(bin, (uint32_t) TIMING_HIST_BINS - 1)]++;
+  }
+  timing_last_cycles = now;
+
+  timing.nak_samples += usb_dalsa_bulk_nak();
+  timing.stall_samples += usb_dalsa_bulk_stalled();
+}
+
+void timing_finish() {
+  // A late edge is only a drop if the timer fired once for several periods, which shows in the total
+  uint32_t periods = (timing_elapsed_cycles + timing.period_cycles / 2) / timing.period_cycles;
+  timing.dropped_edges = periods > timing.edges ? periods - timing.edges : 0;
+  timing.bulk_bytes = usb_dalsa_bulk_bytes() - timing_bulk_start;
+}
+
 void pixel_irq(){
+  if (state.busy && timing.sampled) {
+    timing_edge();
+  }
+
   if (state.rising_edge) {
     if (state.busy) {
       if(state.ph_v_counter > 0) {
-        // Vertical phase (rows)
-        uint32_t v_t_us = (T_PH_H_TOTAL_US - state.ph_v_counter * T_HALF_PIXEL_US);
+        // Vertical phase (rows), repeated for every binned row
+        uint32_t v_t_us = (T_PH_H_TOTAL_US - ((state.ph_v_counter - 1) % T_PH_H_TOTAL_US + 1) * T_HALF_PIXEL_US);
         if(v_t_us < T_PH_V_PRE_US) {
           PHASE_V(false, false);
         } else if(v_t_us < T_PH_V_PRE_US + T_PH_V_PULSE_US) {
@@ -80,7 +577,14 @@ void pixel_irq(){
         }
         state.ph_v_counter--;
       } else {
-        // Horizontal phase (columns)
+        // Horizontal phase (columns). Binned columns are shifted onto the output node first, without a
+        // reset in between, so their charge adds up before the sample.
+        for (uint32_t i = 1; i < binning; i++) {
+          PHASE_H(true);
+          delayNanoseconds(250);
+          PHASE_H(false);
+          delayNanoseconds(250);
+        }
         PHASE_H(true);
         delayNanoseconds(250);
 
@@ -90,22 +594,28 @@ void pixel_irq(){
         // Atomically read pixel value
         noInterrupts();
         while (!adc->adc0->isComplete());
-        pixel_buffer[state.row][state.col] = adc->adc0->readSingle();
+        uint16_t value = adc->adc0->readSingle();
         interrupts();
+        readout_base[pixel_index++] = value;
 
-        // Next pixel!
-        state.col++;
-        if (state.col >= SENSOR_COLUMNS) {
+        // Next pixel! Columns that don't fill a whole bin stay in the register and end up in the junk columns
+        state.col += binning;
+        if (state.col + binning > SENSOR_COLUMNS) {
           state.col = 0;
-          state.row++;
+          state.row += binning;
+          rows_read++;
+          if (rows_read % 16 == 0) {
+            TRACE_COUNTER(TRACE_ROWS_READ, rows_read);
+          }
 
           // Next row!
-          state.ph_v_counter = T_PH_H_TOTAL_US;
+          state.ph_v_counter = T_PH_H_TOTAL_US * binning;
 
-          if (state.row >= SENSOR_ROWS) {
-            state.busy = false; // We're done!
-            state.done = true;
-            arm_dcache_flush_delete(pixel_buffer, sizeof(pixel_buffer));
+          if (state.row + binning > SENSOR_ROWS) {
+            state.busy = false; // We're done! The row pipeline finishes the frame
+            frame_meta[readout_slot].end_us = micros();
+            TRACE_END(TRACE_READOUT, readout_slot, rows_read);
+            timing_finish();
 
             digitalWrite(PIN_LED0, LOW);
 
@@ -130,99 +640,1085 @@ void pixel_irq(){
   state.rising_edge = !state.rising_edge;
 }
 
-bool start_readout(bool high_gain){
-  if (state.busy) {
-    return false;
+bool frame_in_progress() {
+  return state.busy || rows_processed < frame_rows || crc_slot >= 0;
+}
+
+// Free slot first, then the oldest frame nobody is transferring, -1 if there's none
+int find_readout_slot() {
+  int best = -1;
+  for (int slot = 0; slot < FRAME_SLOTS; slot++) {
+    if (slot_state[slot] == SLOT_FREE) {
+      return slot;
+    }
+    if (slot_state[slot] == SLOT_READY && !slot_log_pending[slot] && (best < 0 || frame_meta[slot].sequence < frame_meta[best].sequence)) {
+      best = slot;
+    }
+  }
+  return best;
+}
+
+// Resolves SLOT_LATEST, -1 if there's no such slot or no complete frame in it
+int find_frame_slot(uint8_t slot) {
+  if (slot != SLOT_LATEST) {
+    return slot < FRAME_SLOTS && (slot_state[slot] == SLOT_READY || slot_state[slot] == SLOT_TRANSFER) ? slot : -1;
+  }
+  int best = -1;
+  for (int i = 0; i < FRAME_SLOTS; i++) {
+    if ((slot_state[i] == SLOT_READY || slot_state[i] == SLOT_TRANSFER) && (best < 0 || frame_meta[i].sequence > frame_meta[best].sequence)) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+void start_readout(uint8_t slot, bool high_gain){
+  TRACE_BEGIN(TRACE_READOUT, slot, high_gain);
+  const readout_profile_t *p = &profiles[profile];
+  bool sensor = test_pattern.pattern == TEST_PATTERN_OFF;
+
+  if (sensor) {
+    // Enable LED
+    digitalWrite(PIN_LED0, HIGH);
+
+    // Initialize phases
+    PHASE_V(false, false);
+    PHASE_H(true);
+    PHASE_R(false);
+
+    // Setup analog path
+    digitalWrite(PIN_DRV_SW_PH_H21, !high_gain);
+    digitalWrite(PIN_DRV_SW_PH_H22, high_gain);
+
+    // Setup read ADC and pixel clock
+    adc->adc0->setAveraging(p->adc_averaging);
+    adc->adc0->setResolution(p->adc_resolution);
+    adc->adc0->setConversionSpeed(p->conversion_speed);
+    adc->adc0->setSamplingSpeed(p->sampling_speed);
+    adc->adc0->wait_for_cal();
+    pixelTimer.update(p->half_pixel_us);
   }
 
-  // Enable LED
-  digitalWrite(PIN_LED0, HIGH);
+  binning = p->binning;
+  frame_rows = SENSOR_ROWS / binning;
+  frame_cols = SENSOR_COLUMNS / binning;
 
-  // Initialize phases
-  PHASE_V(false, false);
-  PHASE_H(true);
-  PHASE_R(false);
+  readout_slot = slot;
+  readout_base = &pixel_buffer[slot][0][0];
+  slot_state[slot] = SLOT_READING;
 
-  // Setup analog path
-  digitalWrite(PIN_DRV_SW_PH_H21, !high_gain);
-  digitalWrite(PIN_DRV_SW_PH_H22, high_gain);
+  // Capture the conditions for the frame header
+  frame_meta_t *meta = &frame_meta[slot];
+  meta->sequence = frame_sequence++;
+  meta->high_gain = high_gain;
+  meta->readout_mode = sensor ? READOUT_MODE_SENSOR : READOUT_MODE_TEST_PATTERN;
+  meta->timing_profile = profile;
+  meta->adc_resolution = p->adc_resolution;
+  meta->adc_averaging = p->adc_averaging;
+  meta->binning = binning;
+  meta->rows = frame_rows;
+  meta->cols = frame_cols;
+  meta->start_ms = millis();
+  meta->start_us = micros();
+  meta->end_us = 0;
+  meta->faxitron_kv = faxitron.kv;
+  meta->faxitron_exposure_ds = faxitron.exposure_ds;
+  meta->faxitron_state = faxitron.state;
+  // The maps are per sensor pixel, binned frames go out uncorrected. Test patterns have to arrive as generated.
+  meta->corrections = 0;
+  if (binning == 1 && sensor) {
+    meta->corrections |= (bad_pixels_enabled() && bad_pixels_count() > 0) ? CORRECTION_BAD_PIXELS : 0;
+    meta->corrections |= calibration_dark_active() ? CORRECTION_DARK : 0;
+    meta->corrections |= calibration_gain_active() ? CORRECTION_GAIN : 0;
+  }
 
-  // Setup read ADC
-  adc->adc0->setAveraging(1);
-  adc->adc0->setResolution(10);
-  adc->adc0->setConversionSpeed(ADC_CONVERSION_SPEED::HIGH_SPEED);
-  adc->adc0->setSamplingSpeed(ADC_SAMPLING_SPEED::HIGH_SPEED);
-  adc->adc0->wait_for_cal();
+  stats_reset(&frame_stats[slot], meta->adc_resolution);
+  noise_reset();
+  memset(&timing, 0, sizeof(timing));
+  timing.pixel_priority = pixel_priority;
+  timing.usb_priority = usb_priority;
+  timing.sampled = timing_sample;
+  timing.period_cycles = p->half_pixel_us * (F_CPU_ACTUAL / 1000000);
+  timing.jitter_min_cycles = INT32_MAX;
+  timing.jitter_max_cycles = INT32_MIN;
+  timing_last_cycles = 0;
+  timing_elapsed_cycles = 0;
+  timing_bulk_start = usb_dalsa_bulk_bytes();
+  bad_pixels_start_frame();
+  rows_processed = 0;
+  rows_read = 0;
+  pixel_index = 0;
 
   // Setup state
+  frame_crc_valid[slot] = false;
   state.row = 0;
   state.col = 0;
   state.done = false;
   state.rising_edge = false;
-  state.ph_v_counter = T_PH_H_TOTAL_US; // Start with a fresh row
+  state.ph_v_counter = T_PH_H_TOTAL_US * binning; // Start with a fresh row
   state.readout_pin = high_gain ? PIN_P1_VOUT2 : PIN_P1_VOUT1;
-  state.busy = true;
+  state.busy = sensor;
+  test_pattern_active = !sensor;
+
+  usb_dalsa_post_event(DALSA_EVENT_READOUT_STARTED, slot, frame_rows);
+}
+
+uint8_t request_readout(bool high_gain) {
+  if (!frame_in_progress() && !readout_queued) {
+    int slot = find_readout_slot();
+    if (slot >= 0) {
+      start_readout(slot, high_gain);
+      return READOUT_STARTED;
+    }
+  }
+
+  // One readout can wait for the current one or for a slot to come back from USB
+  if (readout_queued) {
+    post_error(ERROR_READOUT_BUSY, 0);
+    return READOUT_REJECTED;
+  }
+  readout_queued = true;
+  queued_high_gain = high_gain;
+  TRACE_INSTANT(TRACE_READOUT_QUEUED, high_gain, 0);
+  return READOUT_QUEUED;
+}
+
+uint16_t parse_uint(const uint8_t *digits, uint32_t len) {
+  uint16_t value = 0;
+  for (uint32_t i = 0; i < len && digits[i] >= '0' && digits[i] <= '9'; i++) {
+    value = value * 10 + (digits[i] - '0');
+  }
+  return value;
+}
+
+#define FAXITRON_RESPONSE_LEN 10
+#define FAXITRON_POLL_MS 500
+#define FAXITRON_POLL_IDLE_MS 2000 // Host commands are left alone for this long, exposures are several in a row
+#define FAXITRON_POLL_TIMEOUT_MS 1000 // Stream default, same as a host command gets
+
+// State query from loop(), sent and collected without blocking. A host command in the USB ISR finishes it
+// first, its response is next on the wire.
+struct {
+  bool pending;
+  uint32_t sent_ms;
+  uint32_t len;
+  uint8_t response[FAXITRON_RESPONSE_LEN];
+} faxitron_poll;
+
+// Pushes state changes to the host instead of making it poll for them
+void faxitron_update_state(uint8_t state) {
+  if (state != faxitron.state) {
+    faxitron.state = state;
+    TRACE_INSTANT(TRACE_FAXITRON_STATE, faxitron.state, 0);
+    usb_dalsa_post_event(DALSA_EVENT_FAXITRON_STATE, faxitron.state, 0);
+  }
+}
 
-  return true;
+void faxitron_poll_done() {
+  if (faxitron_poll.len == 3 && faxitron_poll.response[0] == '?' && faxitron_poll.response[1] == 'S') {
+    faxitron_update_state(faxitron_poll.response[2]);
+  }
+  faxitron_poll.pending = false;
 }
 
 uint32_t faxitron_command(uint8_t* command, uint32_t command_len, uint8_t *response, uint32_t max_response_len) {
+  if (faxitron_poll.pending) {
+    faxitron_poll.len += Serial2.readBytesUntil('\r', &faxitron_poll.response[faxitron_poll.len], FAXITRON_RESPONSE_LEN - faxitron_poll.len);
+    faxitron_poll_done();
+  }
+  faxitron.last_command_ms = millis();
+
+  TRACE_BEGIN(TRACE_FAXITRON_COMMAND, command_len > 1 ? command[0] | (command[1] << 8) : 0, 0);
   if (command_len > 0) {
     Serial2.write(command, command_len);
     Serial2.write('\r');
     Serial2.flush();
   }
-  return (uint32_t) Serial2.readBytesUntil('\r', response, max_response_len);
+  uint32_t response_len = (uint32_t) Serial2.readBytesUntil('\r', response, max_response_len);
+  TRACE_END(TRACE_FAXITRON_COMMAND, 0, response_len);
+
+  if (command_len > 0 && response_len == 0) {
+    post_error(ERROR_FAXITRON_TIMEOUT, command[0]);
+  }
+
+  if (command_len == 2 && command[0] == '?' && command[1] == 'S' && response_len == 3) {
+    faxitron_update_state(response[2]);
+  }
+
+  // Keep the settings around for the frame headers, both from queries and from accepted set commands
+  if (response_len > 2 && response[0] == '?' && response[1] == 'V') {
+    faxitron.kv = parse_uint(&response[2], response_len - 2);
+  } else if (response_len > 2 && response[0] == '?' && response[1] == 'T') {
+    faxitron.exposure_ds = parse_uint(&response[2], response_len - 2);
+  } else if (command_len > 2 && response_len > 0 && command[0] == '!' && command[1] == 'V') {
+    faxitron.kv = parse_uint(&command[2], command_len - 2);
+  } else if (command_len > 2 && response_len > 0 && command[0] == '!' && command[1] == 'T') {
+    faxitron.exposure_ds = parse_uint(&command[2], command_len - 2);
+  }
+
+  return response_len;
+}
+
+// Keeps an eye on the Faxitron state (door, warm-up) while the host isn't talking to it
+void poll_faxitron() {
+  // Host commands run in the USB ISR, they must not interleave with the query
+  NVIC_DISABLE_IRQ(IRQ_USB1);
+  uint32_t now = millis();
+  if (faxitron_poll.pending) {
+    while (Serial2.available() > 0 && faxitron_poll.pending) {
+      int c = Serial2.read();
+      if (c == '\r') {
+        faxitron_poll_done();
+      } else if (faxitron_poll.len < FAXITRON_RESPONSE_LEN) {
+        faxitron_poll.response[faxitron_poll.len++] = c;
+      }
+    }
+    if (faxitron_poll.pending && now - faxitron_poll.sent_ms > FAXITRON_POLL_TIMEOUT_MS) {
+      faxitron_poll.pending = false;
+    }
+  } else if (now - faxitron_poll.sent_ms >= FAXITRON_POLL_MS && now - faxitron.last_command_ms >= FAXITRON_POLL_IDLE_MS) {
+    Serial2.write("?S\r");
+    faxitron_poll.pending = true;
+    faxitron_poll.sent_ms = now;
+    faxitron_poll.len = 0;
+  }
+  NVIC_ENABLE_IRQ(IRQ_USB1);
+}
+
+// Describes the whole frame in a slot, fetches narrow the region down
+void fill_frame_header(frame_header_t *header, uint8_t slot) {
+  frame_meta_t *meta = &frame_meta[slot];
+  memset(header, 0, sizeof(frame_header_t));
+  header->magic = FRAME_MAGIC;
+  header->header_len = sizeof(frame_header_t);
+  header->header_version = FRAME_HEADER_VERSION;
+  header->sequence = meta->sequence;
+  header->slot = slot;
+  header->high_gain = meta->high_gain;
+  header->readout_mode = meta->readout_mode;
+  header->timing_profile = meta->timing_profile;
+  header->rows = meta->rows;
+  header->cols = meta->cols;
+  header->row_start = 0;
+  header->col_start = 0;
+  header->region_rows = meta->rows;
+  header->region_cols = meta->cols;
+  header->stride = 1;
+  header->adc_resolution = meta->adc_resolution;
+  header->adc_averaging = meta->adc_averaging;
+  header->faxitron_state = meta->faxitron_state;
+  header->faxitron_kv = meta->faxitron_kv;
+  header->faxitron_exposure_ds = meta->faxitron_exposure_ds;
+  header->readout_start_ms = meta->start_ms;
+  header->readout_start_us = meta->start_us;
+  header->readout_end_us = meta->end_us;
+  header->stream_start_us = micros();
+  header->frame_crc = frame_crc[slot];
+  header->frame_crc_valid = frame_crc_valid[slot];
+  header->corrections = meta->corrections;
+  header->binning = meta->binning;
+}
+
+// Bulk stream source for the current fetch: the frame header, then chunks of header + payload
+uint32_t fetch_source(uint8_t *staging, uint32_t max_len, uint8_t **data) {
+  uint32_t header_len = 0;
+  if (!fetch.header_sent) {
+    frame_header_t *frame_header = (frame_header_t *) staging;
+    fill_frame_header(frame_header, fetch.slot);
+    frame_header->row_start = fetch.row_start;
+    frame_header->col_start = fetch.col_start;
+    frame_header->region_rows = fetch.rows;
+    frame_header->region_cols = fetch.cols;
+    frame_header->stride = fetch.stride;
+    frame_header->stream_start_us = fetch.start_us;
+    header_len = sizeof(frame_header_t);
+    fetch.header_sent = true;
+  } else if (fetch.pos >= fetch.end) {
+    return 0;
+  }
+
+  chunk_header_t *header = (chunk_header_t *) (staging + header_len);
+  uint8_t *payload = staging + header_len + sizeof(chunk_header_t);
+  uint32_t len = min(fetch.end - fetch.pos, max_len - header_len - sizeof(chunk_header_t));
+  uint32_t crc = 0xFFFFFFFF;
+  if (len == 0) {
+    // Empty range, the stream is just the headers
+  } else if (fetch.stride == 1 && fetch.cols == fetch.frame_cols) {
+    // Whole rows are contiguous, the DCP copies them out of PSRAM and checksums them on the way
+    crc = dcp_copy_crc32(payload, ((uint8_t *) &fetch.base[fetch.row_start * fetch.frame_cols]) + fetch.pos, len);
+  } else {
+    uint16_t *out = (uint16_t *) payload;
+    uint32_t pixel = fetch.pos / sizeof(uint16_t);
+    uint32_t row = pixel / fetch.cols;
+    uint32_t col = pixel % fetch.cols;
+    for (uint32_t i = 0; i < len / sizeof(uint16_t); i++) {
+      out[i] = fetch.base[(fetch.row_start + row * fetch.stride) * fetch.frame_cols + fetch.col_start + col * fetch.stride];
+      if (++col >= fetch.cols) {
+        col = 0;
+        row++;
+      }
+    }
+    crc = dcp_crc32(payload, len);
+  }
+
+  header->magic = CHUNK_MAGIC;
+  header->tag = fetch.tag;
+  header->flags = 0;
+  header->offset = fetch.pos;
+  header->len = len;
+  header->crc = crc;
+  header->sequence = frame_meta[fetch.slot].sequence;
+  memset(header->reserved, 0, sizeof(header->reserved));
+
+  fetch.pos += len;
+  *data = staging;
+  return header_len + sizeof(chunk_header_t) + len;
+}
+
+uint8_t start_fetch(uint16_t tag, fetch_req_t *req, fetch_resp_t *resp) {
+  // The frame being read out can be fetched as far as the row pipeline got, named by its slot
+  bool partial = req->slot == readout_slot && slot_state[readout_slot] == SLOT_READING && !abort_requested;
+  int slot = partial ? readout_slot : find_frame_slot(req->slot);
+  if (slot < 0) {
+    return DALSA_STATUS_INVALID_ARGUMENT;
+  }
+  frame_meta_t *meta = &frame_meta[slot];
+  uint32_t available_rows = partial ? rows_processed : meta->rows;
+  if (req->stride == 0 || req->row_start >= meta->rows || req->col_start >= meta->cols) {
+    return DALSA_STATUS_INVALID_ARGUMENT;
+  }
+
+  uint32_t row_count = req->row_count != 0 ? req->row_count : meta->rows - req->row_start;
+  uint32_t col_count = req->col_count != 0 ? req->col_count : meta->cols - req->col_start;
+  if (req->row_start + row_count > meta->rows || req->col_start + col_count > meta->cols) {
+    return DALSA_STATUS_INVALID_ARGUMENT;
+  }
+  if (req->row_start + row_count > available_rows) {
+    return DALSA_STATUS_BUSY; // Not read out yet
+  }
+
+  uint32_t rows = (row_count + req->stride - 1) / req->stride;
+  uint32_t cols = (col_count + req->stride - 1) / req->stride;
+  uint32_t stream_len = rows * cols * sizeof(uint16_t);
+  uint32_t len = req->len != 0 ? req->len : stream_len - min(req->offset, stream_len);
+  if ((req->offset % sizeof(uint16_t)) != 0 || (len % sizeof(uint16_t)) != 0 || req->offset + len > stream_len) {
+    return DALSA_STATUS_INVALID_ARGUMENT;
+  }
+
+  usb_dalsa_abort_bulk_stream();
+  download_active = false;
+  if (transfer_slot >= 0) {
+    slot_state[transfer_slot] = SLOT_READY;
+    transfer_slot = -1;
+  }
+  if (partial) {
+    // The rows are final, but only the CPU has seen them so far, the DCP reads memory
+    arm_dcache_flush(&pixel_buffer[slot][0][0] + req->row_start * meta->cols, row_count * meta->cols * sizeof(uint16_t));
+  } else {
+    transfer_slot = slot;
+    slot_state[slot] = SLOT_TRANSFER;
+  }
+
+  fetch.tag = tag;
+  fetch.slot = slot;
+  fetch.partial = partial;
+  fetch.header_sent = false;
+  fetch.start_us = micros();
+  fetch.base = &pixel_buffer[slot][0][0];
+  fetch.frame_cols = meta->cols;
+  fetch.row_start = req->row_start;
+  fetch.col_start = req->col_start;
+  fetch.rows = rows;
+  fetch.cols = cols;
+  fetch.stride = req->stride;
+  fetch.pos = req->offset;
+  fetch.end = req->offset + len;
+  usb_dalsa_start_bulk_stream(fetch_source);
+
+  // The first chunk shares its transfer with the frame header
+  uint32_t chunk_payload_len = usb_dalsa_bulk_chunk_len() - sizeof(chunk_header_t);
+  uint32_t first_payload_len = chunk_payload_len - sizeof(frame_header_t);
+  uint32_t chunks = 1;
+  if (len > first_payload_len) {
+    chunks += (len - first_payload_len + chunk_payload_len - 1) / chunk_payload_len;
+  }
+  resp->len = len;
+  resp->rows = rows;
+  resp->cols = cols;
+  resp->stream_len = sizeof(frame_header_t) + len + chunks * sizeof(chunk_header_t);
+  resp->frame_crc = frame_crc[slot];
+  resp->frame_crc_valid = frame_crc_valid[slot];
+  return DALSA_STATUS_OK;
+}
+
+struct {
+  uint16_t tag;
+  uint32_t record;
+  uint32_t start;  // Of the record within the log
+  uint32_t pos;
+  uint32_t end;
+} download;
+
+// Bulk stream source for a log download, chunks of header + payload straight from the card
+uint32_t download_source(uint8_t *staging, uint32_t max_len, uint8_t **data) {
+  if (download.pos >= download.end) {
+    return 0;
+  }
+
+  chunk_header_t *header = (chunk_header_t *) staging;
+  uint8_t *payload = staging + sizeof(chunk_header_t);
+  uint32_t len = min(download.end - download.pos, max_len - sizeof(chunk_header_t));
+  if (!sd_log_read(download.pos, payload, len)) {
+    return 0; // ends the stream early, the host requests the rest again
+  }
+
+  header->magic = CHUNK_MAGIC;
+  header->tag = download.tag;
+  header->flags = 0;
+  header->offset = download.pos - download.start;
+  header->len = len;
+  header->crc = dcp_crc32(payload, len);
+  header->sequence = download.record;
+  memset(header->reserved, 0, sizeof(header->reserved));
+
+  download.pos += len;
+  *data = staging;
+  return sizeof(chunk_header_t) + len;
+}
+
+uint8_t start_download(uint16_t tag, download_req_t *req, download_resp_t *resp) {
+  // The card is only read while the logger is idle
+  if (sd_log_writing() || log_request >= 0) {
+    return DALSA_STATUS_BUSY;
+  }
+  uint32_t record_len = sd_log_record_len();
+  uint32_t len = req->len != 0 ? req->len : record_len - min(req->offset, record_len);
+  if (req->record >= sd_log_count() || req->offset + len > record_len) {
+    return DALSA_STATUS_INVALID_ARGUMENT;
+  }
+
+  usb_dalsa_abort_bulk_stream();
+  if (transfer_slot >= 0) {
+    slot_state[transfer_slot] = SLOT_READY;
+    transfer_slot = -1;
+  }
+
+  download.tag = tag;
+  download.record = req->record;
+  download.start = req->record * record_len;
+  download.pos = download.start + req->offset;
+  download.end = download.pos + len;
+  fetch.partial = false;
+  download_active = true;
+  usb_dalsa_start_bulk_stream(download_source);
+
+  uint32_t chunk_payload_len = usb_dalsa_bulk_chunk_len() - sizeof(chunk_header_t);
+  uint32_t chunks = max((len + chunk_payload_len - 1) / chunk_payload_len, (uint32_t) 1);
+  resp->len = len;
+  resp->stream_len = len + chunks * sizeof(chunk_header_t);
+  resp->count = sd_log_count();
+  resp->record_len = record_len;
+  return DALSA_STATUS_OK;
+}
+
+void set_irq_priorities(uint8_t pixel, uint8_t usb) {
+  pixel_priority = pixel;
+  usb_priority = usb;
+  pixelTimer.priority(pixel);
+  NVIC_SET_PRIORITY(IRQ_USB1, usb);
+}
+
+// Raw slot memory in whole chunks, no headers. Only there to load USB and PSRAM like a transfer would.
+uint32_t stress_source(uint8_t *staging, uint32_t max_len, uint8_t **data) {
+  if (stress.pos >= stress.end) {
+    return 0;
+  }
+  uint32_t len = min(stress.end - stress.pos, max_len);
+  *data = stress.base + stress.pos % stress.len;
+  stress.pos += len;
+  return len;
 }
 
+// Starts a readout with a bulk stream of stream_len bytes running alongside it
+uint8_t start_timing_stress(bool high_gain, uint32_t stream_len) {
+  if (frame_in_progress() || readout_queued) {
+    return DALSA_STATUS_BUSY;
+  }
+
+  usb_dalsa_abort_bulk_stream();
+  if (transfer_slot >= 0) {
+    slot_state[transfer_slot] = SLOT_READY;
+    transfer_slot = -1;
+  }
+  fetch.partial = false;
+  download_active = false;
+
+  int slot = find_readout_slot();
+  if (slot < 0) {
+    return DALSA_STATUS_BUSY;
+  }
+  start_readout(slot, high_gain);
+  timing.stress = 1;
+  timing.sampled = 1;
+
+  // Streams the other slot, the way a transfer of the previous frame would
+  uint32_t chunk_len = usb_dalsa_bulk_chunk_len();
+  stress.base = (uint8_t *) pixel_buffer[(slot + 1) % FRAME_SLOTS];
+  stress.len = sizeof(pixel_buffer[0]) / chunk_len * chunk_len;
+  stress.pos = 0;
+  stress.end = stream_len;
+  usb_dalsa_start_bulk_stream(stress_source);
+  return DALSA_STATUS_OK;
+}
+
+uint32_t timing_command(control_req_t *req, uint8_t *return_data, uint8_t *status) {
+  switch (req->data[0]) {
+    case TIMING_OP_PRIORITIES:
+      if (req->data_len < 3) {
+        *status = DALSA_STATUS_INVALID_LENGTH;
+        return 0;
+      }
+      if (frame_in_progress()) {
+        *status = DALSA_STATUS_BUSY;
+        return 0;
+      }
+      set_irq_priorities(req->data[1], req->data[2]);
+      break;
+    case TIMING_OP_STRESS: {
+      uint32_t stream_len;
+      if (req->data_len < 2 + sizeof(stream_len)) {
+        *status = DALSA_STATUS_INVALID_LENGTH;
+        return 0;
+      }
+      memcpy(&stream_len, &req->data[2], sizeof(stream_len));
+      *status = start_timing_stress(req->data[1] != 0, stream_len);
+      if (*status != DALSA_STATUS_OK) {
+        return 0;
+      }
+      break;
+    }
+    case TIMING_OP_SAMPLE:
+      if (req->data_len < 2) {
+        *status = DALSA_STATUS_INVALID_LENGTH;
+        return 0;
+      }
+      timing_sample = req->data[1] != 0;
+      break;
+    case TIMING_OP_RESULTS:
+      break;
+    default:
+      *status = DALSA_STATUS_INVALID_ARGUMENT;
+      return 0;
+  }
+
+  // Stats of the readout in progress are still moving, the host waits for FRAME_READY
+  memcpy(return_data, &timing, sizeof(timing));
+  return sizeof(timing);
+}
+
+uint32_t sd_log_command(control_req_t *req, uint8_t *return_data, uint8_t *status) {
+  uint8_t op = req->data[0];
+  switch (op) {
+    case SD_LOG_OP_START:
+    case SD_LOG_OP_STOP:
+      if (op == SD_LOG_OP_START && req->data_len < 1 + sizeof(uint32_t)) {
+        *status = DALSA_STATUS_INVALID_LENGTH;
+        return 0;
+      }
+      if (log_request >= 0 || download_active) {
+        *status = DALSA_STATUS_BUSY;
+        return 0;
+      }
+      if (op == SD_LOG_OP_START) {
+        memcpy(&log_request_capacity, &req->data[1], sizeof(uint32_t));
+      }
+      log_request = op;
+      break;
+    case SD_LOG_OP_INFO:
+      break;
+    default:
+      *status = DALSA_STATUS_INVALID_ARGUMENT;
+      return 0;
+  }
+
+  uint8_t pending = log_request >= 0;
+  for (uint8_t slot = 0; slot < FRAME_SLOTS; slot++) {
+    pending += slot_log_pending[slot];
+  }
+  sd_log_info_t info = {
+    .card = sd_log_card(),
+    .active = sd_log_active(),
+    .pending = pending,
+    .reserved = 0,
+    .capacity = sd_log_capacity(),
+    .count = sd_log_count(),
+    .record_len = sd_log_record_len(),
+  };
+  memcpy(return_data, &info, sizeof(info));
+  return sizeof(info);
+}
+
+uint32_t bad_pixels_command(control_req_t *req, uint8_t *return_data, uint32_t max_return_len, uint8_t *status) {
+  uint8_t op = req->data[0];
+  uint8_t *args = &req->data[1];
+  uint32_t args_len = req->data_len - 1;
+
+  switch (op) {
+    case BAD_PIXELS_OP_CLEAR:
+      bad_pixels_stage_clear();
+      break;
+    case BAD_PIXELS_OP_ADD:
+      if ((args_len % sizeof(bad_pixel_t)) != 0) {
+        *status = DALSA_STATUS_INVALID_LENGTH;
+        return 0;
+      }
+      if (!bad_pixels_stage_add((bad_pixel_t *) args, args_len / sizeof(bad_pixel_t))) {
+        *status = DALSA_STATUS_INVALID_ARGUMENT;
+        return 0;
+      }
+      break;
+    case BAD_PIXELS_OP_COMMIT:
+      bad_pixels_commit();
+      break;
+    case BAD_PIXELS_OP_READ:
+      break;
+    case BAD_PIXELS_OP_ENABLE:
+      if (args_len < 1) {
+        *status = DALSA_STATUS_INVALID_LENGTH;
+        return 0;
+      }
+      bad_pixels_set_enabled(args[0] != 0);
+      break;
+    default:
+      *status = DALSA_STATUS_INVALID_ARGUMENT;
+      return 0;
+  }
+
+  bad_pixels_info_t info = {
+    .count = (uint16_t) bad_pixels_count(),
+    .staged = (uint16_t) bad_pixels_staged(),
+    .max_count = BAD_PIXELS_MAX,
+    .enabled = bad_pixels_enabled(),
+    .pending = bad_pixels_pending(),
+  };
+  memcpy(return_data, &info, sizeof(info));
+  uint32_t return_len = sizeof(info);
+
+  // Reads return as many active entries as fit, starting at the requested index
+  if (op == BAD_PIXELS_OP_READ) {
+    uint16_t start = 0;
+    if (args_len >= sizeof(start)) {
+      memcpy(&start, args, sizeof(start));
+    }
+    uint32_t max_count = (max_return_len - return_len) / sizeof(bad_pixel_t);
+    return_len += bad_pixels_get((bad_pixel_t *) &return_data[return_len], start, max_count) * sizeof(bad_pixel_t);
+  }
+  return return_len;
+}
+
+uint32_t calibration_command(control_req_t *req, uint8_t *return_data, uint8_t *status) {
+  uint8_t op = req->data[0];
+  uint8_t *args = &req->data[1];
+  uint32_t args_len = req->data_len - 1;
+  uint32_t offset, crc;
+  uint16_t pedestal;
+
+  switch (op) {
+    case CALIBRATION_OP_BEGIN:
+      if (args_len < 1) {
+        *status = DALSA_STATUS_INVALID_LENGTH;
+        return 0;
+      }
+      // Would leave the frame in progress half corrected
+      if (frame_in_progress()) {
+        *status = DALSA_STATUS_BUSY;
+        return 0;
+      }
+      if (args[0] >= CALIBRATION_MAPS) {
+        *status = DALSA_STATUS_INVALID_ARGUMENT;
+        return 0;
+      }
+      if (!calibration_begin(args[0])) {
+        // With 8 MB of PSRAM the second map takes over the last frame slot, dropping the frame in it
+        uint8_t slot = FRAME_SLOTS - 1;
+        if (slot_state[slot] == SLOT_CALIBRATION) {
+          *status = DALSA_STATUS_NO_MEMORY;
+          return 0;
+        }
+        if (slot_state[slot] == SLOT_TRANSFER || slot_log_pending[slot]) {
+          *status = DALSA_STATUS_BUSY;
+          return 0;
+        }
+        slot_state[slot] = SLOT_CALIBRATION;
+        calibration_set_buffer(args[0], &pixel_buffer[slot][0][0]);
+        calibration_begin(args[0]);
+      }
+      break;
+    case CALIBRATION_OP_WRITE:
+      if (args_len < 1 + sizeof(offset) || ((args_len - 1 - sizeof(offset)) % sizeof(uint16_t)) != 0) {
+        *status = DALSA_STATUS_INVALID_LENGTH;
+        return 0;
+      }
+      memcpy(&offset, &args[1], sizeof(offset));
+      if (!calibration_write(args[0], offset, (uint16_t *) &args[1 + sizeof(offset)], (args_len - 1 - sizeof(offset)) / sizeof(uint16_t))) {
+        *status = DALSA_STATUS_INVALID_ARGUMENT;
+        return 0;
+      }
+      break;
+    case CALIBRATION_OP_COMMIT:
+      if (args_len < 1 + sizeof(crc)) {
+        *status = DALSA_STATUS_INVALID_LENGTH;
+        return 0;
+      }
+      memcpy(&crc, &args[1], sizeof(crc));
+      if (!calibration_commit(args[0], crc)) {
+        *status = DALSA_STATUS_INVALID_ARGUMENT;
+        return 0;
+      }
+      break;
+    case CALIBRATION_OP_CONFIGURE:
+      if (args_len < 1 + sizeof(pedestal)) {
+        *status = DALSA_STATUS_INVALID_LENGTH;
+        return 0;
+      }
+      if (frame_in_progress()) {
+        *status = DALSA_STATUS_BUSY;
+        return 0;
+      }
+      memcpy(&pedestal, &args[1], sizeof(pedestal));
+      calibration_configure(args[0] & CORRECTION_DARK, args[0] & CORRECTION_GAIN, pedestal);
+      break;
+    case CALIBRATION_OP_INFO:
+      break;
+    default:
+      *status = DALSA_STATUS_INVALID_ARGUMENT;
+      return 0;
+  }
+
+  calibration_info_t info = {
+    .dark_state = calibration_map_state(CALIBRATION_MAP_DARK),
+    .gain_state = calibration_map_state(CALIBRATION_MAP_GAIN),
+    .active = (uint8_t) ((calibration_dark_active() ? CORRECTION_DARK : 0) | (calibration_gain_active() ? CORRECTION_GAIN : 0)),
+    .gain_shift = CALIBRATION_GAIN_SHIFT,
+    .pedestal = calibration_pedestal(),
+    .reserved = 0,
+  };
+  memcpy(return_data, &info, sizeof(info));
+  return sizeof(info);
+}
+
+uint32_t get_profiles(uint8_t *return_data) {
+  return_data[0] = profile;
+  return_data[1] = PROFILES;
+  uint32_t return_len = 2;
+  for (uint8_t i = 0; i < PROFILES; i++) {
+    profile_info_t info = {
+      .id = i,
+      .adc_resolution = profiles[i].adc_resolution,
+      .adc_averaging = profiles[i].adc_averaging,
+      .binning = profiles[i].binning,
+      .half_pixel_ns = (uint32_t) (profiles[i].half_pixel_us * 1000),
+      .rows = (uint16_t) (SENSOR_ROWS / profiles[i].binning),
+      .cols = (uint16_t) (SENSOR_COLUMNS / profiles[i].binning),
+      .frames = profile_results[i].frames,
+      .frame_us = profile_results[i].frame_us,
+      .noise_mlsb = profile_results[i].noise_mlsb,
+    };
+    memcpy(&return_data[return_len], &info, sizeof(info));
+    return_len += sizeof(info);
+  }
+  return return_len;
+}
+
+uint32_t get_stats(uint8_t slot, uint8_t include, uint8_t *return_data, uint32_t max_return_len) {
+  frame_stats_t *stats = &frame_stats[slot];
+  stats_resp_t resp = {
+    .sequence = frame_meta[slot].sequence,
+    .valid = stats->valid,
+    .hist_shift = stats->hist_shift,
+    .hist_bins = (include & STATS_INCLUDE_HISTOGRAM) ? (uint16_t) STATS_HIST_BINS : (uint16_t) 0,
+    .rows = (include & STATS_INCLUDE_ROWS) ? stats->row_count : (uint16_t) 0,
+    .col_start = stats->col_start,
+    .cols = stats->cols,
+    .reserved = 0,
+  };
+  uint32_t hist_len = resp.hist_bins * sizeof(uint32_t);
+  uint32_t rows_len = resp.rows * sizeof(row_stats_t);
+  if (sizeof(resp) + hist_len + rows_len > max_return_len) {
+    return 0;
+  }
+
+  memcpy(return_data, &resp, sizeof(resp));
+  memcpy(return_data + sizeof(resp), stats->histogram, hist_len);
+  memcpy(return_data + sizeof(resp) + hist_len, stats->rows, rows_len);
+  return sizeof(resp) + hist_len + rows_len;
+}
+
+// Capability flags, reported by the capabilities command
+#define CAP_FAXITRON_SERIAL (1 << 0)
+#define CAP_EVENTS (1 << 1)
+#define CAP_RANGED_FETCH (1 << 2)
+#define CAP_CRC (1 << 3)
+#define CAP_STATS (1 << 4)
+#define CAP_BAD_PIXELS (1 << 5)
+#define CAP_CALIBRATION (1 << 6)
+#define CAP_PROFILES (1 << 7)
+#define CAP_SLOTS (1 << 8)
+#define CAP_SD_LOG (1 << 9)
+#define CAP_TRACE (1 << 10)
+#define CAP_TIMING (1 << 11)
+#define CAP_TEST_PATTERN (1 << 12)
+#define CAP_PARTIAL_FETCH (1 << 13)
+#define CAPABILITIES (CAP_FAXITRON_SERIAL | CAP_EVENTS | CAP_RANGED_FETCH | CAP_CRC | CAP_STATS | CAP_BAD_PIXELS | CAP_CALIBRATION | CAP_PROFILES | CAP_SLOTS | CAP_SD_LOG | CAP_TRACE | CAP_TIMING | CAP_TEST_PATTERN | CAP_PARTIAL_FETCH)
+
 typedef struct __attribute__((__packed__)) {
-  uint8_t command;
-  uint32_t data_len;
-  uint8_t data[64 - 5];
-} control_req_t;
+  uint8_t protocol_version;
+  uint8_t max_outstanding;
+  uint16_t max_frame_len;
+  uint32_t max_response_len;
+  uint32_t capabilities;
+  uint16_t rows;
+  uint16_t columns;
+} capabilities_t;
 
-uint32_t usb_handler(uint8_t *control_data, uint32_t len, uint8_t *return_data, uint32_t max_return_len) {
+typedef struct __attribute__((__packed__)) {
+  uint32_t first; // stream position of the first entry
+  uint32_t lost;  // entries overwritten before this read
+  uint32_t now_us;
+  uint16_t count;
+  uint16_t reserved;
+  dalsa_trace_t entries[];
+} trace_resp_t;
+
+// Fixed part of every command's response, checked before the command runs so no handler writes past what's
+// left of the response frame. The variable parts (stats, bad pixel entries, trace entries) are fit to the rest.
+uint32_t response_reserve(uint8_t command) {
+  switch (command) {
+    case 0x00: return 1;
+    case 0x01: return sizeof(state);
+    case 0x02: return sizeof(((fetch_resp_t *) 0)->stream_len);
+    case 0x03: return 1;
+    case 0x04: return sizeof(capabilities_t);
+    case 0x06: return sizeof(fetch_resp_t);
+    case 0x07: return sizeof(stats_resp_t);
+    case 0x08: return sizeof(bad_pixels_info_t);
+    case 0x09: return sizeof(calibration_info_t);
+    case 0x0A: return 2 + PROFILES * sizeof(profile_info_t);
+    case 0x0B: return FRAME_SLOTS * sizeof(slot_info_t);
+    case 0x0C: return sizeof(sd_log_info_t);
+    case 0x0D: return sizeof(download_resp_t);
+    case 0x0E: return sizeof(trace_resp_t);
+    case 0x0F: return sizeof(timing_stats_t);
+    case 0x10: return FAXITRON_RESPONSE_LEN;
+    case 0x11: return sizeof(test_pattern_config_t);
+    default: return 0;
+  }
+}
+
+uint32_t usb_handler(control_req_t *req, uint8_t *return_data, uint32_t max_return_len, uint8_t *status) {
   uint32_t return_len = 0;
-  control_req_t *req = (control_req_t *)control_data;
-  if (len < 5) {
-    Serial.write("Invalid command with len %d\n", len);
-    return_len = 0;
-    goto end;
+
+  if (response_reserve(req->command) > max_return_len) {
+    *status = DALSA_STATUS_RESPONSE_OVERFLOW;
+    return 0;
   }
 
   switch (req->command) {
     case 0x00: // Ping
-      Serial.write("Ping!\n");
       return_data[0] = 0xA5;
       return_len = 1;
       break;
     case 0x01: // Check state
-      memcpy(return_data, &state, sizeof(state));
+      memcpy(return_data, (void *) &state, sizeof(state));
       return_len = sizeof(state);
       break;
-    case 0x02: // Get pixel buffer
-      // setup bulk transfer
-      usb_dalsa_init_bulk_transfer((uint8_t *) pixel_buffer, sizeof(pixel_buffer), 0);
+    case 0x02: { // Get pixel buffer
+      fetch_req_t fetch_req = { .slot = SLOT_LATEST, .stride = 1 };
+      fetch_resp_t fetch_resp = { .stream_len = 0 };
+      *status = start_fetch(req->tag, &fetch_req, &fetch_resp);
+      if (*status != DALSA_STATUS_OK) {
+        break;
+      }
 
-      // return the size of the buffer
-      *((uint32_t *)return_data) = sizeof(pixel_buffer);
-      return_len = sizeof(uint32_t);
+      // return the size of the stream
+      memcpy(return_data, &fetch_resp.stream_len, sizeof(fetch_resp.stream_len));
+      return_len = sizeof(fetch_resp.stream_len);
       break;
+    }
     case 0x03: // Start readout
-      return_data[0] = start_readout((req->data[0] != 0)) ? 0x00 : 0xFF;
+      if (req->data_len < 1) {
+        *status = DALSA_STATUS_INVALID_LENGTH;
+        break;
+      }
+      return_data[0] = request_readout(req->data[0] != 0);
       return_len = 1;
       break;
+    case 0x04: { // Get capabilities
+      capabilities_t caps = {
+        .protocol_version = DALSA_PROTOCOL_VERSION,
+        .max_outstanding = (uint8_t) usb_dalsa_max_outstanding(),
+        .max_frame_len = (uint16_t) usb_dalsa_max_frame_len(),
+        .max_response_len = usb_dalsa_max_response_len(),
+        .capabilities = CAPABILITIES,
+        .rows = SENSOR_ROWS,
+        .columns = SENSOR_COLUMNS,
+      };
+      memcpy(return_data, &caps, sizeof(caps));
+      return_len = sizeof(caps);
+      break;
+    }
+    case 0x05: // Configure events
+      if (req->data_len < sizeof(uint16_t)) {
+        *status = DALSA_STATUS_INVALID_LENGTH;
+        break;
+      }
+      memcpy((void *) &progress_rows, req->data, sizeof(uint16_t));
+      break;
+    case 0x06: { // Fetch frame range
+      fetch_req_t fetch_req;
+      fetch_resp_t fetch_resp;
+      if (req->data_len < sizeof(fetch_req)) {
+        *status = DALSA_STATUS_INVALID_LENGTH;
+        break;
+      }
+      memcpy(&fetch_req, req->data, sizeof(fetch_req));
+      *status = start_fetch(req->tag, &fetch_req, &fetch_resp);
+      if (*status != DALSA_STATUS_OK) {
+        break;
+      }
+      memcpy(return_data, &fetch_resp, sizeof(fetch_resp));
+      return_len = sizeof(fetch_resp);
+      break;
+    }
+    case 0x07: { // Get frame statistics
+      int slot = find_frame_slot(req->data_len > 0 ? req->data[0] : SLOT_LATEST);
+      uint8_t include = req->data_len > 1 ? req->data[1] : (STATS_INCLUDE_HISTOGRAM | STATS_INCLUDE_ROWS);
+      if (slot < 0) {
+        *status = DALSA_STATUS_INVALID_ARGUMENT;
+        break;
+      }
+      return_len = get_stats(slot, include, return_data, max_return_len);
+      if (return_len == 0) {
+        *status = DALSA_STATUS_RESPONSE_OVERFLOW;
+      }
+      break;
+    }
+    case 0x08: // Bad pixel map
+      if (req->data_len < 1) {
+        *status = DALSA_STATUS_INVALID_LENGTH;
+        break;
+      }
+      return_len = bad_pixels_command(req, return_data, max_return_len, status);
+      break;
+    case 0x09: // Dark and gain maps
+      if (req->data_len < 1) {
+        *status = DALSA_STATUS_INVALID_LENGTH;
+        break;
+      }
+      return_len = calibration_command(req, return_data, status);
+      break;
+    case 0x0A: // Readout profiles, selects one if given
+      if (req->data_len > 0) {
+        if (req->data[0] >= PROFILES) {
+          *status = DALSA_STATUS_INVALID_ARGUMENT;
+          break;
+        }
+        if (frame_in_progress()) {
+          *status = DALSA_STATUS_BUSY;
+          break;
+        }
+        profile = req->data[0];
+      }
+      return_len = get_profiles(return_data);
+      break;
+    case 0x0B: // Frame slots
+      for (uint8_t slot = 0; slot < FRAME_SLOTS; slot++) {
+        slot_info_t info = {
+          .state = slot_state[slot],
+          .reserved = {0, 0, 0},
+          .sequence = frame_meta[slot].sequence,
+        };
+        memcpy(&return_data[return_len], &info, sizeof(info));
+        return_len += sizeof(info);
+      }
+      break;
+    case 0x0C: // SD log
+      if (req->data_len < 1) {
+        *status = DALSA_STATUS_INVALID_LENGTH;
+        break;
+      }
+      return_len = sd_log_command(req, return_data, status);
+      break;
+    case 0x0D: { // Download a logged frame
+      download_req_t download_req;
+      download_resp_t download_resp;
+      if (req->data_len < sizeof(download_req)) {
+        *status = DALSA_STATUS_INVALID_LENGTH;
+        break;
+      }
+      memcpy(&download_req, req->data, sizeof(download_req));
+      *status = start_download(req->tag, &download_req, &download_resp);
+      if (*status != DALSA_STATUS_OK) {
+        break;
+      }
+      memcpy(return_data, &download_resp, sizeof(download_resp));
+      return_len = sizeof(download_resp);
+      break;
+    }
+    case 0x0E: { // Drain the trace ring
+      trace_resp_t *resp = (trace_resp_t *) return_data;
+      uint32_t max_entries = (max_return_len - sizeof(trace_resp_t)) / sizeof(dalsa_trace_t);
+      uint32_t first, lost;
+      uint32_t count = dalsa_trace_read(resp->entries, max_entries, &first, &lost);
+      resp->first = first;
+      resp->lost = lost;
+      resp->now_us = micros();
+      resp->count = count;
+      resp->reserved = 0;
+      return_len = sizeof(trace_resp_t) + count * sizeof(dalsa_trace_t);
+      break;
+    }
+    case 0x0F: // Interrupt priorities and readout timing
+      if (req->data_len < 1) {
+        *status = DALSA_STATUS_INVALID_LENGTH;
+        break;
+      }
+      return_len = timing_command(req, return_data, status);
+      break;
     case 0x10: // Get Faxitron status
-      return_len = faxitron_command(req->data, req->data_len, return_data, 10);
+      return_len = faxitron_command(req->data, req->data_len, return_data, FAXITRON_RESPONSE_LEN);
+      break;
+    case 0x11: // Test pattern, selects one if given
+      if (req->data_len > 0) {
+        test_pattern_config_t config;
+        if (req->data_len < sizeof(config)) {
+          *status = DALSA_STATUS_INVALID_LENGTH;
+          break;
+        }
+        memcpy(&config, req->data, sizeof(config));
+        if (config.pattern >= TEST_PATTERNS) {
+          *status = DALSA_STATUS_INVALID_ARGUMENT;
+          break;
+        }
+        if (frame_in_progress() || readout_queued) {
+          *status = DALSA_STATUS_BUSY;
+          break;
+        }
+        test_pattern = config;
+      }
+      memcpy(return_data, &test_pattern, sizeof(test_pattern));
+      return_len = sizeof(test_pattern);
+      break;
+    case 0x12: // Abort readout, also drops a queued one
+      abort_requested = true;
       break;
 
     default:
-      Serial.write("Invalid command %d\n", req->command);
-      return_len = 0;
+      post_error(ERROR_INVALID_COMMAND, req->command);
+      *status = DALSA_STATUS_INVALID_COMMAND;
       break;
   }
 
-end:
   return return_len;
 }
 
@@ -251,14 +1747,231 @@ void setup() {
   pinMode(PIN_DRV_SW_PH_H21, OUTPUT);
   pinMode(PIN_DRV_SW_PH_H22, OUTPUT);
 
+  // Frame checksums
+  dcp_init();
+
+  // Slots hold full frames until a readout says otherwise
+  for (uint8_t slot = 0; slot < FRAME_SLOTS; slot++) {
+    frame_meta[slot].binning = 1;
+    frame_meta[slot].rows = SENSOR_ROWS;
+    frame_meta[slot].cols = SENSOR_COLUMNS;
+  }
+
+  // Defect map from EEPROM, dark and gain maps get uploaded after boot
+  bad_pixels_load();
+  calibration_init();
+
+  // Frame log, if there's a card
+  sd_log_init();
+
   // USB handler
   usb_dalsa_set_handler(usb_handler);
 
   // Start pixel timer
   pixelTimer.begin(pixel_irq, T_HALF_PIXEL_US);
+  set_irq_priorities(PIXEL_TIMER_PRIORITY, USB_PRIORITY);
+}
+
+void finish_frame() {
+  frame_meta_t *meta = &frame_meta[readout_slot];
+  if (meta->readout_mode == READOUT_MODE_SENSOR) {
+    profile_result_t *result = &profile_results[meta->timing_profile];
+    result->frames++;
+    result->frame_us = meta->end_us - meta->start_us;
+    result->noise_mlsb = noise_mlsb();
+  }
+
+  uint32_t frame_len = meta->rows * meta->cols * sizeof(uint16_t);
+  frame_stats[readout_slot].valid = true;
+  arm_dcache_flush_delete(readout_base, frame_len);
+  crc_slot = readout_slot;
+  TRACE_BEGIN(TRACE_FRAME_CRC, crc_slot, 0);
+  dcp_crc32_start(DCP_JOB_FRAME, readout_base, frame_len); // frame is ready once this is done
+  state.done = true;
+}
+
+// Stands in for the pixel ISR during test pattern frames, paced to the configured row rate
+void generate_pattern_rows() {
+  if (!test_pattern_active) {
+    return;
+  }
+  frame_meta_t *meta = &frame_meta[readout_slot];
+  uint32_t due = frame_rows;
+  if (test_pattern.row_rate != 0) {
+    due = min((uint64_t) (micros() - meta->start_us) * test_pattern.row_rate / 1000000, (uint64_t) frame_rows);
+  }
+  // A bit at a time, so the row pipeline and logging keep going alongside
+  due = min(due, rows_read + TEST_PATTERN_ROWS_PER_LOOP);
+
+  while (rows_read < due) {
+    test_pattern_row(test_pattern.pattern, test_pattern.seed, rows_read, frame_cols, readout_base + rows_read * frame_cols);
+    rows_read++;
+  }
+
+  if (rows_read == frame_rows) {
+    test_pattern_active = false;
+    meta->end_us = micros();
+    TRACE_END(TRACE_READOUT, readout_slot, rows_read);
+  }
+}
+
+void process_rows() {
+  while (rows_processed < rows_read) {
+    uint16_t *row = readout_base + rows_processed * frame_cols;
+    noise_add_row(rows_processed, row);
+    if (binning == 1) {
+      calibration_correct_row(row, rows_processed);
+      bad_pixels_correct_row(row, rows_processed);
+    }
+    stats_add_row(&frame_stats[readout_slot], rows_processed, row);
+    if (rows_processed + 1 == frame_rows) {
+      // Hands the slot to the CRC before the last row counts, frame_in_progress() has to stay true throughout
+      // or the USB ISR could start the next readout in between
+      finish_frame();
+    }
+    rows_processed++;
+    if (rows_processed % 16 == 0) {
+      TRACE_COUNTER(TRACE_ROWS_PROCESSED, rows_processed);
+    }
+    if (rows_processed < frame_rows && progress_rows != 0 && rows_processed % progress_rows == 0) {
+      // Reported once the rows are corrected, so everything up to here can be fetched already
+      usb_dalsa_post_event(DALSA_EVENT_ROW_PROGRESS, rows_processed, frame_rows);
+    }
+  }
+}
+
+// Writes completed frames to the SD card, a piece per call so the row pipeline keeps up
+void log_frames() {
+  if (log_slot < 0) {
+    if (log_request >= 0) {
+      if (log_request == SD_LOG_OP_START) {
+        if (!sd_log_open(log_request_capacity, sizeof(pixel_buffer[0]))) {
+          post_error(ERROR_SD_LOG, 0);
+        }
+      } else {
+        sd_log_close();
+      }
+      memset(slot_log_pending, 0, sizeof(slot_log_pending));
+      log_request = -1;
+      return;
+    }
+
+    // Oldest frame first. Downloads start from the USB ISR, keep it out until the card is claimed.
+    NVIC_DISABLE_IRQ(IRQ_USB1);
+    int slot = -1;
+    for (int i = 0; i < FRAME_SLOTS; i++) {
+      if (slot_log_pending[i] && (slot < 0 || frame_meta[i].sequence < frame_meta[slot].sequence)) {
+        slot = i;
+      }
+    }
+    if (slot >= 0 && !download_active) {
+      frame_header_t header;
+      fill_frame_header(&header, slot);
+      frame_meta_t *meta = &frame_meta[slot];
+      if (sd_log_begin_record(&header, sizeof(header), pixel_buffer[slot], meta->rows * meta->cols * sizeof(uint16_t))) {
+        log_slot = slot;
+        TRACE_BEGIN(TRACE_SD_LOG_RECORD, slot, meta->sequence);
+      } else {
+        // Log full or card gone, the frame stays available over USB
+        slot_log_pending[slot] = false;
+        post_error(ERROR_SD_LOG, meta->sequence);
+      }
+    }
+    NVIC_ENABLE_IRQ(IRQ_USB1);
+    return;
+  }
+
+  bool done = sd_log_poll();
+  if (!sd_log_writing()) {
+    TRACE_END(TRACE_SD_LOG_RECORD, log_slot, done);
+    if (!done) {
+      post_error(ERROR_SD_LOG, frame_meta[log_slot].sequence);
+    }
+    slot_log_pending[log_slot] = false;
+    log_slot = -1;
+  }
+}
+
+// Drops the frame being read out and frees its slot, e.g. once the first rows show the sample is misplaced
+void abort_readout() {
+  abort_requested = false;
+  readout_queued = false;
+  if (!state.busy && !test_pattern_active && rows_processed >= frame_rows) {
+    return; // Nothing left to abort, a frame that only waits for its CRC completes
+  }
+
+  noInterrupts();
+  bool sensor = state.busy;
+  state.busy = false;
+  interrupts();
+  test_pattern_active = false;
+  if (sensor) {
+    digitalWrite(PIN_LED0, LOW);
+    PHASE_V(false, false);
+    PHASE_H(false);
+    PHASE_R(false);
+  }
+  TRACE_END(TRACE_READOUT, readout_slot, rows_read);
+  // Freed while the frame still counts as in progress, once it doesn't the USB ISR may start the next readout.
+  // A partial fetch of this frame would go on streaming from the slot, so it ends here too.
+  uint8_t slot = readout_slot;
+  NVIC_DISABLE_IRQ(IRQ_USB1);
+  if (fetch.partial && fetch.slot == slot && usb_dalsa_bulk_busy()) {
+    usb_dalsa_abort_bulk_stream();
+  }
+  fetch.partial = false;
+  slot_state[slot] = SLOT_FREE;
+  NVIC_ENABLE_IRQ(IRQ_USB1);
+  rows_read = frame_rows;
+  rows_processed = frame_rows;
+  post_error(ERROR_READOUT_ABORTED, slot);
 }
 
 void loop() {
+  if (abort_requested) {
+    abort_readout();
+  }
+  generate_pattern_rows();
+  process_rows();
+  log_frames();
+  poll_faxitron();
+
+  // New maps only take over between frames
+  if (!frame_in_progress()) {
+    bad_pixels_poll();
+    calibration_poll();
+  }
+
+  uint32_t crc;
+  if (dcp_crc32_done(DCP_JOB_FRAME, &crc)) {
+    frame_crc[crc_slot] = crc;
+    frame_crc_valid[crc_slot] = true;
+    TRACE_END(TRACE_FRAME_CRC, crc_slot, crc);
+    slot_state[crc_slot] = SLOT_READY;
+    slot_log_pending[crc_slot] = sd_log_active();
+    usb_dalsa_post_event(DALSA_EVENT_FRAME_READY, crc_slot, crc);
+    crc_slot = -1;
+  }
+
+  // Fetches start from the USB ISR, keep it out while the slots change hands
+  NVIC_DISABLE_IRQ(IRQ_USB1);
+  if (!usb_dalsa_bulk_busy()) {
+    if (transfer_slot >= 0) {
+      slot_state[transfer_slot] = SLOT_READY;
+      transfer_slot = -1;
+    }
+    fetch.partial = false;
+    download_active = false;
+  }
+  if (readout_queued && !frame_in_progress()) {
+    int slot = find_readout_slot();
+    if (slot >= 0) {
+      readout_queued = false;
+      start_readout(slot, queued_high_gain);
+    }
+  }
+  NVIC_ENABLE_IRQ(IRQ_USB1);
+
   // if(state.busy == false) {
   //   start_readout(true);
   // }
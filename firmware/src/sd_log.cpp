@@ -0,0 +1,212 @@
+#include <Arduino.h>
+#include <SdFat.h>
+#include "sd_log.h"
+
+#define LOG_FILE "frames.log"
+#define LOG_MAGIC 0x474F4C44 // "DLOG"
+#define LOG_VERSION 1
+#define SECTORS_PER_POLL 64  // 32 KB, keeps the main loop (and with it the row pipeline) moving
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t record_len;
+  uint32_t capacity;
+  uint32_t count;
+} log_header_t;
+
+// FIFO mode polls the card, so reads also work from the USB ISR
+static SdFs sd;
+static FsFile file;
+static bool card = false;
+static bool active = false;
+static uint32_t first_sector = 0;
+static log_header_t log_header;
+
+static uint8_t sector_buffer[SD_LOG_SECTOR_LEN] __attribute__ ((aligned(4)));
+
+// Record being written
+static struct {
+  bool busy;
+  const uint8_t *data;
+  uint32_t len;
+  uint32_t sector;   // Of the record, relative to the first record
+  uint32_t written;  // Data sectors
+} record;
+
+static inline uint32_t sectors(uint32_t len) {
+  return (len + SD_LOG_SECTOR_LEN - 1) / SD_LOG_SECTOR_LEN;
+}
+
+static bool write_log_header() {
+  memset(sector_buffer, 0, sizeof(sector_buffer));
+  memcpy(sector_buffer, &log_header, sizeof(log_header));
+  return sd.card()->writeSectors(first_sector, sector_buffer, 1);
+}
+
+bool sd_log_init() {
+  card = sd.begin(SdioConfig(FIFO_SDIO));
+  return card;
+}
+
+bool sd_log_card() {
+  return card;
+}
+
+bool sd_log_open(uint32_t capacity, uint32_t record_data_len) {
+  sd_log_close();
+  if (!card) {
+    return false;
+  }
+
+  uint32_t record_len = SD_LOG_HEADER_LEN + sectors(record_data_len) * SD_LOG_SECTOR_LEN;
+  uint32_t last_sector;
+  if (capacity == 0) {
+    if (!file.open(LOG_FILE, O_RDWR) || !file.contiguousRange(&first_sector, &last_sector)) {
+      file.close();
+      return false;
+    }
+    if (!sd.card()->readSectors(first_sector, sector_buffer, 1)) {
+      file.close();
+      return false;
+    }
+    memcpy(&log_header, sector_buffer, sizeof(log_header));
+    if (log_header.magic != LOG_MAGIC || log_header.version != LOG_VERSION || log_header.record_len != record_len) {
+      file.close();
+      return false;
+    }
+  } else {
+    // Preallocating up front gets a contiguous range of sectors, which can then be written without the filesystem
+    uint64_t file_len = SD_LOG_SECTOR_LEN + (uint64_t) capacity * record_len;
+    if (!file.open(LOG_FILE, O_RDWR | O_CREAT | O_TRUNC) || !file.preAllocate(file_len) ||
+        !file.contiguousRange(&first_sector, &last_sector)) {
+      file.close();
+      return false;
+    }
+    log_header = { .magic = LOG_MAGIC, .version = LOG_VERSION, .record_len = record_len, .capacity = capacity, .count = 0 };
+    if (!write_log_header()) {
+      file.close();
+      return false;
+    }
+  }
+
+  record.busy = false;
+  active = true;
+  return true;
+}
+
+void sd_log_close() {
+  if (active) {
+    file.close();
+  }
+  active = false;
+  record.busy = false;
+}
+
+bool sd_log_active() {
+  return active;
+}
+
+uint32_t sd_log_capacity() {
+  return active ? log_header.capacity : 0;
+}
+
+uint32_t sd_log_count() {
+  return active ? log_header.count : 0;
+}
+
+uint32_t sd_log_record_len() {
+  return active ? log_header.record_len : 0;
+}
+
+bool sd_log_begin_record(const void *header, uint32_t header_len, const void *data, uint32_t len) {
+  if (!active || record.busy || log_header.count >= log_header.capacity || header_len > SD_LOG_HEADER_LEN ||
+      SD_LOG_HEADER_LEN + sectors(len) * SD_LOG_SECTOR_LEN > log_header.record_len) {
+    return false;
+  }
+
+  // Busy for as long as the card is in use, readers check it before they touch the card
+  record.busy = true;
+  record.data = (const uint8_t *) data;
+  record.len = len;
+  record.written = 0;
+  record.sector = 1 + log_header.count * (log_header.record_len / SD_LOG_SECTOR_LEN);
+  memset(sector_buffer, 0, sizeof(sector_buffer));
+  memcpy(sector_buffer, header, header_len);
+  if (!sd.card()->writeSectors(first_sector + record.sector, sector_buffer, 1)) {
+    record.busy = false;
+    return false;
+  }
+  return true;
+}
+
+bool sd_log_writing() {
+  return record.busy;
+}
+
+bool sd_log_poll() {
+  if (!record.busy) {
+    return false;
+  }
+
+  uint32_t sector = first_sector + record.sector + 1 + record.written;
+  uint32_t whole = record.len / SD_LOG_SECTOR_LEN;
+  bool ok;
+  uint32_t n;
+  if (record.written < whole) {
+    n = min(whole - record.written, (uint32_t) SECTORS_PER_POLL);
+    ok = sd.card()->writeSectors(sector, record.data + record.written * SD_LOG_SECTOR_LEN, n);
+  } else {
+    // The tail of the frame, padded to a whole sector
+    n = 1;
+    memset(sector_buffer, 0, sizeof(sector_buffer));
+    memcpy(sector_buffer, record.data + whole * SD_LOG_SECTOR_LEN, record.len - whole * SD_LOG_SECTOR_LEN);
+    ok = sd.card()->writeSectors(sector, sector_buffer, 1);
+  }
+  if (!ok) {
+    record.busy = false;
+    return false;
+  }
+
+  record.written += n;
+  if (record.written < sectors(record.len)) {
+    return false;
+  }
+
+  log_header.count++;
+  ok = write_log_header();
+  record.busy = false;
+  return ok;
+}
+
+bool sd_log_read(uint32_t offset, void *dst, uint32_t len) {
+  if (!active || (uint64_t) offset + len > (uint64_t) log_header.count * log_header.record_len) {
+    return false;
+  }
+
+  uint8_t *out = (uint8_t *) dst;
+  uint32_t sector = first_sector + 1 + offset / SD_LOG_SECTOR_LEN;
+  uint32_t skip = offset % SD_LOG_SECTOR_LEN;
+  while (len > 0) {
+    if (skip == 0 && len >= SD_LOG_SECTOR_LEN) {
+      uint32_t n = len / SD_LOG_SECTOR_LEN;
+      if (!sd.card()->readSectors(sector, out, n)) {
+        return false;
+      }
+      sector += n;
+      out += n * SD_LOG_SECTOR_LEN;
+      len -= n * SD_LOG_SECTOR_LEN;
+    } else {
+      if (!sd.card()->readSectors(sector, sector_buffer, 1)) {
+        return false;
+      }
+      uint32_t part = min(len, SD_LOG_SECTOR_LEN - skip);
+      memcpy(out, sector_buffer + skip, part);
+      sector++;
+      out += part;
+      len -= part;
+      skip = 0;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,33 @@
+#include <Arduino.h>
+#include "test_pattern.h"
+
+void test_pattern_row(uint8_t pattern, uint32_t seed, uint32_t row, uint32_t cols, uint16_t *dst) {
+  switch (pattern) {
+    case TEST_PATTERN_RAMP: {
+      uint32_t value = row * cols + seed;
+      for (uint32_t col = 0; col < cols; col++) {
+        dst[col] = value++;
+      }
+      break;
+    }
+    case TEST_PATTERN_CHECKERBOARD:
+      for (uint32_t col = 0; col < cols; col++) {
+        dst[col] = (((row >> 3) + (col >> 3) + seed) & 1) ? 0xA5A5 : 0x5A5A;
+      }
+      break;
+    case TEST_PATTERN_PRNG: {
+      // Rows start from independent states, so the host can generate them all at once
+      uint32_t x = (seed + row * 0x9E3779B9) | 1;
+      for (uint32_t col = 0; col < cols; col++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        dst[col] = x;
+      }
+      break;
+    }
+    default:
+      memset(dst, 0, cols * sizeof(uint16_t));
+      break;
+  }
+}
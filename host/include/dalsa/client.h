@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "dalsa/protocol.h"
+
+struct libusb_context;
+struct libusb_device_handle;
+struct libusb_transfer;
+
+namespace dalsa {
+
+// Transport failures, and commands the device answered with a status other than OK
+class error : public std::runtime_error {
+ public:
+  explicit error(const std::string &what, int status = 0) : std::runtime_error(what), status(status) {}
+  int status;
+};
+
+struct region {
+  uint8_t slot = DALSA_SLOT_LATEST;
+  uint8_t stride = 1;
+  uint16_t row_start = 0;
+  uint16_t row_count = 0;  // 0 = up to the last row
+  uint16_t col_start = 0;
+  uint16_t col_count = 0;  // 0 = up to the last column
+};
+
+struct client_options {
+  int transfers = 8;                             // Bulk transfers kept queued while a stream comes in
+  size_t transfer_len = 4 * DALSA_BULK_CHUNK_LEN; // Multiple of the chunk length, so chunks never straddle two
+  unsigned timeout_ms = 5000;
+  int retries = 3;                               // Re-requests of ranges that went missing or failed their CRC
+};
+
+// Same protocol as app/dalsa_teensy.py. Commands go out synchronously; frame streams come in through a
+// queue of asynchronous bulk transfers into pooled buffers, and their payload is checked and copied
+// straight into the caller's buffer.
+// Safe to share between threads: commands from any thread are multiplexed on the control endpoints and
+// matched back to their caller by tag, bulk streams take turns.
+class client {
+ public:
+  explicit client(const client_options &options = client_options());
+  ~client();
+  client(const client &) = delete;
+  client &operator=(const client &) = delete;
+
+  const dalsa_capabilities_t &capabilities() const { return caps_; }
+
+  std::vector<uint8_t> command(uint8_t cmd, const void *data = nullptr, size_t len = 0);
+  // Packs as many requests per command frame as fit before waiting on any response
+  std::vector<std::vector<uint8_t>> command_batch(const std::vector<std::pair<uint8_t, std::vector<uint8_t>>> &commands);
+  // The two halves of command_batch, for callers that need the tags (bulk streams are tagged with their request)
+  std::vector<uint16_t> submit(const std::vector<std::pair<uint8_t, std::vector<uint8_t>>> &commands);
+  std::vector<uint8_t> collect(uint16_t tag);
+  // Plain synchronous read of the bulk endpoint, returns the bytes received before a timeout
+  size_t bulk_read(uint8_t *dst, size_t len, unsigned timeout_ms);
+
+  void ping();
+  uint8_t start_readout(bool high_gain);
+  void set_test_pattern(uint8_t pattern, uint32_t seed = 0, uint32_t row_rate = 0);
+  // False on timeout, libusb treats 0 as no timeout
+  bool wait_event(dalsa_event_t &event, unsigned timeout_ms);
+
+  // Size of the buffer fetch() needs for a region of the current frame geometry
+  size_t fetch_len(const region &r) const;
+  // Header followed by the region's pixels, like DalsaFrame in Python. Returns the bytes written.
+  size_t fetch(const region &r, uint8_t *dst, size_t capacity);
+  size_t fetch(const region &r, std::vector<uint8_t> &dst);
+
+  struct stream_stats {
+    uint64_t bytes = 0;
+    uint64_t chunks = 0;
+    uint64_t crc_errors = 0;
+    uint64_t retries = 0;
+  };
+  const stream_stats &stats() const { return stats_; }
+
+ private:
+  struct transfer_slot;
+
+  void send_frame(const std::vector<uint8_t> &frame);
+  void receive_responses();
+  dalsa_fetch_resp_t request_range(const region &r, uint32_t offset, uint32_t len, uint16_t &tag);
+  // Reads stream_len bytes with the transfer queue, hands every transfer to place_chunks in order
+  void read_stream(uint32_t stream_len, uint16_t tag, uint8_t *dst, size_t capacity,
+                   std::vector<std::pair<uint32_t, uint32_t>> &covered);
+  void place_chunks(const uint8_t *data, size_t len, uint16_t tag, uint8_t *dst, size_t capacity,
+                    std::vector<std::pair<uint32_t, uint32_t>> &covered);
+  static void transfer_done(libusb_transfer *transfer);
+
+  client_options options_;
+  std::mutex command_mutex_;  // Control endpoints and response bookkeeping
+  std::mutex stream_mutex_;   // Bulk endpoint, taken before command_mutex_ where both are needed
+  libusb_context *ctx_ = nullptr;
+  libusb_device_handle *handle_ = nullptr;
+  dalsa_capabilities_t caps_ = {};
+  uint16_t next_tag_ = 0;
+  int frames_in_flight_ = 0;
+  std::vector<uint8_t> rx_;
+  std::vector<std::pair<uint16_t, std::pair<uint8_t, std::vector<uint8_t>>>> responses_;
+  std::vector<transfer_slot> slots_;
+  bool header_seen_ = false;
+  uint32_t sequence_ = 0;
+  stream_stats stats_;
+};
+
+}  // namespace dalsa
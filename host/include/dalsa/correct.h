@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Frame correction and display mapping on the host, one pass per row: dark and gain with the same math
+// as firmware/include/calibration.h, bad pixels patched like firmware/src/bad_pixels.cpp, then window/level
+// to 8 or 16 bits, optionally inverted. Rows are spread over a thread pool, the inner loops use AVX2 when
+// the CPU has it and give the same result either way.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+  #define DALSA_BAD_PIXEL_COLUMN 0xFFFF // row value of an entry that marks the whole column bad
+  #define DALSA_GAIN_SHIFT 12
+
+  typedef struct {
+    uint16_t row;
+    uint16_t col;
+  } dalsa_bad_pixel_t;
+
+  typedef struct {
+    const uint16_t *dark;                 // Per pixel, NULL to skip
+    const uint16_t *gain;                 // Per pixel Q3.12, 4096 is unity, NULL to skip
+    uint16_t pedestal;                    // Added after the dark subtraction
+    const dalsa_bad_pixel_t *bad_pixels;  // Any order, NULL to skip
+    uint32_t bad_pixel_count;
+    uint16_t window_low;                  // Maps to black, window_high to white (swapped when inverted)
+    uint16_t window_high;
+    uint8_t invert;
+    uint8_t output_bits;                  // 8 or 16
+    uint16_t threads;                     // 0 uses every core
+  } dalsa_correction_t;
+
+  // src is rows x cols. corrected gets the corrected frame before the window/level, it can be NULL, or
+  // src to correct in place. dst gets the display image with dst_stride bytes per row, or is NULL.
+  void dalsa_correct_frame(const uint16_t *src, uint32_t rows, uint32_t cols, const dalsa_correction_t *config,
+                           uint16_t *corrected, void *dst, size_t dst_stride);
+
+  // Maps every pixel through a 65536 entry table of uint8_t or uint16_t (output_bits), so window, level and
+  // gamma changes only rebuild the table and never touch the frame
+  void dalsa_apply_lut(const uint16_t *src, uint32_t rows, uint32_t cols, const void *lut, uint8_t output_bits,
+                       void *dst, size_t dst_stride, uint16_t threads);
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32/MPEG-2, as computed by the DCP on the Teensy: polynomial 0x04C11DB7, init 0xFFFFFFFF,
+// not reflected, no final XOR. Chain calls by passing the previous result as crc.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+  #define DALSA_CRC32_INIT 0xFFFFFFFF
+  uint32_t dalsa_crc32_update(uint32_t crc, const uint8_t *data, size_t len);
+  uint32_t dalsa_crc32(const uint8_t *data, size_t len);
+#ifdef __cplusplus
+}
+#endif
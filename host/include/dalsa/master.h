@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dalsa/correct.h"
+
+// Master darks and flats in one streaming pass: every frame updates running per pixel statistics and is
+// then dropped, so memory stays at a few floats per pixel however many frames go in. Kept per pixel:
+// - the mean and variance of all frames (Welford)
+// - a sigma-clipped mean and variance, which drops X-ray hits and other one-off outliers. The warmup frames
+//   are held on to and seed it from their median and MAD, from then on a value further than clip_sigma from
+//   the clipped mean so far is left out.
+// - an approximate median, seeded the same way and then updated by stochastic approximation, with a step
+//   that scales with the clipped sigma and shrinks with 1/n; for unimodal noise it ends up about as close to
+//   the true median as the sample median
+// Rows are spread over the thread pool, the inner loop is vectorized with AVX2 when the CPU has it and gives
+// the same result either way.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+  #define DALSA_MASTER_MEAN 0
+  #define DALSA_MASTER_CLIPPED 1
+  #define DALSA_MASTER_MEDIAN 2
+  #define DALSA_MASTER_SIGMA 3     // Temporal standard deviation of the values the clipped mean kept
+  #define DALSA_MASTER_MAX_WARMUP 15
+
+  #define DALSA_DEFECT_HOT (1 << 0)
+  #define DALSA_DEFECT_DEAD (1 << 1)
+  #define DALSA_DEFECT_NOISY (1 << 2)
+
+  typedef struct dalsa_master dalsa_master_t;
+
+  typedef struct {
+    float clip_sigma;       // 3 is typical
+    uint16_t clip_warmup;   // Frames held to seed the clipping, 3 to DALSA_MASTER_MAX_WARMUP
+    uint16_t threads;       // 0 uses every core
+  } dalsa_master_config_t;
+
+  // Judged on the clipped mean against the median over all pixels, thresholds of 0 are skipped
+  typedef struct {
+    float hot_sigma;        // Hot above the median by this many robust sigma (from the MAD) of the master
+    float dead_fraction;    // Dead below this fraction of the median, for flats
+    float noisy_factor;     // Noisy with a temporal sigma this many times the median one
+    float column_fraction;  // A column with more than this fraction of its pixels bad becomes a column entry
+  } dalsa_defect_config_t;
+
+  dalsa_master_t *dalsa_master_create(uint32_t rows, uint32_t cols, const dalsa_master_config_t *config);
+  void dalsa_master_destroy(dalsa_master_t *master);
+  // frame is rows x cols
+  void dalsa_master_add(dalsa_master_t *master, const uint16_t *frame);
+  uint32_t dalsa_master_frames(const dalsa_master_t *master);
+  // One of DALSA_MASTER_*, rows x cols floats
+  void dalsa_master_get(const dalsa_master_t *master, uint8_t kind, float *out);
+
+  // Fills map (rows x cols DALSA_DEFECT_* flags) and list (the same defects as bad pixel entries, whole
+  // columns first), either can be NULL. Returns the number of list entries, of which at most max_count
+  // were written.
+  uint32_t dalsa_master_defects(const dalsa_master_t *master, const dalsa_defect_config_t *config, uint8_t *map,
+                                dalsa_bad_pixel_t *list, uint32_t max_count);
+#ifdef __cplusplus
+}
+#endif
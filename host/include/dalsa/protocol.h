@@ -0,0 +1,165 @@
+#pragma once
+
+#include <stdint.h>
+
+// Wire format of the Teensy USB interface, mirrors firmware/core_patches/usb_dalsa.h and firmware/src/main.cpp
+
+#define DALSA_VENDOR_ID 0x16C0
+#define DALSA_PRODUCT_ID 0x0483
+#define DALSA_INTERFACE 2
+#define DALSA_CONTROL_OUT_ENDPOINT 0x05
+#define DALSA_CONTROL_IN_ENDPOINT 0x86
+#define DALSA_BULK_IN_ENDPOINT 0x87
+#define DALSA_EVENT_IN_ENDPOINT 0x85
+
+#define DALSA_PROTOCOL_VERSION 2
+#define DALSA_BULK_CHUNK_LEN 16384 // Every bulk transfer but the last of a stream is exactly this long
+
+#define DALSA_STATUS_OK 0x00
+#define DALSA_STATUS_INVALID_VERSION 0x01
+#define DALSA_STATUS_INVALID_COMMAND 0x02
+#define DALSA_STATUS_INVALID_LENGTH 0x03
+#define DALSA_STATUS_INVALID_ARGUMENT 0x04
+#define DALSA_STATUS_BUSY 0x05
+#define DALSA_STATUS_RESPONSE_OVERFLOW 0x06
+#define DALSA_STATUS_NO_HANDLER 0x07
+#define DALSA_STATUS_NO_MEMORY 0x08
+
+#define DALSA_CMD_PING 0x00
+#define DALSA_CMD_START_READOUT 0x03
+#define DALSA_CMD_CAPABILITIES 0x04
+#define DALSA_CMD_CONFIGURE_EVENTS 0x05
+#define DALSA_CMD_FETCH 0x06
+#define DALSA_CMD_TEST_PATTERN 0x11
+
+#define DALSA_CAP_EVENTS (1 << 1)
+#define DALSA_CAP_RANGED_FETCH (1 << 2)
+#define DALSA_CAP_CRC (1 << 3)
+#define DALSA_CAP_TEST_PATTERN (1 << 12)
+
+#define DALSA_EVENT_READOUT_STARTED 0x01
+#define DALSA_EVENT_ROW_PROGRESS 0x02
+#define DALSA_EVENT_FRAME_READY 0x03
+#define DALSA_EVENT_FAXITRON_STATE 0x04
+#define DALSA_EVENT_ERROR 0x05
+
+#define DALSA_SLOT_LATEST 0xFF
+#define DALSA_READOUT_STARTED 0x00
+#define DALSA_READOUT_QUEUED 0x01
+#define DALSA_READOUT_REJECTED 0xFF
+
+#define DALSA_TEST_PATTERN_OFF 0
+#define DALSA_TEST_PATTERN_RAMP 1
+#define DALSA_TEST_PATTERN_CHECKERBOARD 2
+#define DALSA_TEST_PATTERN_PRNG 3
+
+#define DALSA_CHUNK_MAGIC 0x4B484344 // "DCHK"
+#define DALSA_FRAME_MAGIC 0x4D524644 // "DFRM"
+
+typedef struct __attribute__((__packed__)) {
+  uint8_t version;
+  uint8_t command;
+  uint16_t tag;
+  uint32_t data_len;
+} dalsa_req_header_t;
+
+typedef struct __attribute__((__packed__)) {
+  uint8_t version;
+  uint8_t status;
+  uint16_t tag;
+  uint32_t data_len;
+} dalsa_resp_header_t;
+
+typedef struct __attribute__((__packed__)) {
+  uint8_t protocol_version;
+  uint8_t max_outstanding;
+  uint16_t max_frame_len;
+  uint32_t max_response_len;
+  uint32_t capabilities;
+  uint16_t rows;
+  uint16_t columns;
+} dalsa_capabilities_t;
+
+typedef struct __attribute__((__packed__)) {
+  uint8_t type;
+  uint8_t dropped;
+  uint16_t sequence;
+  uint32_t timestamp_us;
+  uint32_t arg0;
+  uint32_t arg1;
+} dalsa_event_t;
+
+typedef struct __attribute__((__packed__)) {
+  uint8_t slot;
+  uint8_t stride;
+  uint16_t row_start;
+  uint16_t row_count;
+  uint16_t col_start;
+  uint16_t col_count;
+  uint32_t offset;
+  uint32_t len;
+} dalsa_fetch_req_t;
+
+typedef struct __attribute__((__packed__)) {
+  uint32_t len;
+  uint16_t rows;
+  uint16_t cols;
+  uint32_t stream_len;
+  uint32_t frame_crc;
+  uint8_t frame_crc_valid;
+} dalsa_fetch_resp_t;
+
+typedef struct __attribute__((__packed__)) {
+  uint32_t magic;
+  uint16_t tag;
+  uint16_t flags;
+  uint32_t offset;
+  uint32_t len;
+  uint32_t crc;
+  uint32_t sequence;
+  uint8_t reserved[8];
+} dalsa_chunk_header_t;
+
+typedef struct __attribute__((__packed__)) {
+  uint32_t magic;
+  uint16_t header_len;
+  uint16_t header_version;
+  uint32_t sequence;
+  uint8_t slot;
+  uint8_t high_gain;
+  uint8_t readout_mode;
+  uint8_t timing_profile;
+  uint16_t rows;
+  uint16_t cols;
+  uint16_t row_start;
+  uint16_t col_start;
+  uint16_t region_rows;
+  uint16_t region_cols;
+  uint8_t stride;
+  uint8_t adc_resolution;
+  uint8_t adc_averaging;
+  uint8_t faxitron_state;
+  uint16_t faxitron_kv;
+  uint16_t faxitron_exposure_ds;
+  uint32_t readout_start_ms;
+  uint32_t readout_start_us;
+  uint32_t readout_end_us;
+  uint32_t stream_start_us;
+  uint32_t frame_crc;
+  uint8_t frame_crc_valid;
+  uint8_t corrections;
+  uint8_t binning;
+  uint8_t reserved[5];
+} dalsa_frame_header_t;
+
+typedef struct __attribute__((__packed__)) {
+  uint8_t pattern;
+  uint8_t reserved[3];
+  uint32_t seed;
+  uint32_t row_rate;
+} dalsa_test_pattern_t;
+
+#ifdef __cplusplus
+static_assert(sizeof(dalsa_chunk_header_t) == 32, "chunk header size");
+static_assert(sizeof(dalsa_frame_header_t) == 64, "frame header size");
+#endif
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+
+// Shared memory frame ring of the capture daemon (host/tools/dalsa_captured.cpp), mapped read-only by any
+// number of local processes. The header is followed by `slots` slots of slot_len bytes from data_offset on,
+// each a dalsa_ring_slot_t and then the frame as fetched: dalsa_frame_header_t, then the pixels.
+//
+// Frame n goes to slot n % slots. The daemon sets the slot's sequence to 2n + 1 while it writes the frame
+// and to 2n + 2 once it's complete, then sets frames to n + 1. Readers check that sequence is 2n + 2 before
+// and after using a frame in place; anything else means it was overwritten in the meantime.
+
+#define DALSA_RING_MAGIC 0x474E5244 // "DRNG"
+#define DALSA_RING_VERSION 1
+#define DALSA_RING_ALIGN 4096       // data_offset and slot_len are multiples of this
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t slots;
+  uint32_t slot_len;     // Bytes per slot, its dalsa_ring_slot_t included
+  uint32_t data_offset;  // Of the first slot
+  uint32_t pid;          // Of the daemon
+  uint64_t frames;       // Published so far, the newest is frames - 1
+} dalsa_ring_header_t;
+
+typedef struct {
+  uint64_t sequence;     // Odd while the frame is written, 0 if the slot never held one
+  uint32_t len;          // Frame header and pixels
+  uint32_t reserved;
+  uint64_t captured_us;  // Host CLOCK_REALTIME once the frame was in
+  uint8_t pad[40];       // The frame starts on the next cache line
+} dalsa_ring_slot_t;
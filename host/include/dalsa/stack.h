@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Stacks frames of the same scene into one with less noise, streaming like dalsa_master_t: each frame is
+// added and dropped. Per pixel outlier rejection keeps direct X-ray hits on the CCD out of the result,
+// either by dropping the lowest and highest value or by sigma clipping. With sigma clipping up to
+// DALSA_MASTER_MAX_WARMUP frames are held and clipped around their median as a batch, more than that are
+// clipped as they come in.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+  #define DALSA_STACK_MEAN 0
+  #define DALSA_STACK_MINMAX 1   // Drops the lowest and highest value of every pixel, from 3 frames on
+  #define DALSA_STACK_SIGMA 2
+
+  typedef struct dalsa_stack dalsa_stack_t;
+
+  typedef struct {
+    uint8_t rejection;     // One of DALSA_STACK_*
+    float clip_sigma;      // For DALSA_STACK_SIGMA, 3 is typical
+    uint16_t threads;      // 0 uses every core
+  } dalsa_stack_config_t;
+
+  dalsa_stack_t *dalsa_stack_create(uint32_t rows, uint32_t cols, const dalsa_stack_config_t *config);
+  void dalsa_stack_destroy(dalsa_stack_t *stack);
+  // frame is rows x cols
+  void dalsa_stack_add(dalsa_stack_t *stack, const uint16_t *frame);
+  uint32_t dalsa_stack_frames(const dalsa_stack_t *stack);
+  // The stack so far, rounded to 16 bits like a single frame so correction and display take it as is
+  void dalsa_stack_get(const dalsa_stack_t *stack, uint16_t *out);
+#ifdef __cplusplus
+}
+#endif
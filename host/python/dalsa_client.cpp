@@ -0,0 +1,175 @@
+// Python module over dalsa::client, used by app/dalsa_teensy.py when it's built
+
+#include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
+
+#include "dalsa/client.h"
+
+#include <memory>
+#include <mutex>
+
+namespace py = pybind11;
+
+namespace {
+
+// Fetch buffers come back here once Python drops the frame, so streaming frames doesn't allocate
+class buffer_pool {
+ public:
+  std::vector<uint8_t> acquire() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (free_.empty()) {
+      return std::vector<uint8_t>();
+    }
+    std::vector<uint8_t> buf = std::move(free_.back());
+    free_.pop_back();
+    return buf;
+  }
+
+  void release(std::vector<uint8_t> buf) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (free_.size() < MAX_FREE) {
+      free_.push_back(std::move(buf));
+    }
+  }
+
+ private:
+  static constexpr size_t MAX_FREE = 4;
+  std::mutex mutex_;
+  std::vector<std::vector<uint8_t>> free_;
+};
+
+// Frame header followed by the pixels, exposed through the buffer protocol
+struct frame {
+  frame(std::shared_ptr<buffer_pool> pool, std::vector<uint8_t> data, size_t len)
+      : pool(std::move(pool)), data(std::move(data)), len(len) {}
+  ~frame() { pool->release(std::move(data)); }
+  frame(const frame &) = delete;
+  frame &operator=(const frame &) = delete;
+
+  std::shared_ptr<buffer_pool> pool;
+  std::vector<uint8_t> data;
+  size_t len;
+};
+
+struct client_wrapper {
+  client_wrapper(const dalsa::client_options &options) : client(options), pool(std::make_shared<buffer_pool>()) {}
+
+  dalsa::client client;
+  std::shared_ptr<buffer_pool> pool;
+};
+
+}  // namespace
+
+PYBIND11_MODULE(dalsa_client, m) {
+  py::register_exception<dalsa::error>(m, "Error");
+
+  py::class_<frame>(m, "Frame", py::buffer_protocol())
+      .def_buffer([](frame &f) { return py::buffer_info(f.data.data(), (py::ssize_t) f.len); })
+      .def("__len__", [](const frame &f) { return f.len; });
+
+  py::class_<client_wrapper>(m, "Client")
+      .def(py::init([](int transfers, size_t transfer_len, unsigned timeout_ms, int retries) {
+             dalsa::client_options options;
+             options.transfers = transfers;
+             options.transfer_len = transfer_len;
+             options.timeout_ms = timeout_ms;
+             options.retries = retries;
+             py::gil_scoped_release release;
+             return new client_wrapper(options);
+           }),
+           py::arg("transfers") = dalsa::client_options().transfers,
+           py::arg("transfer_len") = dalsa::client_options().transfer_len,
+           py::arg("timeout_ms") = dalsa::client_options().timeout_ms,
+           py::arg("retries") = dalsa::client_options().retries)
+
+      // Status codes come back instead of raising, DalsaTeensy turns them into DalsaCommandError
+      .def("submit",
+           [](client_wrapper &c, const std::vector<std::pair<uint8_t, std::string>> &commands) {
+             std::vector<std::pair<uint8_t, std::vector<uint8_t>>> requests;
+             for (const auto &cmd : commands) {
+               requests.emplace_back(cmd.first, std::vector<uint8_t>(cmd.second.begin(), cmd.second.end()));
+             }
+             py::gil_scoped_release release;
+             return c.client.submit(requests);
+           })
+      .def("collect",
+           [](client_wrapper &c, uint16_t tag) {
+             std::vector<uint8_t> data;
+             int status = DALSA_STATUS_OK;
+             {
+               py::gil_scoped_release release;
+               try {
+                 data = c.client.collect(tag);
+               } catch (const dalsa::error &e) {
+                 if (e.status == DALSA_STATUS_OK) {
+                   throw;
+                 }
+                 status = e.status;
+               }
+             }
+             return py::make_tuple(status, py::bytes((const char *) data.data(), data.size()));
+           })
+
+      .def("bulk_read",
+           [](client_wrapper &c, size_t len, unsigned timeout_ms) {
+             std::vector<uint8_t> buf(len);
+             {
+               py::gil_scoped_release release;
+               buf.resize(c.client.bulk_read(buf.data(), len, timeout_ms));
+             }
+             return py::bytes((const char *) buf.data(), buf.size());
+           },
+           py::arg("len"), py::arg("timeout_ms") = dalsa::client_options().timeout_ms)
+
+      // Raw event struct, None on timeout
+      .def("wait_event",
+           [](client_wrapper &c, unsigned timeout_ms) -> py::object {
+             dalsa_event_t event;
+             bool received;
+             {
+               py::gil_scoped_release release;
+               received = c.client.wait_event(event, timeout_ms);
+             }
+             if (!received) {
+               return py::none();
+             }
+             return py::bytes((const char *) &event, sizeof(event));
+           })
+
+      .def("fetch",
+           [](client_wrapper &c, uint8_t slot, uint16_t row_start, uint16_t row_count, uint16_t col_start,
+              uint16_t col_count, uint8_t stride) {
+             dalsa::region r;
+             r.slot = slot;
+             r.stride = stride;
+             r.row_start = row_start;
+             r.row_count = row_count;
+             r.col_start = col_start;
+             r.col_count = col_count;
+
+             std::vector<uint8_t> buf = c.pool->acquire();
+             size_t len;
+             {
+               py::gil_scoped_release release;
+               try {
+                 len = c.client.fetch(r, buf);
+               } catch (...) {
+                 c.pool->release(std::move(buf));
+                 throw;
+               }
+             }
+             return new frame(c.pool, std::move(buf), len);
+           },
+           py::arg("slot") = DALSA_SLOT_LATEST, py::arg("row_start") = 0, py::arg("row_count") = 0,
+           py::arg("col_start") = 0, py::arg("col_count") = 0, py::arg("stride") = 1)
+
+      .def("stats", [](const client_wrapper &c) {
+        const auto &s = c.client.stats();
+        py::dict stats;
+        stats["bytes"] = s.bytes;
+        stats["chunks"] = s.chunks;
+        stats["crc_errors"] = s.crc_errors;
+        stats["retries"] = s.retries;
+        return stats;
+      });
+}
@@ -0,0 +1,423 @@
+#include "dalsa/client.h"
+#include "dalsa/crc32.h"
+
+#include <libusb.h>
+
+#include <algorithm>
+#include <cstring>
+
+namespace dalsa {
+
+namespace {
+
+// Until the capabilities are known, stay within what every firmware / link speed supports
+constexpr uint16_t DEFAULT_MAX_FRAME_LEN = 64;
+constexpr uint32_t DEFAULT_MAX_RESPONSE_LEN = 16384;
+
+std::string usb_error(const char *what, int rc) {
+  return std::string(what) + ": " + libusb_error_name(rc);
+}
+
+std::vector<std::pair<uint32_t, uint32_t>> missing_ranges(uint32_t start, uint32_t length,
+                                                          std::vector<std::pair<uint32_t, uint32_t>> covered) {
+  std::vector<std::pair<uint32_t, uint32_t>> missing;
+  std::sort(covered.begin(), covered.end());
+  uint32_t pos = start;
+  for (const auto &c : covered) {
+    if (c.first > pos) {
+      missing.emplace_back(pos, c.first - pos);
+    }
+    pos = std::max(pos, c.first + c.second);
+  }
+  if (pos < start + length) {
+    missing.emplace_back(pos, start + length - pos);
+  }
+  return missing;
+}
+
+}  // namespace
+
+struct client::transfer_slot {
+  libusb_transfer *transfer = nullptr;
+  uint8_t *buffer = nullptr;
+  bool dev_mem = false;  // usbfs memory the controller DMAs into directly, no bounce buffer in the kernel
+  int completed = 0;
+};
+
+client::client(const client_options &options) : options_(options) {
+  if (options_.transfers < 1 || options_.transfer_len == 0 || options_.transfer_len % DALSA_BULK_CHUNK_LEN != 0) {
+    throw error("transfer_len must be a multiple of the bulk chunk length");
+  }
+
+  int rc = libusb_init(&ctx_);
+  if (rc != 0) {
+    throw error(usb_error("libusb_init", rc));
+  }
+  handle_ = libusb_open_device_with_vid_pid(ctx_, DALSA_VENDOR_ID, DALSA_PRODUCT_ID);
+  if (handle_ == nullptr) {
+    libusb_exit(ctx_);
+    throw error("Could not find Dalsa Teensy. Make sure it's connected.");
+  }
+  libusb_set_auto_detach_kernel_driver(handle_, 1);
+  rc = libusb_claim_interface(handle_, DALSA_INTERFACE);
+  if (rc != 0) {
+    libusb_close(handle_);
+    libusb_exit(ctx_);
+    throw error(usb_error("libusb_claim_interface", rc));
+  }
+
+  slots_.resize(options_.transfers);
+  for (auto &slot : slots_) {
+    slot.transfer = libusb_alloc_transfer(0);
+    slot.buffer = libusb_dev_mem_alloc(handle_, options_.transfer_len);
+    slot.dev_mem = slot.buffer != nullptr;
+    if (!slot.dev_mem) {
+      slot.buffer = new uint8_t[options_.transfer_len];
+    }
+  }
+
+  caps_.max_frame_len = DEFAULT_MAX_FRAME_LEN;
+  caps_.max_response_len = DEFAULT_MAX_RESPONSE_LEN;
+  caps_.max_outstanding = 1;
+  std::vector<uint8_t> caps = command(DALSA_CMD_CAPABILITIES);
+  if (caps.size() != sizeof(caps_)) {
+    throw error("Capabilities response does not match the expected size");
+  }
+  memcpy(&caps_, caps.data(), sizeof(caps_));
+}
+
+client::~client() {
+  for (auto &slot : slots_) {
+    libusb_free_transfer(slot.transfer);
+    if (slot.dev_mem) {
+      libusb_dev_mem_free(handle_, slot.buffer, options_.transfer_len);
+    } else {
+      delete[] slot.buffer;
+    }
+  }
+  libusb_release_interface(handle_, DALSA_INTERFACE);
+  libusb_close(handle_);
+  libusb_exit(ctx_);
+}
+
+void client::send_frame(const std::vector<uint8_t> &frame) {
+  // The device only takes a new frame once a previous response has been read, so drain before we'd block
+  while (frames_in_flight_ >= caps_.max_outstanding) {
+    receive_responses();
+  }
+  int sent = 0;
+  int rc = libusb_bulk_transfer(handle_, DALSA_CONTROL_OUT_ENDPOINT, const_cast<uint8_t *>(frame.data()), frame.size(),
+                                &sent, options_.timeout_ms);
+  if (rc != 0) {
+    throw error(usb_error("Sending command frame", rc));
+  }
+  frames_in_flight_++;
+}
+
+void client::receive_responses() {
+  // Every IN transfer carries the responses to exactly one command frame
+  std::vector<uint8_t> buf(caps_.max_response_len);
+  int received = 0;
+  int rc = libusb_bulk_transfer(handle_, DALSA_CONTROL_IN_ENDPOINT, buf.data(), buf.size(), &received, options_.timeout_ms);
+  if (rc != 0) {
+    throw error(usb_error("Receiving responses", rc));
+  }
+  frames_in_flight_--;
+  rx_.insert(rx_.end(), buf.begin(), buf.begin() + received);
+
+  size_t pos = 0;
+  while (rx_.size() - pos >= sizeof(dalsa_resp_header_t)) {
+    dalsa_resp_header_t header;
+    memcpy(&header, &rx_[pos], sizeof(header));
+    if (header.version != DALSA_PROTOCOL_VERSION) {
+      rx_.clear();
+      throw error("Invalid response version " + std::to_string(header.version));
+    }
+    size_t end = pos + sizeof(header) + header.data_len;
+    if (rx_.size() < end) {
+      break;
+    }
+    responses_.push_back({header.tag, {header.status, std::vector<uint8_t>(rx_.begin() + pos + sizeof(header), rx_.begin() + end)}});
+    pos = end;
+  }
+  rx_.erase(rx_.begin(), rx_.begin() + pos);
+}
+
+std::vector<uint8_t> client::collect(uint16_t tag) {
+  // Whichever caller holds the lock reads the next response frame, and parks the other callers' responses
+  std::lock_guard<std::mutex> lock(command_mutex_);
+  while (true) {
+    for (auto it = responses_.begin(); it != responses_.end(); ++it) {
+      if (it->first == tag) {
+        uint8_t status = it->second.first;
+        std::vector<uint8_t> data = std::move(it->second.second);
+        responses_.erase(it);
+        if (status != DALSA_STATUS_OK) {
+          throw error("Command failed with status " + std::to_string(status), status);
+        }
+        return data;
+      }
+    }
+    if (frames_in_flight_ == 0) {
+      throw error("No response to request " + std::to_string(tag));
+    }
+    receive_responses();
+  }
+}
+
+std::vector<uint16_t> client::submit(const std::vector<std::pair<uint8_t, std::vector<uint8_t>>> &commands) {
+  std::lock_guard<std::mutex> lock(command_mutex_);
+  std::vector<uint16_t> tags;
+  std::vector<uint8_t> frame;
+  for (const auto &c : commands) {
+    dalsa_req_header_t header = {DALSA_PROTOCOL_VERSION, c.first, next_tag_++, (uint32_t) c.second.size()};
+    size_t len = sizeof(header) + c.second.size();
+    if (len > caps_.max_frame_len) {
+      throw error("Request too large: " + std::to_string(len));
+    }
+    if (frame.size() + len > caps_.max_frame_len) {
+      send_frame(frame);
+      frame.clear();
+    }
+    const uint8_t *h = (const uint8_t *) &header;
+    frame.insert(frame.end(), h, h + sizeof(header));
+    frame.insert(frame.end(), c.second.begin(), c.second.end());
+    tags.push_back(header.tag);
+  }
+  if (!frame.empty()) {
+    send_frame(frame);
+  }
+  return tags;
+}
+
+std::vector<std::vector<uint8_t>> client::command_batch(const std::vector<std::pair<uint8_t, std::vector<uint8_t>>> &commands) {
+  std::vector<std::vector<uint8_t>> results;
+  for (uint16_t tag : submit(commands)) {
+    results.push_back(collect(tag));
+  }
+  return results;
+}
+
+std::vector<uint8_t> client::command(uint8_t cmd, const void *data, size_t len) {
+  const uint8_t *bytes = (const uint8_t *) data;
+  return command_batch({{cmd, std::vector<uint8_t>(bytes, bytes + len)}})[0];
+}
+
+void client::ping() {
+  std::vector<uint8_t> resp = command(DALSA_CMD_PING);
+  if (resp.size() != 1 || resp[0] != 0xA5) {
+    throw error("Invalid ping response");
+  }
+}
+
+uint8_t client::start_readout(bool high_gain) {
+  uint8_t arg = high_gain;
+  std::vector<uint8_t> resp = command(DALSA_CMD_START_READOUT, &arg, 1);
+  return resp.empty() ? DALSA_READOUT_STARTED : resp[0];
+}
+
+void client::set_test_pattern(uint8_t pattern, uint32_t seed, uint32_t row_rate) {
+  dalsa_test_pattern_t config = {pattern, {0, 0, 0}, seed, row_rate};
+  command(DALSA_CMD_TEST_PATTERN, &config, sizeof(config));
+}
+
+size_t client::bulk_read(uint8_t *dst, size_t len, unsigned timeout_ms) {
+  std::lock_guard<std::mutex> lock(stream_mutex_);
+  int received = 0;
+  int rc = libusb_bulk_transfer(handle_, DALSA_BULK_IN_ENDPOINT, dst, len, &received, timeout_ms);
+  if (rc != 0 && rc != LIBUSB_ERROR_TIMEOUT) {
+    throw error(usb_error("Bulk read", rc));
+  }
+  stats_.bytes += received;
+  return received;
+}
+
+bool client::wait_event(dalsa_event_t &event, unsigned timeout_ms) {
+  int received = 0;
+  int rc = libusb_interrupt_transfer(handle_, DALSA_EVENT_IN_ENDPOINT, (uint8_t *) &event, sizeof(event), &received, timeout_ms);
+  if (rc == LIBUSB_ERROR_TIMEOUT) {
+    return false;
+  }
+  if (rc != 0 || received != sizeof(event)) {
+    throw error(usb_error("Reading event", rc));
+  }
+  return true;
+}
+
+size_t client::fetch_len(const region &r) const {
+  // Sensor geometry, binned frames come out smaller
+  uint32_t rows = r.row_count != 0 ? r.row_count : caps_.rows - std::min<uint32_t>(r.row_start, caps_.rows);
+  uint32_t cols = r.col_count != 0 ? r.col_count : caps_.columns - std::min<uint32_t>(r.col_start, caps_.columns);
+  uint32_t stride = std::max<uint32_t>(r.stride, 1);
+  return sizeof(dalsa_frame_header_t) + ((rows + stride - 1) / stride) * ((cols + stride - 1) / stride) * sizeof(uint16_t);
+}
+
+dalsa_fetch_resp_t client::request_range(const region &r, uint32_t offset, uint32_t len, uint16_t &tag) {
+  dalsa_fetch_req_t req = {r.slot, r.stride, r.row_start, r.row_count, r.col_start, r.col_count, offset, len};
+  const uint8_t *bytes = (const uint8_t *) &req;
+  tag = submit({{DALSA_CMD_FETCH, std::vector<uint8_t>(bytes, bytes + sizeof(req))}})[0];
+  std::vector<uint8_t> resp = collect(tag);
+  dalsa_fetch_resp_t info;
+  if (resp.size() != sizeof(info)) {
+    throw error("Fetch response does not match the expected size");
+  }
+  memcpy(&info, resp.data(), sizeof(info));
+  return info;
+}
+
+void client::transfer_done(libusb_transfer *transfer) {
+  ((transfer_slot *) transfer->user_data)->completed = 1;
+}
+
+void client::read_stream(uint32_t stream_len, uint16_t tag, uint8_t *dst, size_t capacity,
+                         std::vector<std::pair<uint32_t, uint32_t>> &covered) {
+  // Transfers on one endpoint complete in the order they were submitted, so slots come back round-robin
+  uint32_t requested = 0;
+  size_t next_submit = 0;
+  size_t next_complete = 0;
+  size_t in_flight = 0;
+  bool ended = false;
+  header_seen_ = false;
+
+  auto submit = [&]() {
+    while (!ended && in_flight < slots_.size() && requested < stream_len) {
+      transfer_slot &slot = slots_[next_submit % slots_.size()];
+      uint32_t len = std::min<uint32_t>(options_.transfer_len, stream_len - requested);
+      libusb_fill_bulk_transfer(slot.transfer, handle_, DALSA_BULK_IN_ENDPOINT, slot.buffer, len, transfer_done, &slot,
+                                options_.timeout_ms);
+      slot.completed = 0;
+      if (libusb_submit_transfer(slot.transfer) != 0) {
+        ended = true;
+        break;
+      }
+      requested += len;
+      next_submit++;
+      in_flight++;
+    }
+  };
+
+  submit();
+  while (in_flight > 0) {
+    transfer_slot &slot = slots_[next_complete % slots_.size()];
+    while (!slot.completed) {
+      libusb_handle_events_completed(ctx_, &slot.completed);
+    }
+    next_complete++;
+    in_flight--;
+
+    libusb_transfer *t = slot.transfer;
+    if (t->actual_length > 0) {
+      place_chunks(slot.buffer, t->actual_length, tag, dst, capacity, covered);
+    }
+    if (!ended && (t->status != LIBUSB_TRANSFER_COMPLETED || t->actual_length < t->length)) {
+      // The stream stopped short, drop what's still queued and let the retries pick up the rest
+      ended = true;
+      for (size_t i = next_complete; i < next_submit; i++) {
+        libusb_cancel_transfer(slots_[i % slots_.size()].transfer);
+      }
+    }
+    submit();
+  }
+}
+
+void client::place_chunks(const uint8_t *data, size_t len, uint16_t tag, uint8_t *dst, size_t capacity,
+                          std::vector<std::pair<uint32_t, uint32_t>> &covered) {
+  stats_.bytes += len;
+  size_t pos = 0;
+  if (!header_seen_) {
+    // Every stream starts with the frame header, its sequence ties the chunks to the frame
+    dalsa_frame_header_t header;
+    if (len < sizeof(header)) {
+      return;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != DALSA_FRAME_MAGIC) {
+      return;
+    }
+    dalsa_frame_header_t current;
+    memcpy(&current, dst, sizeof(current));
+    if (current.magic != DALSA_FRAME_MAGIC) {
+      memcpy(dst, &header, sizeof(header));
+    } else if (current.sequence != header.sequence) {
+      throw error("Frame was replaced while fetching it");
+    }
+    sequence_ = header.sequence;
+    header_seen_ = true;
+    pos = sizeof(header);
+  }
+
+  while (pos + sizeof(dalsa_chunk_header_t) <= len) {
+    dalsa_chunk_header_t chunk;
+    memcpy(&chunk, data + pos, sizeof(chunk));
+    if (chunk.magic != DALSA_CHUNK_MAGIC || chunk.tag != tag || chunk.sequence != sequence_) {
+      break;  // Lost track of the stream, whatever is left gets requested again
+    }
+    pos += sizeof(chunk);
+    size_t at = sizeof(dalsa_frame_header_t) + chunk.offset;
+    if (pos + chunk.len > len || at + chunk.len > capacity) {
+      break;
+    }
+    memcpy(dst + at, data + pos, chunk.len);
+    if (dalsa_crc32(dst + at, chunk.len) == chunk.crc) {
+      covered.emplace_back((uint32_t) chunk.offset, (uint32_t) chunk.len);
+    } else {
+      stats_.crc_errors++;
+    }
+    stats_.chunks++;
+    pos += chunk.len;
+  }
+}
+
+size_t client::fetch(const region &r, uint8_t *dst, size_t capacity) {
+  if (capacity < fetch_len(r)) {
+    throw error("Fetch buffer too small");
+  }
+  // A new fetch aborts the stream that's running on the device
+  std::lock_guard<std::mutex> lock(stream_mutex_);
+  memset(dst, 0, sizeof(dalsa_frame_header_t));
+
+  uint16_t tag;
+  dalsa_fetch_resp_t info = request_range(r, 0, 0, tag);
+  std::vector<std::pair<uint32_t, uint32_t>> covered;
+  read_stream(info.stream_len, tag, dst, capacity, covered);
+
+  dalsa_frame_header_t header;
+  memcpy(&header, dst, sizeof(header));
+  region retry = r;
+  if (header.magic == DALSA_FRAME_MAGIC) {
+    // Retries go to the same slot, even if a newer frame completes in the meantime
+    retry.slot = header.slot;
+  }
+  auto missing = missing_ranges(0, info.len, covered);
+  for (int i = 0; i < options_.retries && !missing.empty(); i++) {
+    for (const auto &m : missing) {
+      stats_.retries++;
+      dalsa_fetch_resp_t part = request_range(retry, m.first, m.second, tag);
+      read_stream(part.stream_len, tag, dst, capacity, covered);
+    }
+    missing = missing_ranges(0, info.len, covered);
+  }
+  if (!missing.empty()) {
+    throw error("Failed to fetch frame, " + std::to_string(missing.size()) + " ranges missing");
+  }
+
+  memcpy(&header, dst, sizeof(header));
+  if (header.magic != DALSA_FRAME_MAGIC) {
+    throw error("Did not receive a frame header");
+  }
+  bool whole_frame = r.stride == 1 && r.row_start == 0 && r.row_count == 0 && r.col_start == 0 && r.col_count == 0;
+  if (whole_frame && header.frame_crc_valid && dalsa_crc32(dst + sizeof(header), info.len) != header.frame_crc) {
+    throw error("Frame CRC mismatch");
+  }
+  return sizeof(header) + info.len;
+}
+
+size_t client::fetch(const region &r, std::vector<uint8_t> &dst) {
+  // Reused across calls, the buffer only grows
+  if (dst.size() < fetch_len(r)) {
+    dst.resize(fetch_len(r));
+  }
+  return fetch(r, dst.data(), dst.size());
+}
+
+}  // namespace dalsa
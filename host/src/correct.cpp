@@ -0,0 +1,280 @@
+#include "dalsa/correct.h"
+#include "cpu.h"
+#include "thread_pool.h"
+
+#include <immintrin.h>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+namespace {
+
+struct bad_pixel_map {
+  std::vector<uint8_t> column_bad;
+  std::vector<uint16_t> columns;
+  std::vector<dalsa_bad_pixel_t> pixels;  // Sorted by row, then column
+};
+
+struct window_params {
+  uint32_t low;
+  uint32_t high;
+  uint32_t mul;    // out = ((v - low) * mul + round) >> shift, stays below 2^31
+  uint32_t shift;
+  uint32_t full;
+  bool invert;
+};
+
+struct job {
+  const uint16_t *src;
+  uint32_t cols;
+  const dalsa_correction_t *config;
+  bool avx2;
+  bool calibrate;
+  int32_t acc;
+  const bad_pixel_map *bad;
+  uint16_t *corrected;
+  uint8_t *dst;
+  size_t dst_stride;
+  window_params window;
+};
+
+// Same as calibration_correct_row() in the firmware: saturating signed difference, Q3.12 multiply with the
+// pedestal as accumulator, then shifted and saturated to 16 bits
+inline uint16_t correct_pixel(uint16_t raw, uint16_t dark, uint16_t gain, int32_t acc) {
+  int32_t diff = std::clamp<int32_t>((int16_t) raw - (int16_t) dark, INT16_MIN, INT16_MAX);
+  return std::clamp<int32_t>((diff * (int16_t) gain + acc) >> DALSA_GAIN_SHIFT, 0, UINT16_MAX);
+}
+
+inline uint32_t window_pixel(uint16_t v, const window_params &w) {
+  uint32_t d = std::clamp<uint32_t>(v, w.low, w.high) - w.low;
+  uint32_t out = (d * w.mul + (1u << (w.shift - 1))) >> w.shift;
+  return w.invert ? w.full - out : out;
+}
+
+void correct_row(const uint16_t *in, const uint16_t *dark, const uint16_t *gain, int32_t acc, uint16_t *out, uint32_t cols) {
+  for (uint32_t i = 0; i < cols; i++) {
+    out[i] = correct_pixel(in[i], dark != nullptr ? dark[i] : 0, gain != nullptr ? gain[i] : 1 << DALSA_GAIN_SHIFT, acc);
+  }
+}
+
+__attribute__((target("avx2")))
+void correct_row_avx2(const uint16_t *in, const uint16_t *dark, const uint16_t *gain, int32_t acc, uint16_t *out, uint32_t cols) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i unity = _mm256_set1_epi16(1 << DALSA_GAIN_SHIFT);
+  const __m256i acc_v = _mm256_set1_epi32(acc);
+  uint32_t i = 0;
+  for (; i + 16 <= cols; i += 16) {
+    __m256i raw = _mm256_loadu_si256((const __m256i *) (in + i));
+    __m256i dk = dark != nullptr ? _mm256_loadu_si256((const __m256i *) (dark + i)) : zero;
+    __m256i g = gain != nullptr ? _mm256_loadu_si256((const __m256i *) (gain + i)) : unity;
+    __m256i diff = _mm256_subs_epi16(raw, dk);
+    // 32-bit products from the low and high halves, unpack and packus both work per 128-bit lane so the
+    // order comes back out as it went in
+    __m256i lo = _mm256_mullo_epi16(diff, g);
+    __m256i hi = _mm256_mulhi_epi16(diff, g);
+    __m256i p0 = _mm256_srai_epi32(_mm256_add_epi32(_mm256_unpacklo_epi16(lo, hi), acc_v), DALSA_GAIN_SHIFT);
+    __m256i p1 = _mm256_srai_epi32(_mm256_add_epi32(_mm256_unpackhi_epi16(lo, hi), acc_v), DALSA_GAIN_SHIFT);
+    _mm256_storeu_si256((__m256i *) (out + i), _mm256_packus_epi32(p0, p1));
+  }
+  correct_row(in + i, dark != nullptr ? dark + i : nullptr, gain != nullptr ? gain + i : nullptr, acc, out + i, cols - i);
+}
+
+template <typename T>
+void window_row(const uint16_t *in, T *out, uint32_t cols, const window_params &w) {
+  for (uint32_t i = 0; i < cols; i++) {
+    out[i] = window_pixel(in[i], w);
+  }
+}
+
+template <typename T>
+__attribute__((target("avx2")))
+void window_row_avx2(const uint16_t *in, T *out, uint32_t cols, const window_params &w) {
+  const __m256i low = _mm256_set1_epi16(w.low);
+  const __m256i high = _mm256_set1_epi16(w.high);
+  const __m256i mul = _mm256_set1_epi32(w.mul);
+  const __m256i round = _mm256_set1_epi32(1u << (w.shift - 1));
+  const __m256i full = _mm256_set1_epi32(w.full);
+  const __m128i shift = _mm_cvtsi32_si128(w.shift);
+  uint32_t i = 0;
+  for (; i + 16 <= cols; i += 16) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (in + i));
+    __m256i d = _mm256_sub_epi16(_mm256_min_epu16(_mm256_max_epu16(v, low), high), low);
+    __m256i d0 = _mm256_cvtepu16_epi32(_mm256_castsi256_si128(d));
+    __m256i d1 = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(d, 1));
+    d0 = _mm256_srl_epi32(_mm256_add_epi32(_mm256_mullo_epi32(d0, mul), round), shift);
+    d1 = _mm256_srl_epi32(_mm256_add_epi32(_mm256_mullo_epi32(d1, mul), round), shift);
+    if (w.invert) {
+      d0 = _mm256_sub_epi32(full, d0);
+      d1 = _mm256_sub_epi32(full, d1);
+    }
+    // packus interleaves the lanes, the permute puts the 16 pixels back in order
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(d0, d1), 0xD8);
+    if (sizeof(T) == 1) {
+      __m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(packed, packed), 0x08);
+      _mm_storeu_si128((__m128i *) (out + i), _mm256_castsi256_si128(bytes));
+    } else {
+      _mm256_storeu_si256((__m256i *) (out + i), packed);
+    }
+  }
+  window_row(in + i, out + i, cols - i, w);
+}
+
+using pixel_iter = std::vector<dalsa_bad_pixel_t>::const_iterator;
+
+// [first, last) are the single defects of this row, sorted by column
+bool is_bad(int32_t col, const std::vector<uint8_t> &column_bad, pixel_iter first, pixel_iter last) {
+  if (column_bad[col]) {
+    return true;
+  }
+  for (auto p = first; p != last && p->col <= col; ++p) {
+    if (p->col == col) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Like interpolate() in firmware/src/bad_pixels.cpp: mean of the nearest neighbours that aren't defects
+void interpolate(uint16_t *row, int32_t col, int32_t cols, const std::vector<uint8_t> &column_bad, pixel_iter first, pixel_iter last) {
+  int32_t left = col - 1;
+  while (left >= 0 && is_bad(left, column_bad, first, last)) left--;
+  int32_t right = col + 1;
+  while (right < cols && is_bad(right, column_bad, first, last)) right++;
+
+  if (left >= 0 && right < cols) {
+    row[col] = (row[left] + row[right] + 1) / 2;
+  } else if (left >= 0) {
+    row[col] = row[left];
+  } else if (right < cols) {
+    row[col] = row[right];
+  }
+}
+
+void patch_row(uint16_t *row, uint32_t row_index, uint32_t cols, const bad_pixel_map &bad) {
+  auto first = std::lower_bound(bad.pixels.begin(), bad.pixels.end(), row_index,
+                                [](const dalsa_bad_pixel_t &p, uint32_t r) { return p.row < r; });
+  auto last = first;
+  while (last != bad.pixels.end() && last->row == row_index) ++last;
+
+  for (uint16_t col : bad.columns) {
+    interpolate(row, col, cols, bad.column_bad, first, last);
+  }
+  for (auto p = first; p != last; ++p) {
+    interpolate(row, p->col, cols, bad.column_bad, first, last);
+  }
+}
+
+void process_rows(const job &j, size_t begin, size_t end) {
+  const dalsa_correction_t *c = j.config;
+  bool patch = !j.bad->columns.empty() || !j.bad->pixels.empty();
+  // Rows are corrected into a scratch row that stays in L1 when the caller doesn't want them back
+  std::vector<uint16_t> scratch(j.corrected == nullptr && (j.calibrate || patch) ? j.cols : 0);
+
+  for (size_t r = begin; r < end; r++) {
+    size_t offset = r * j.cols;
+    const uint16_t *in = j.src + offset;
+    uint16_t *row = j.corrected != nullptr ? j.corrected + offset : scratch.data();
+    if (j.calibrate) {
+      const uint16_t *dark = c->dark != nullptr ? c->dark + offset : nullptr;
+      const uint16_t *gain = c->gain != nullptr ? c->gain + offset : nullptr;
+      (j.avx2 ? correct_row_avx2 : correct_row)(in, dark, gain, j.acc, row, j.cols);
+    } else if (row != nullptr && row != in && (patch || j.corrected != nullptr)) {
+      memcpy(row, in, j.cols * sizeof(uint16_t));
+    }
+    if (patch) {
+      patch_row(row, r, j.cols, *j.bad);
+    }
+
+    if (j.dst != nullptr) {
+      const uint16_t *v = (j.calibrate || patch || j.corrected != nullptr) ? row : in;
+      uint8_t *out = j.dst + r * j.dst_stride;
+      if (c->output_bits == 8) {
+        (j.avx2 ? window_row_avx2<uint8_t> : window_row<uint8_t>)(v, out, j.cols, j.window);
+      } else {
+        (j.avx2 ? window_row_avx2<uint16_t> : window_row<uint16_t>)(v, (uint16_t *) out, j.cols, j.window);
+      }
+    }
+  }
+}
+
+template <typename T>
+void lut_rows(const uint16_t *src, uint32_t cols, const T *lut, uint8_t *dst, size_t dst_stride, size_t begin, size_t end) {
+  for (size_t r = begin; r < end; r++) {
+    const uint16_t *in = src + r * cols;
+    T *out = (T *) (dst + r * dst_stride);
+    // The table is 64K or 128K, so it mostly stays in L2; the lookups don't depend on each other
+    uint32_t i = 0;
+    for (; i + 4 <= cols; i += 4) {
+      T a = lut[in[i]], b = lut[in[i + 1]], c = lut[in[i + 2]], d = lut[in[i + 3]];
+      out[i] = a;
+      out[i + 1] = b;
+      out[i + 2] = c;
+      out[i + 3] = d;
+    }
+    for (; i < cols; i++) {
+      out[i] = lut[in[i]];
+    }
+  }
+}
+
+}  // namespace
+
+void dalsa_apply_lut(const uint16_t *src, uint32_t rows, uint32_t cols, const void *lut, uint8_t output_bits,
+                     void *dst, size_t dst_stride, uint16_t threads) {
+  dalsa::thread_pool::shared().parallel_for(rows, threads, [&](size_t begin, size_t end) {
+    if (output_bits == 8) {
+      lut_rows(src, cols, (const uint8_t *) lut, (uint8_t *) dst, dst_stride, begin, end);
+    } else {
+      lut_rows(src, cols, (const uint16_t *) lut, (uint8_t *) dst, dst_stride, begin, end);
+    }
+  });
+}
+
+void dalsa_correct_frame(const uint16_t *src, uint32_t rows, uint32_t cols, const dalsa_correction_t *config,
+                         uint16_t *corrected, void *dst, size_t dst_stride) {
+  bad_pixel_map bad;
+  if (config->bad_pixels != nullptr && config->bad_pixel_count > 0) {
+    bad.column_bad.assign(cols, 0);
+    for (uint32_t i = 0; i < config->bad_pixel_count; i++) {
+      const dalsa_bad_pixel_t &p = config->bad_pixels[i];
+      if (p.col >= cols) {
+        continue;
+      }
+      if (p.row == DALSA_BAD_PIXEL_COLUMN) {
+        bad.column_bad[p.col] = 1;
+        bad.columns.push_back(p.col);
+      } else if (p.row < rows) {
+        bad.pixels.push_back(p);
+      }
+    }
+    std::sort(bad.columns.begin(), bad.columns.end());
+    std::sort(bad.pixels.begin(), bad.pixels.end(), [](const dalsa_bad_pixel_t &a, const dalsa_bad_pixel_t &b) {
+      return a.row != b.row ? a.row < b.row : a.col < b.col;
+    });
+  }
+
+  job j = {};
+  j.src = src;
+  j.cols = cols;
+  j.config = config;
+  j.avx2 = dalsa::use_avx2();
+  j.calibrate = config->dark != nullptr || config->gain != nullptr;
+  j.acc = (int32_t) config->pedestal << DALSA_GAIN_SHIFT;
+  j.bad = &bad;
+  j.corrected = corrected;
+  j.dst = (uint8_t *) dst;
+  j.dst_stride = dst_stride;
+
+  uint32_t low = std::min(config->window_low, config->window_high);
+  uint32_t high = std::max(config->window_low, config->window_high);
+  j.window.low = low;
+  j.window.high = high;
+  j.window.full = config->output_bits == 8 ? UINT8_MAX : UINT16_MAX;
+  j.window.shift = config->output_bits == 8 ? 23 : 15;
+  j.window.mul = (j.window.full << j.window.shift) / std::max<uint32_t>(high - low, 1);
+  j.window.invert = config->invert != 0;
+
+  dalsa::thread_pool::shared().parallel_for(rows, config->threads,
+                                            [&j](size_t begin, size_t end) { process_rows(j, begin, end); });
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstdlib>
+
+namespace dalsa {
+
+// The AVX2 paths run when the CPU has it. DALSA_NO_AVX2 forces the scalar ones, it is read on every call so
+// a check can run both on the same frames in one process.
+inline bool use_avx2() {
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  return has_avx2 && getenv("DALSA_NO_AVX2") == nullptr;
+}
+
+}  // namespace dalsa
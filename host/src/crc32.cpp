@@ -0,0 +1,53 @@
+#include "dalsa/crc32.h"
+
+#include <array>
+
+namespace {
+
+// Slicing-by-8 tables, tables[k][i] is the CRC of byte i followed by k zero bytes
+struct crc_tables {
+  std::array<std::array<uint32_t, 256>, 8> t;
+
+  crc_tables() {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t crc = i << 24;
+      for (int bit = 0; bit < 8; bit++) {
+        crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : (crc << 1);
+      }
+      t[0][i] = crc;
+    }
+    for (int k = 1; k < 8; k++) {
+      for (uint32_t i = 0; i < 256; i++) {
+        t[k][i] = (t[k - 1][i] << 8) ^ t[0][t[k - 1][i] >> 24];
+      }
+    }
+  }
+};
+
+const crc_tables tables;
+
+inline uint32_t load_be32(const uint8_t *p) {
+  return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+}  // namespace
+
+uint32_t dalsa_crc32_update(uint32_t crc, const uint8_t *data, size_t len) {
+  const auto &t = tables.t;
+  while (len >= 8) {
+    uint32_t hi = crc ^ load_be32(data);
+    uint32_t lo = load_be32(data + 4);
+    crc = t[7][hi >> 24] ^ t[6][(hi >> 16) & 0xFF] ^ t[5][(hi >> 8) & 0xFF] ^ t[4][hi & 0xFF] ^
+          t[3][lo >> 24] ^ t[2][(lo >> 16) & 0xFF] ^ t[1][(lo >> 8) & 0xFF] ^ t[0][lo & 0xFF];
+    data += 8;
+    len -= 8;
+  }
+  while (len--) {
+    crc = (crc << 8) ^ t[0][(crc >> 24) ^ *data++];
+  }
+  return crc;
+}
+
+uint32_t dalsa_crc32(const uint8_t *data, size_t len) {
+  return dalsa_crc32_update(DALSA_CRC32_INIT, data, len);
+}
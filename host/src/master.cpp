@@ -0,0 +1,339 @@
+#include "dalsa/master.h"
+#include "cpu.h"
+#include "thread_pool.h"
+
+#include <immintrin.h>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+struct dalsa_master {
+  uint32_t rows;
+  uint32_t cols;
+  dalsa_master_config_t config;
+  uint32_t frames = 0;
+  float noise = 0;  // Typical noise of a pixel, the clip never gets tighter than clip_sigma times this
+  // One plane per statistic, so the inner loop streams through each of them
+  std::vector<float> mean, m2, clip_mean, clip_m2, clip_n, median;
+  std::vector<uint16_t> warmup;  // The first clip_warmup frames, dropped once they seeded the clipping
+};
+
+namespace {
+
+constexpr float MIN_SIGMA = 0.5f;           // Quantization noise, keeps the clip and median step from collapsing
+constexpr float MEDIAN_GAIN = 1.2533141f;   // sqrt(pi / 2), the optimal gain for Gaussian noise
+
+struct add_params {
+  float inv_n;
+  float median_step;  // MEDIAN_GAIN / n
+  float clip_sigma;
+  float noise;
+};
+
+struct seed_planes {
+  float *clip_mean;
+  float *clip_m2;
+  float *clip_n;
+  float *median;
+};
+
+inline float clipped_sigma(float m2, float n, float noise) {
+  return std::max(std::sqrt(m2 / std::max(n - 1.0f, 1.0f)), noise);
+}
+
+void add_pixels(const uint16_t *in, dalsa_master &m, size_t begin, size_t end, const add_params &p) {
+  float *mean = m.mean.data(), *m2 = m.m2.data(), *cmean = m.clip_mean.data(), *cm2 = m.clip_m2.data();
+  float *cn = m.clip_n.data(), *median = m.median.data();
+  for (size_t i = begin; i < end; i++) {
+    float x = in[i];
+    float d = x - mean[i];
+    mean[i] += d * p.inv_n;
+    m2[i] += d * (x - mean[i]);
+
+    float dc = x - cmean[i];
+    float limit = p.clip_sigma * clipped_sigma(cm2[i], cn[i], p.noise);
+    float keep = (p.clip_sigma <= 0 || std::fabs(dc) <= limit) ? 1.0f : 0.0f;
+    cn[i] += keep;
+    cmean[i] += keep * dc / cn[i];
+    cm2[i] += keep * dc * (x - cmean[i]);
+
+    float step = p.median_step * clipped_sigma(cm2[i], cn[i], p.noise);
+    float sign = (x > median[i] ? 1.0f : 0.0f) - (x < median[i] ? 1.0f : 0.0f);
+    median[i] += sign * step;
+  }
+}
+
+__attribute__((target("avx2")))
+inline __m256 clipped_sigma_avx2(__m256 m2, __m256 n, __m256 noise) {
+  const __m256 one = _mm256_set1_ps(1.0f);
+  return _mm256_max_ps(_mm256_sqrt_ps(_mm256_div_ps(m2, _mm256_max_ps(_mm256_sub_ps(n, one), one))), noise);
+}
+
+// Same operations in the same order as add_pixels(), 8 pixels at a time
+__attribute__((target("avx2")))
+void add_pixels_avx2(const uint16_t *in, dalsa_master &m, size_t begin, size_t end, const add_params &p) {
+  float *mean = m.mean.data(), *m2 = m.m2.data(), *cmean = m.clip_mean.data(), *cm2 = m.clip_m2.data();
+  float *cn = m.clip_n.data(), *median = m.median.data();
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+  const __m256 inv_n = _mm256_set1_ps(p.inv_n);
+  const __m256 median_step = _mm256_set1_ps(p.median_step);
+  const __m256 clip_sigma = _mm256_set1_ps(p.clip_sigma);
+  const __m256 noise = _mm256_set1_ps(p.noise);
+  const __m256 keep_all = p.clip_sigma <= 0 ? one : _mm256_setzero_ps();
+
+  size_t i = begin;
+  for (; i + 8 <= end; i += 8) {
+    __m256 x = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *) (in + i))));
+    __m256 mean_v = _mm256_loadu_ps(mean + i);
+    __m256 d = _mm256_sub_ps(x, mean_v);
+    mean_v = _mm256_add_ps(mean_v, _mm256_mul_ps(d, inv_n));
+    _mm256_storeu_ps(mean + i, mean_v);
+    _mm256_storeu_ps(m2 + i, _mm256_add_ps(_mm256_loadu_ps(m2 + i), _mm256_mul_ps(d, _mm256_sub_ps(x, mean_v))));
+
+    __m256 cmean_v = _mm256_loadu_ps(cmean + i), cm2_v = _mm256_loadu_ps(cm2 + i), cn_v = _mm256_loadu_ps(cn + i);
+    __m256 dc = _mm256_sub_ps(x, cmean_v);
+    __m256 limit = _mm256_mul_ps(clip_sigma, clipped_sigma_avx2(cm2_v, cn_v, noise));
+    __m256 keep = _mm256_or_ps(keep_all, _mm256_and_ps(_mm256_cmp_ps(_mm256_and_ps(dc, abs_mask), limit, _CMP_LE_OQ), one));
+    cn_v = _mm256_add_ps(cn_v, keep);
+    __m256 kd = _mm256_mul_ps(keep, dc);
+    cmean_v = _mm256_add_ps(cmean_v, _mm256_div_ps(kd, cn_v));
+    cm2_v = _mm256_add_ps(cm2_v, _mm256_mul_ps(kd, _mm256_sub_ps(x, cmean_v)));
+    _mm256_storeu_ps(cn + i, cn_v);
+    _mm256_storeu_ps(cmean + i, cmean_v);
+    _mm256_storeu_ps(cm2 + i, cm2_v);
+
+    __m256 median_v = _mm256_loadu_ps(median + i);
+    __m256 step = _mm256_mul_ps(median_step, clipped_sigma_avx2(cm2_v, cn_v, noise));
+    __m256 sign = _mm256_sub_ps(_mm256_and_ps(_mm256_cmp_ps(x, median_v, _CMP_GT_OQ), one),
+                                _mm256_and_ps(_mm256_cmp_ps(x, median_v, _CMP_LT_OQ), one));
+    _mm256_storeu_ps(median + i, _mm256_add_ps(median_v, _mm256_mul_ps(sign, step)));
+  }
+  add_pixels(in, m, i, end, p);
+}
+
+void welford_rows(const uint16_t *in, dalsa_master &m, size_t begin, size_t end, float inv_n) {
+  for (size_t i = begin; i < end; i++) {
+    float x = in[i];
+    float d = x - m.mean[i];
+    m.mean[i] += d * inv_n;
+    m.m2[i] += d * (x - m.mean[i]);
+  }
+}
+
+template <typename T>
+T median_sorted(const T *v, uint32_t n) {
+  return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+// Median and robust sigma (from the MAD) of each pixel over the first n frames held in warmup, the sigma
+// goes where the clipped variance ends up
+void seed_median(const dalsa_master &m, uint32_t n, size_t begin, size_t end, const seed_planes &out) {
+  size_t pixels = (size_t) m.rows * m.cols;
+  float v[DALSA_MASTER_MAX_WARMUP];
+  for (size_t i = begin; i < end; i++) {
+    for (uint32_t k = 0; k < n; k++) {
+      v[k] = m.warmup[k * pixels + i];
+    }
+    std::sort(v, v + n);
+    float med = median_sorted(v, n);
+    for (uint32_t k = 0; k < n; k++) {
+      v[k] = std::fabs(v[k] - med);
+    }
+    std::sort(v, v + n);
+    out.median[i] = med;
+    out.clip_m2[i] = 1.4826f * median_sorted(v, n);
+  }
+}
+
+// Then the values within clip_sigma of the median go into the clipped mean and variance
+void seed_clip(const dalsa_master &m, uint32_t n, float noise, size_t begin, size_t end, const seed_planes &out) {
+  size_t pixels = (size_t) m.rows * m.cols;
+  for (size_t i = begin; i < end; i++) {
+    float med = out.median[i];
+    float limit = m.config.clip_sigma * std::max(out.clip_m2[i], noise);
+    float cn = 0, cmean = 0, cm2 = 0;
+    for (uint32_t k = 0; k < n; k++) {
+      float x = m.warmup[k * pixels + i];
+      if (m.config.clip_sigma <= 0 || std::fabs(x - med) <= limit) {
+        cn++;
+        float d = x - cmean;
+        cmean += d / cn;
+        cm2 += d * (x - cmean);
+      }
+    }
+    out.clip_mean[i] = cmean;
+    out.clip_m2[i] = cm2;
+    out.clip_n[i] = cn;
+  }
+}
+
+float median_of(std::vector<float> v) {
+  auto mid = v.begin() + v.size() / 2;
+  std::nth_element(v.begin(), mid, v.end());
+  return *mid;
+}
+
+// Returns the typical noise
+float seed(const dalsa_master &m, uint32_t n, const seed_planes &out) {
+  size_t pixels = (size_t) m.rows * m.cols;
+  size_t cols = m.cols;
+  dalsa::thread_pool &pool = dalsa::thread_pool::shared();
+  pool.parallel_for(m.rows, m.config.threads, [&](size_t begin, size_t end) {
+    seed_median(m, n, begin * cols, end * cols, out);
+  });
+  float noise = std::max(median_of(std::vector<float>(out.clip_m2, out.clip_m2 + pixels)), MIN_SIGMA);
+  pool.parallel_for(m.rows, m.config.threads, [&](size_t begin, size_t end) {
+    seed_clip(m, n, noise, begin * cols, end * cols, out);
+  });
+  return noise;
+}
+
+}  // namespace
+
+dalsa_master_t *dalsa_master_create(uint32_t rows, uint32_t cols, const dalsa_master_config_t *config) {
+  dalsa_master *m = new dalsa_master();
+  m->rows = rows;
+  m->cols = cols;
+  m->config = *config;
+  m->config.clip_warmup = std::clamp<uint16_t>(config->clip_warmup, 3, DALSA_MASTER_MAX_WARMUP);
+  size_t pixels = (size_t) rows * cols;
+  for (auto *plane : {&m->mean, &m->m2, &m->clip_mean, &m->clip_m2, &m->clip_n, &m->median}) {
+    plane->assign(pixels, 0.0f);
+  }
+  m->warmup.resize(pixels * m->config.clip_warmup);
+  return m;
+}
+
+void dalsa_master_destroy(dalsa_master_t *master) {
+  delete master;
+}
+
+void dalsa_master_add(dalsa_master_t *master, const uint16_t *frame) {
+  dalsa_master &m = *master;
+  m.frames++;
+  size_t cols = m.cols;
+  size_t pixels = (size_t) m.rows * m.cols;
+  dalsa::thread_pool &pool = dalsa::thread_pool::shared();
+
+  if (m.frames <= m.config.clip_warmup) {
+    std::copy(frame, frame + pixels, m.warmup.begin() + (m.frames - 1) * pixels);
+    pool.parallel_for(m.rows, m.config.threads, [&](size_t begin, size_t end) {
+      welford_rows(frame, m, begin * cols, end * cols, 1.0f / m.frames);
+    });
+    if (m.frames == m.config.clip_warmup) {
+      m.noise = seed(m, m.frames, {m.clip_mean.data(), m.clip_m2.data(), m.clip_n.data(), m.median.data()});
+      std::vector<uint16_t>().swap(m.warmup);
+    }
+    return;
+  }
+
+  add_params p;
+  p.inv_n = 1.0f / m.frames;
+  p.median_step = MEDIAN_GAIN / m.frames;
+  p.clip_sigma = m.config.clip_sigma;
+  p.noise = m.noise;
+  auto add = dalsa::use_avx2() ? add_pixels_avx2 : add_pixels;
+  pool.parallel_for(m.rows, m.config.threads, [&](size_t begin, size_t end) {
+    add(frame, m, begin * cols, end * cols, p);
+  });
+}
+
+uint32_t dalsa_master_frames(const dalsa_master_t *master) {
+  return master->frames;
+}
+
+void dalsa_master_get(const dalsa_master_t *master, uint8_t kind, float *out) {
+  const dalsa_master &m = *master;
+  size_t pixels = (size_t) m.rows * m.cols;
+  const float *clip_mean = m.clip_mean.data(), *clip_m2 = m.clip_m2.data(), *clip_n = m.clip_n.data();
+  const float *median = m.median.data();
+  std::vector<float> seeded;
+  if (m.frames > 0 && m.frames < m.config.clip_warmup && kind != DALSA_MASTER_MEAN) {
+    // Not seeded yet, from the frames there are so far then
+    seeded.resize(4 * pixels);
+    seed_planes planes = {seeded.data(), seeded.data() + pixels, seeded.data() + 2 * pixels, seeded.data() + 3 * pixels};
+    seed(m, m.frames, planes);
+    clip_mean = planes.clip_mean;
+    clip_m2 = planes.clip_m2;
+    clip_n = planes.clip_n;
+    median = planes.median;
+  }
+
+  switch (kind) {
+    case DALSA_MASTER_MEAN:
+      std::copy(m.mean.begin(), m.mean.end(), out);
+      break;
+    case DALSA_MASTER_CLIPPED:
+      std::copy(clip_mean, clip_mean + pixels, out);
+      break;
+    case DALSA_MASTER_MEDIAN:
+      std::copy(median, median + pixels, out);
+      break;
+    case DALSA_MASTER_SIGMA:
+      for (size_t i = 0; i < pixels; i++) {
+        out[i] = clip_n[i] > 1 ? std::sqrt(clip_m2[i] / (clip_n[i] - 1)) : 0.0f;
+      }
+      break;
+  }
+}
+
+uint32_t dalsa_master_defects(const dalsa_master_t *master, const dalsa_defect_config_t *config, uint8_t *map,
+                              dalsa_bad_pixel_t *list, uint32_t max_count) {
+  const dalsa_master &m = *master;
+  size_t pixels = (size_t) m.rows * m.cols;
+  std::vector<float> value(pixels), sigma(pixels);
+  dalsa_master_get(master, DALSA_MASTER_CLIPPED, value.data());
+  dalsa_master_get(master, DALSA_MASTER_SIGMA, sigma.data());
+
+  float level = median_of(value);
+  std::vector<float> deviation(pixels);
+  for (size_t i = 0; i < pixels; i++) {
+    deviation[i] = std::fabs(value[i] - level);
+  }
+  float spread = std::max(1.4826f * median_of(deviation), MIN_SIGMA);
+  float noise = median_of(sigma);
+
+  std::vector<uint8_t> flags(pixels, 0);
+  std::vector<uint32_t> column_count(m.cols, 0);
+  for (size_t i = 0; i < pixels; i++) {
+    float v = value[i];
+    uint8_t f = 0;
+    if (config->hot_sigma > 0 && v > level + config->hot_sigma * spread) {
+      f |= DALSA_DEFECT_HOT;
+    }
+    if (config->dead_fraction > 0 && v < config->dead_fraction * level) {
+      f |= DALSA_DEFECT_DEAD;
+    }
+    if (config->noisy_factor > 0 && sigma[i] > config->noisy_factor * std::max(noise, MIN_SIGMA)) {
+      f |= DALSA_DEFECT_NOISY;
+    }
+    flags[i] = f;
+    column_count[i % m.cols] += f != 0;
+  }
+  if (map != nullptr) {
+    std::copy(flags.begin(), flags.end(), map);
+  }
+
+  uint32_t count = 0;
+  auto emit = [&](uint16_t row, uint16_t col) {
+    if (list != nullptr && count < max_count) {
+      list[count] = {row, col};
+    }
+    count++;
+  };
+  std::vector<uint8_t> column_bad(m.cols, 0);
+  for (uint32_t col = 0; col < m.cols; col++) {
+    if (config->column_fraction > 0 && column_count[col] > config->column_fraction * m.rows) {
+      column_bad[col] = 1;
+      emit(DALSA_BAD_PIXEL_COLUMN, col);
+    }
+  }
+  for (size_t i = 0; i < pixels; i++) {
+    if (flags[i] != 0 && !column_bad[i % m.cols]) {
+      emit(i / m.cols, i % m.cols);
+    }
+  }
+  return count;
+}
@@ -0,0 +1,118 @@
+#include "dalsa/stack.h"
+#include "dalsa/master.h"
+#include "cpu.h"
+#include "thread_pool.h"
+
+#include <immintrin.h>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+struct dalsa_stack {
+  uint32_t rows;
+  uint32_t cols;
+  dalsa_stack_config_t config;
+  uint32_t frames = 0;
+  std::vector<uint32_t> sum;
+  std::vector<uint16_t> min, max;
+  dalsa_master_t *master = nullptr;  // Does the sigma clipping
+};
+
+namespace {
+
+void accumulate(const uint16_t *in, dalsa_stack &s, size_t begin, size_t end) {
+  for (size_t i = begin; i < end; i++) {
+    s.sum[i] += in[i];
+    s.min[i] = std::min(s.min[i], in[i]);
+    s.max[i] = std::max(s.max[i], in[i]);
+  }
+}
+
+__attribute__((target("avx2")))
+void accumulate_avx2(const uint16_t *in, dalsa_stack &s, size_t begin, size_t end) {
+  uint32_t *sum = s.sum.data();
+  uint16_t *min = s.min.data(), *max = s.max.data();
+  size_t i = begin;
+  for (; i + 16 <= end; i += 16) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (in + i));
+    _mm256_storeu_si256((__m256i *) (min + i), _mm256_min_epu16(_mm256_loadu_si256((const __m256i *) (min + i)), v));
+    _mm256_storeu_si256((__m256i *) (max + i), _mm256_max_epu16(_mm256_loadu_si256((const __m256i *) (max + i)), v));
+    __m256i lo = _mm256_cvtepu16_epi32(_mm256_castsi256_si128(v));
+    __m256i hi = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(v, 1));
+    _mm256_storeu_si256((__m256i *) (sum + i), _mm256_add_epi32(_mm256_loadu_si256((const __m256i *) (sum + i)), lo));
+    _mm256_storeu_si256((__m256i *) (sum + i + 8), _mm256_add_epi32(_mm256_loadu_si256((const __m256i *) (sum + i + 8)), hi));
+  }
+  accumulate(in, s, i, end);
+}
+
+}  // namespace
+
+dalsa_stack_t *dalsa_stack_create(uint32_t rows, uint32_t cols, const dalsa_stack_config_t *config) {
+  dalsa_stack *s = new dalsa_stack();
+  s->rows = rows;
+  s->cols = cols;
+  s->config = *config;
+  size_t pixels = (size_t) rows * cols;
+  if (config->rejection == DALSA_STACK_SIGMA) {
+    dalsa_master_config_t master_config = {config->clip_sigma, DALSA_MASTER_MAX_WARMUP, config->threads};
+    s->master = dalsa_master_create(rows, cols, &master_config);
+  } else {
+    s->sum.assign(pixels, 0);
+    s->min.assign(pixels, UINT16_MAX);
+    s->max.assign(pixels, 0);
+  }
+  return s;
+}
+
+void dalsa_stack_destroy(dalsa_stack_t *stack) {
+  if (stack->master != nullptr) {
+    dalsa_master_destroy(stack->master);
+  }
+  delete stack;
+}
+
+void dalsa_stack_add(dalsa_stack_t *stack, const uint16_t *frame) {
+  dalsa_stack &s = *stack;
+  s.frames++;
+  if (s.master != nullptr) {
+    dalsa_master_add(s.master, frame);
+    return;
+  }
+  size_t cols = s.cols;
+  auto add = dalsa::use_avx2() ? accumulate_avx2 : accumulate;
+  dalsa::thread_pool::shared().parallel_for(s.rows, s.config.threads, [&](size_t begin, size_t end) {
+    add(frame, s, begin * cols, end * cols);
+  });
+}
+
+uint32_t dalsa_stack_frames(const dalsa_stack_t *stack) {
+  return stack->frames;
+}
+
+void dalsa_stack_get(const dalsa_stack_t *stack, uint16_t *out) {
+  const dalsa_stack &s = *stack;
+  size_t pixels = (size_t) s.rows * s.cols;
+  if (s.frames == 0) {
+    std::fill(out, out + pixels, 0);
+    return;
+  }
+  if (s.master != nullptr) {
+    std::vector<float> mean(pixels);
+    dalsa_master_get(s.master, DALSA_MASTER_CLIPPED, mean.data());
+    for (size_t i = 0; i < pixels; i++) {
+      out[i] = (uint16_t) std::clamp(std::lrint(mean[i]), 0L, (long) UINT16_MAX);
+    }
+    return;
+  }
+
+  bool minmax = s.config.rejection == DALSA_STACK_MINMAX && s.frames >= 3;
+  uint32_t n = minmax ? s.frames - 2 : s.frames;
+  size_t cols = s.cols;
+  dalsa::thread_pool::shared().parallel_for(s.rows, s.config.threads, [&](size_t begin, size_t end) {
+    for (size_t i = begin * cols; i < end * cols; i++) {
+      uint32_t total = minmax ? s.sum[i] - s.min[i] - s.max[i] : s.sum[i];
+      out[i] = (total + n / 2) / n;
+    }
+  });
+}
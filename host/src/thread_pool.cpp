@@ -0,0 +1,84 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+namespace dalsa {
+
+thread_pool::thread_pool(size_t threads) {
+  for (size_t i = 1; i < std::max<size_t>(threads, 1); i++) {
+    workers_.emplace_back(&thread_pool::run, this, i);
+  }
+}
+
+thread_pool::~thread_pool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  start_.notify_all();
+  for (auto &w : workers_) {
+    w.join();
+  }
+}
+
+thread_pool &thread_pool::shared() {
+  static thread_pool pool;
+  return pool;
+}
+
+void thread_pool::parallel_for(size_t count, size_t max_threads, const std::function<void(size_t, size_t)> &fn) {
+  size_t blocks = std::min({max_threads != 0 ? max_threads : size(), size(), count});
+  if (blocks <= 1) {
+    fn(0, count);
+    return;
+  }
+
+  std::lock_guard<std::mutex> job(job_mutex_);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    fn_ = &fn;
+    count_ = count;
+    blocks_ = blocks;
+    pending_ = blocks - 1;
+    generation_++;
+  }
+  start_.notify_all();
+
+  // Block 0 runs on the caller
+  fn(0, count / blocks);
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_.wait(lock, [this] { return pending_ == 0; });
+  fn_ = nullptr;
+}
+
+void thread_pool::run(size_t worker) {
+  size_t seen = 0;
+  while (true) {
+    const std::function<void(size_t, size_t)> *fn;
+    size_t begin, end;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      start_.wait(lock, [&] { return stop_ || generation_ != seen; });
+      if (stop_) {
+        return;
+      }
+      seen = generation_;
+      if (worker >= blocks_) {
+        continue;
+      }
+      fn = fn_;
+      begin = count_ * worker / blocks_;
+      end = count_ * (worker + 1) / blocks_;
+    }
+
+    (*fn)(begin, end);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (--pending_ == 0) {
+      done_.notify_one();
+    }
+  }
+}
+
+}  // namespace dalsa
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace dalsa {
+
+// Workers stay parked between frames, starting threads per frame would cost more than the work itself
+class thread_pool {
+ public:
+  explicit thread_pool(size_t threads = std::thread::hardware_concurrency());
+  ~thread_pool();
+  thread_pool(const thread_pool &) = delete;
+  thread_pool &operator=(const thread_pool &) = delete;
+
+  size_t size() const { return workers_.size() + 1; }
+
+  // Calls fn(begin, end) on consecutive blocks of [0, count) using up to max_threads threads, the caller
+  // included, and returns once all of them are done. One job at a time.
+  void parallel_for(size_t count, size_t max_threads, const std::function<void(size_t, size_t)> &fn);
+
+  static thread_pool &shared();
+
+ private:
+  void run(size_t worker);
+
+  std::vector<std::thread> workers_;
+  std::mutex job_mutex_;  // Serializes callers
+  std::mutex mutex_;
+  std::condition_variable start_;
+  std::condition_variable done_;
+  const std::function<void(size_t, size_t)> *fn_ = nullptr;
+  size_t count_ = 0;
+  size_t blocks_ = 0;
+  size_t generation_ = 0;
+  size_t pending_ = 0;
+  bool stop_ = false;
+};
+
+}  // namespace dalsa
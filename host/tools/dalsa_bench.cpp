@@ -0,0 +1,200 @@
+// Frame transfer benchmark for the native client, the C++ counterpart of app/benchmark.py
+
+#include "dalsa/client.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+// Same generator as firmware/src/test_pattern.cpp
+void test_pattern_row(uint8_t pattern, uint32_t seed, uint32_t row, uint32_t cols, uint16_t *dst) {
+  uint32_t state = (seed + row * 0x9E3779B9u) | 1;
+  for (uint32_t col = 0; col < cols; col++) {
+    switch (pattern) {
+      case DALSA_TEST_PATTERN_RAMP:
+        dst[col] = (uint16_t) (row * cols + col + seed);
+        break;
+      case DALSA_TEST_PATTERN_CHECKERBOARD:
+        dst[col] = (((row >> 3) + (col >> 3) + seed) & 1) ? 0xA5A5 : 0x5A5A;
+        break;
+      default:
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        dst[col] = (uint16_t) state;
+        break;
+    }
+  }
+}
+
+// Pixels of the fetched region that differ from the pattern
+uint64_t pattern_errors(const std::vector<uint8_t> &buf, uint8_t pattern, uint32_t seed) {
+  dalsa_frame_header_t h;
+  memcpy(&h, buf.data(), sizeof(h));
+  std::vector<uint16_t> row(h.cols);
+  uint64_t errors = 0;
+  for (uint32_t r = 0; r < h.region_rows; r++) {
+    test_pattern_row(pattern, seed, h.row_start + r * h.stride, h.cols, row.data());
+    const uint8_t *src = buf.data() + sizeof(h) + (size_t) r * h.region_cols * sizeof(uint16_t);
+    for (uint32_t c = 0; c < h.region_cols; c++) {
+      uint16_t v;
+      memcpy(&v, src + c * sizeof(uint16_t), sizeof(v));
+      errors += v != row[h.col_start + c * h.stride];
+    }
+  }
+  return errors;
+}
+
+dalsa::region mode_region(const std::string &mode, const dalsa_capabilities_t &caps) {
+  dalsa::region r;
+  if (mode == "stride2") {
+    r.stride = 2;
+  } else if (mode == "region") {
+    r.row_start = caps.rows / 4;
+    r.row_count = caps.rows / 2;
+    r.col_start = caps.columns / 4;
+    r.col_count = caps.columns / 2;
+  } else if (mode == "rows") {
+    r.row_start = caps.rows - 64;
+    r.row_count = 64;
+  } else if (mode != "full") {
+    throw dalsa::error("Unknown mode " + mode);
+  }
+  return r;
+}
+
+void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [--frames N] [--mode full|stride2|region|rows] [--transfers K] [--transfer-kb KB]\n"
+          "          [--pattern off|ramp|checkerboard|prng] [--seed S]\n",
+          argv0);
+  exit(1);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  int frames = 10;
+  std::string mode = "full";
+  std::string pattern_name = "prng";
+  uint32_t seed = 0x12345678;
+  dalsa::client_options options;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) {
+      usage(argv[0]);
+    }
+    const char *value = argv[++i];
+    if (arg == "--frames") {
+      frames = atoi(value);
+    } else if (arg == "--mode") {
+      mode = value;
+    } else if (arg == "--transfers") {
+      options.transfers = atoi(value);
+    } else if (arg == "--transfer-kb") {
+      options.transfer_len = (size_t) atoi(value) * 1024;
+    } else if (arg == "--pattern") {
+      pattern_name = value;
+    } else if (arg == "--seed") {
+      seed = strtoul(value, nullptr, 0);
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  uint8_t pattern = DALSA_TEST_PATTERN_OFF;
+  if (pattern_name == "ramp") {
+    pattern = DALSA_TEST_PATTERN_RAMP;
+  } else if (pattern_name == "checkerboard") {
+    pattern = DALSA_TEST_PATTERN_CHECKERBOARD;
+  } else if (pattern_name == "prng") {
+    pattern = DALSA_TEST_PATTERN_PRNG;
+  } else if (pattern_name != "off") {
+    usage(argv[0]);
+  }
+
+  try {
+    dalsa::client client(options);
+    client.ping();
+    const dalsa_capabilities_t &caps = client.capabilities();
+    if (!(caps.capabilities & DALSA_CAP_TEST_PATTERN)) {
+      // Sensor frames then, transfer numbers still hold but there's nothing to check the pixels against
+      pattern = DALSA_TEST_PATTERN_OFF;
+    }
+    client.set_test_pattern(pattern, seed);
+    dalsa::region r = mode_region(mode, caps);
+
+    std::vector<uint8_t> buf;
+    std::vector<double> latency_ms;
+    double transfer_s = 0;
+    uint64_t bytes = 0, pixels = 0, bad_pixels = 0;
+    int failed = 0;
+    for (int i = 0; i < frames; i++) {
+      dalsa_event_t event;
+      while (client.wait_event(event, 1)) {
+      }
+      auto start = clock_type::now();
+      client.start_readout(false);
+      do {
+        if (!client.wait_event(event, 60000)) {
+          throw dalsa::error("Frame never became ready");
+        }
+      } while (event.type != DALSA_EVENT_FRAME_READY);
+      auto ready = clock_type::now();
+
+      dalsa::region fr = r;
+      fr.slot = event.arg0;
+      size_t len;
+      try {
+        len = client.fetch(fr, buf);
+      } catch (const dalsa::error &e) {
+        fprintf(stderr, "transfer failed: %s\n", e.what());
+        failed++;
+        continue;
+      }
+      auto done = clock_type::now();
+
+      bytes += len - sizeof(dalsa_frame_header_t);
+      pixels += (len - sizeof(dalsa_frame_header_t)) / sizeof(uint16_t);
+      if (pattern != DALSA_TEST_PATTERN_OFF) {
+        bad_pixels += pattern_errors(buf, pattern, seed);
+      }
+      transfer_s += std::chrono::duration<double>(done - ready).count();
+      latency_ms.push_back(std::chrono::duration<double, std::milli>(done - start).count());
+    }
+    client.set_test_pattern(DALSA_TEST_PATTERN_OFF);
+
+    if (latency_ms.empty()) {
+      printf("%s: no frames transferred, %d failed\n", mode.c_str(), failed);
+      return 1;
+    }
+    std::sort(latency_ms.begin(), latency_ms.end());
+    double mean = 0;
+    for (double l : latency_ms) {
+      mean += l / latency_ms.size();
+    }
+    const auto &stats = client.stats();
+    printf("%-8s %d frames, %d failed, %d x %zu KB transfers\n", mode.c_str(), (int) latency_ms.size(), failed,
+           options.transfers, options.transfer_len / 1024);
+    printf("  %.1f MB/s, latency %.1f ms mean, %.1f ms p95\n", bytes / transfer_s / 1e6, mean,
+           latency_ms[std::min(latency_ms.size() - 1, latency_ms.size() * 95 / 100)]);
+    printf("  %llu chunks, %llu CRC errors, %llu retries", (unsigned long long) stats.chunks,
+           (unsigned long long) stats.crc_errors, (unsigned long long) stats.retries);
+    if (pattern != DALSA_TEST_PATTERN_OFF) {
+      printf(", pixel error rate %.2e", (double) bad_pixels / pixels);
+    }
+    printf("\n");
+  } catch (const dalsa::error &e) {
+    fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,456 @@
+// Capture daemon: the one process holding the USB interface. Every frame the device reports ready is fetched
+// straight into a shared memory ring (dalsa/ring.h) that other processes read in place, and a Unix socket
+// lets any number of local clients send commands, fetch regions and follow the events.
+//
+// Socket protocol, one request per line, binary payloads follow the line that gives their length:
+//   info                                   -> ok <ring name> <slots> <slot len>
+//   command <cmd> <len> + data             -> ok <status> <len> + response data
+//   fetch <slot> <stride> <row start> <row count> <col start> <col count>
+//                                          -> ring <frame index> for a whole frame that is in the ring,
+//                                             ok <len> + frame header and pixels otherwise
+//   bulk <len> <timeout ms>                -> ok <len> + data
+//   subscribe                              -> ok, then the connection only carries
+//                                             event <type> <dropped> <sequence> <timestamp us> <arg0> <arg1>
+//                                             frame <frame index>
+// Failures answer error <message>. app/dalsa_capture.py is the Python side.
+
+#include "dalsa/client.h"
+#include "dalsa/ring.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+std::atomic<bool> stop(false);
+
+class ring {
+ public:
+  ring(const std::string &name, uint32_t slots, size_t frame_len) : name_(name) {
+    slot_len_ = align(sizeof(dalsa_ring_slot_t) + frame_len);
+    uint32_t data_offset = align(sizeof(dalsa_ring_header_t));
+    len_ = data_offset + (size_t) slots * slot_len_;
+
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0 && errno == EEXIST) {
+      // Left behind by a daemon that didn't shut down cleanly
+      shm_unlink(name.c_str());
+      fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    }
+    if (fd < 0 || ftruncate(fd, len_) != 0) {
+      throw dalsa::error("Could not create shared memory " + name + ": " + strerror(errno));
+    }
+    base_ = (uint8_t *) mmap(nullptr, len_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base_ == MAP_FAILED) {
+      shm_unlink(name.c_str());
+      throw dalsa::error("Could not map shared memory " + name + ": " + strerror(errno));
+    }
+
+    // Fresh pages are zero, so every slot starts out empty
+    header_ = (dalsa_ring_header_t *) base_;
+    header_->version = DALSA_RING_VERSION;
+    header_->slots = slots;
+    header_->slot_len = slot_len_;
+    header_->data_offset = data_offset;
+    header_->pid = getpid();
+    __atomic_store_n(&header_->magic, DALSA_RING_MAGIC, __ATOMIC_RELEASE);
+  }
+
+  ~ring() {
+    munmap(base_, len_);
+    shm_unlink(name_.c_str());
+  }
+
+  const std::string &name() const { return name_; }
+  uint32_t slots() const { return header_->slots; }
+  uint32_t slot_len() const { return slot_len_; }
+  uint64_t frames() const { return __atomic_load_n(&header_->frames, __ATOMIC_ACQUIRE); }
+
+  // Has fill() write the next frame straight into its slot, returns the index it was published as
+  uint64_t write(const std::function<size_t(uint8_t *, size_t)> &fill) {
+    uint64_t index = header_->frames;
+    dalsa_ring_slot_t *slot = slot_at(index);
+    __atomic_store_n(&slot->sequence, 2 * index + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    try {
+      slot->len = fill((uint8_t *) (slot + 1), slot_len_ - sizeof(dalsa_ring_slot_t));
+    } catch (...) {
+      __atomic_store_n(&slot->sequence, 0, __ATOMIC_RELEASE);
+      throw;
+    }
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    slot->captured_us = (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    __atomic_store_n(&slot->sequence, 2 * index + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&header_->frames, index + 1, __ATOMIC_RELEASE);
+    return index;
+  }
+
+  // Still holds frame index, i.e. not overwritten by a newer one
+  bool holds(uint64_t index) const {
+    return __atomic_load_n(&slot_at(index)->sequence, __ATOMIC_ACQUIRE) == 2 * index + 2;
+  }
+
+ private:
+  static uint32_t align(size_t len) { return (len + DALSA_RING_ALIGN - 1) / DALSA_RING_ALIGN * DALSA_RING_ALIGN; }
+  dalsa_ring_slot_t *slot_at(uint64_t index) const {
+    return (dalsa_ring_slot_t *) (base_ + header_->data_offset + (index % header_->slots) * slot_len_);
+  }
+
+  std::string name_;
+  uint8_t *base_ = nullptr;
+  size_t len_ = 0;
+  uint32_t slot_len_ = 0;
+  dalsa_ring_header_t *header_ = nullptr;
+};
+
+struct daemon_state {
+  daemon_state(dalsa::client &client, ring &frames) : client(client), frames(frames) {}
+
+  dalsa::client &client;
+  ring &frames;
+  std::mutex mutex;
+  std::condition_variable captured;
+  int capturing = -1;                      // Device slot being fetched into the ring
+  std::map<uint8_t, uint64_t> slot_frames;  // Device slot -> ring frame, until a readout may reuse the slot
+  std::vector<int> subscribers;
+  std::vector<int> connections;             // Shut down on exit, each thread removes its own
+  std::condition_variable closed;
+};
+
+bool send_all(int fd, const void *data, size_t len) {
+  const uint8_t *p = (const uint8_t *) data;
+  while (len > 0) {
+    ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool send_line(int fd, const std::string &line) {
+  return send_all(fd, (line + "\n").data(), line.size() + 1);
+}
+
+void broadcast(daemon_state &s, const std::string &line) {
+  // Never waits on a subscriber: one that can't keep up is cut off, its connection thread drops it
+  std::string data = line + "\n";
+  std::lock_guard<std::mutex> lock(s.mutex);
+  for (int fd : s.subscribers) {
+    if (send(fd, data.data(), data.size(), MSG_NOSIGNAL | MSG_DONTWAIT) != (ssize_t) data.size()) {
+      shutdown(fd, SHUT_RDWR);
+    }
+  }
+}
+
+void capture(daemon_state &s, uint8_t slot) {
+  bool ok = false;
+  uint64_t index = 0;
+  try {
+    dalsa::region r;
+    r.slot = slot;
+    index = s.frames.write([&](uint8_t *dst, size_t capacity) { return s.client.fetch(r, dst, capacity); });
+    ok = true;
+  } catch (const dalsa::error &e) {
+    fprintf(stderr, "Capturing slot %u failed: %s\n", slot, e.what());
+  }
+  {
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.capturing = -1;
+    if (ok) {
+      s.slot_frames[slot] = index;
+    }
+  }
+  s.captured.notify_all();
+  if (ok) {
+    broadcast(s, "frame " + std::to_string(index));
+  }
+}
+
+void event_loop(daemon_state &s) {
+  while (!stop) {
+    dalsa_event_t event;
+    try {
+      if (!s.client.wait_event(event, 100)) {
+        continue;
+      }
+    } catch (const dalsa::error &e) {
+      fprintf(stderr, "%s\n", e.what());
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      continue;
+    }
+
+    if (event.type == DALSA_EVENT_READOUT_STARTED || event.type == DALSA_EVENT_FRAME_READY) {
+      std::lock_guard<std::mutex> lock(s.mutex);
+      if (event.type == DALSA_EVENT_READOUT_STARTED) {
+        // That slot gets overwritten now
+        s.slot_frames.erase(event.arg0);
+      } else {
+        s.capturing = event.arg0;
+      }
+    }
+    char line[96];
+    snprintf(line, sizeof(line), "event %u %u %u %u %u %u", event.type, event.dropped, event.sequence,
+             event.timestamp_us, event.arg0, event.arg1);
+    broadcast(s, line);
+    if (event.type == DALSA_EVENT_FRAME_READY) {
+      capture(s, event.arg0);
+    }
+  }
+}
+
+// Reads lines and the payloads behind them off one connection
+class reader {
+ public:
+  explicit reader(int fd) : fd_(fd) {}
+
+  bool line(std::string &out) {
+    while (true) {
+      auto end = std::find(buf_.begin(), buf_.end(), '\n');
+      if (end != buf_.end()) {
+        out.assign(buf_.begin(), end);
+        buf_.erase(buf_.begin(), end + 1);
+        return true;
+      }
+      if (!fill()) {
+        return false;
+      }
+    }
+  }
+
+  bool payload(std::vector<uint8_t> &out, size_t len) {
+    while (buf_.size() < len) {
+      if (!fill()) {
+        return false;
+      }
+    }
+    out.assign(buf_.begin(), buf_.begin() + len);
+    buf_.erase(buf_.begin(), buf_.begin() + len);
+    return true;
+  }
+
+ private:
+  bool fill() {
+    uint8_t tmp[4096];
+    ssize_t n = recv(fd_, tmp, sizeof(tmp), 0);
+    if (n <= 0) {
+      return false;
+    }
+    buf_.insert(buf_.end(), tmp, tmp + n);
+    return true;
+  }
+
+  int fd_;
+  std::vector<uint8_t> buf_;
+};
+
+bool reply(int fd, const std::string &line, const uint8_t *data = nullptr, size_t len = 0) {
+  return send_line(fd, line) && (len == 0 || send_all(fd, data, len));
+}
+
+bool serve_fetch(daemon_state &s, int fd, const dalsa::region &r) {
+  bool whole_frame = r.stride == 1 && r.row_start == 0 && r.row_count == 0 && r.col_start == 0 && r.col_count == 0;
+  if (whole_frame) {
+    // Whole frames normally are in the ring already, or about to be
+    std::unique_lock<std::mutex> lock(s.mutex);
+    s.captured.wait(lock, [&] { return s.capturing < 0 || (r.slot != DALSA_SLOT_LATEST && s.capturing != r.slot); });
+    auto it = r.slot == DALSA_SLOT_LATEST ? std::max_element(s.slot_frames.begin(), s.slot_frames.end(),
+                                                             [](const auto &a, const auto &b) { return a.second < b.second; })
+                                          : s.slot_frames.find(r.slot);
+    if (it != s.slot_frames.end() && s.frames.holds(it->second)) {
+      return reply(fd, "ring " + std::to_string(it->second));
+    }
+  }
+  std::vector<uint8_t> buf;
+  size_t len = s.client.fetch(r, buf);
+  return reply(fd, "ok " + std::to_string(len), buf.data(), len);
+}
+
+void serve_subscriber(daemon_state &s, int fd, reader &in) {
+  {
+    std::lock_guard<std::mutex> lock(s.mutex);
+    send_line(fd, "ok");
+    s.subscribers.push_back(fd);
+  }
+  std::string ignored;
+  while (in.line(ignored)) {
+  }
+  std::lock_guard<std::mutex> lock(s.mutex);
+  s.subscribers.erase(std::find(s.subscribers.begin(), s.subscribers.end(), fd));
+}
+
+void serve(daemon_state &s, int fd) {
+  reader in(fd);
+  std::string line;
+  std::vector<uint8_t> data;
+  bool ok = true;
+  while (ok && in.line(line)) {
+    std::istringstream args(line);
+    std::string request;
+    args >> request;
+    try {
+      if (request == "info") {
+        ok = reply(fd, "ok " + s.frames.name() + " " + std::to_string(s.frames.slots()) + " " + std::to_string(s.frames.slot_len()));
+      } else if (request == "command") {
+        unsigned cmd = 0;
+        size_t len = 0;
+        args >> cmd >> len;
+        if (!in.payload(data, len)) {
+          break;
+        }
+        int status = DALSA_STATUS_OK;
+        std::vector<uint8_t> resp;
+        try {
+          resp = s.client.command(cmd, data.data(), data.size());
+        } catch (const dalsa::error &e) {
+          if (e.status == 0) {
+            throw;
+          }
+          status = e.status;  // The device's answer, passed on like any other
+        }
+        ok = reply(fd, "ok " + std::to_string(status) + " " + std::to_string(resp.size()), resp.data(), resp.size());
+      } else if (request == "fetch") {
+        unsigned slot = DALSA_SLOT_LATEST, stride = 1, row_start = 0, row_count = 0, col_start = 0, col_count = 0;
+        args >> slot >> stride >> row_start >> row_count >> col_start >> col_count;
+        dalsa::region r;
+        r.slot = slot;
+        r.stride = stride;
+        r.row_start = row_start;
+        r.row_count = row_count;
+        r.col_start = col_start;
+        r.col_count = col_count;
+        ok = serve_fetch(s, fd, r);
+      } else if (request == "bulk") {
+        size_t len = 0;
+        unsigned timeout_ms = 0;
+        args >> len >> timeout_ms;
+        std::vector<uint8_t> buf(len);
+        size_t received = s.client.bulk_read(buf.data(), len, timeout_ms);
+        ok = reply(fd, "ok " + std::to_string(received), buf.data(), received);
+      } else if (request == "subscribe") {
+        serve_subscriber(s, fd, in);
+        break;
+      } else {
+        ok = reply(fd, "error Unknown request " + request);
+      }
+    } catch (const dalsa::error &e) {
+      ok = reply(fd, std::string("error ") + e.what());
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(s.mutex);
+  s.connections.erase(std::find(s.connections.begin(), s.connections.end(), fd));
+  close(fd);
+  s.closed.notify_all();
+}
+
+void usage(const char *argv0) {
+  fprintf(stderr, "usage: %s [--ring NAME] [--slots N] [--socket PATH] [--transfers K] [--transfer-kb KB]\n", argv0);
+  exit(1);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  std::string ring_name = "/dalsa";
+  uint32_t slots = 8;
+  std::string socket_path = "/tmp/dalsa.sock";
+  dalsa::client_options options;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) {
+      usage(argv[0]);
+    }
+    const char *value = argv[++i];
+    if (arg == "--ring") {
+      ring_name = value;
+    } else if (arg == "--slots") {
+      slots = std::max(atoi(value), 2);
+    } else if (arg == "--socket") {
+      socket_path = value;
+    } else if (arg == "--transfers") {
+      options.transfers = atoi(value);
+    } else if (arg == "--transfer-kb") {
+      options.transfer_len = (size_t) atoi(value) * 1024;
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  signal(SIGINT, [](int) { stop = true; });
+  signal(SIGTERM, [](int) { stop = true; });
+  signal(SIGPIPE, SIG_IGN);
+
+  try {
+    dalsa::client client(options);
+    dalsa::region whole;
+    ring frames(ring_name, slots, client.fetch_len(whole));
+    daemon_state s(client, frames);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path)) {
+      throw dalsa::error("Socket path too long");
+    }
+    strcpy(addr.sun_path, socket_path.c_str());
+    unlink(socket_path.c_str());
+    if (bind(listener, (sockaddr *) &addr, sizeof(addr)) != 0 || listen(listener, 16) != 0) {
+      throw dalsa::error("Could not listen on " + socket_path + ": " + strerror(errno));
+    }
+    printf("Serving on %s, %u frame ring in %s (%u bytes per slot)\n", socket_path.c_str(), slots, ring_name.c_str(), frames.slot_len());
+
+    std::thread events(event_loop, std::ref(s));
+    while (!stop) {
+      pollfd p = {listener, POLLIN, 0};
+      if (poll(&p, 1, 200) <= 0) {
+        continue;
+      }
+      int fd = accept(listener, nullptr, nullptr);
+      if (fd >= 0) {
+        // Connections are few and mostly idle, one thread each keeps a slow fetch from holding up the others
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.connections.push_back(fd);
+        std::thread(serve, std::ref(s), fd).detach();
+      }
+    }
+
+    events.join();
+    close(listener);
+    unlink(socket_path.c_str());
+    std::unique_lock<std::mutex> lock(s.mutex);
+    for (int fd : s.connections) {
+      shutdown(fd, SHUT_RDWR);
+    }
+    s.closed.wait(lock, [&] { return s.connections.empty(); });
+  } catch (const dalsa::error &e) {
+    fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
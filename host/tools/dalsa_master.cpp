@@ -0,0 +1,161 @@
+// Builds master darks or flats from frames saved as .npy (app/sequencer.py writes them like that), one frame
+// in memory at a time, and writes the masters, the temporal sigma and the defects next to each other
+
+#include "dalsa/master.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+// Only what np.save() writes for a C ordered 2D uint16 array
+std::vector<uint16_t> read_npy(const std::string &path, uint32_t &rows, uint32_t &cols) {
+  FILE *f = fopen(path.c_str(), "rb");
+  if (f == nullptr) {
+    throw std::runtime_error("Can't open " + path);
+  }
+  uint8_t preamble[10];
+  std::string header;
+  if (fread(preamble, 1, sizeof(preamble), f) == sizeof(preamble) && memcmp(preamble, "\x93NUMPY", 6) == 0) {
+    size_t len = preamble[8] | (preamble[9] << 8);
+    if (preamble[6] >= 2) {
+      uint8_t more[2];
+      len |= fread(more, 1, 2, f) == 2 ? (more[0] << 16) | (more[1] << 24) : 0;
+    }
+    header.resize(len);
+    header.resize(fread(&header[0], 1, len, f));
+  }
+  size_t shape = header.find("'shape': (");
+  unsigned r = 0, c = 0;
+  if (header.find("'descr': '<u2'") == std::string::npos || header.find("'fortran_order': False") == std::string::npos ||
+      shape == std::string::npos || sscanf(header.c_str() + shape, "'shape': (%u, %u)", &r, &c) != 2) {
+    fclose(f);
+    throw std::runtime_error(path + " is not a 2D uint16 .npy");
+  }
+  rows = r;
+  cols = c;
+  std::vector<uint16_t> pixels((size_t) rows * cols);
+  size_t got = fread(pixels.data(), sizeof(uint16_t), pixels.size(), f);
+  fclose(f);
+  if (got != pixels.size()) {
+    throw std::runtime_error(path + " is truncated");
+  }
+  return pixels;
+}
+
+void write_npy(const std::string &path, const char *descr, const std::string &shape, const void *data, size_t len) {
+  std::string header = std::string("{'descr': '") + descr + "', 'fortran_order': False, 'shape': " + shape + ", }";
+  header.append(63 - (10 + header.size()) % 64, ' ').push_back('\n');
+  uint8_t preamble[10] = {0x93, 'N', 'U', 'M', 'P', 'Y', 1, 0, (uint8_t) header.size(), (uint8_t) (header.size() >> 8)};
+  FILE *f = fopen(path.c_str(), "wb");
+  if (f == nullptr || fwrite(preamble, 1, sizeof(preamble), f) != sizeof(preamble) ||
+      fwrite(header.data(), 1, header.size(), f) != header.size() || fwrite(data, 1, len, f) != len) {
+    if (f != nullptr) {
+      fclose(f);
+    }
+    throw std::runtime_error("Can't write " + path);
+  }
+  fclose(f);
+}
+
+void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [--out PREFIX] [--kind dark|flat] [--clip SIGMA] [--warmup N] [--threads N] FRAME.npy...\n"
+          "writes PREFIX_{mean,clipped,median,sigma}.npy, PREFIX_defect_map.npy and PREFIX_defects.npy\n",
+          argv0);
+  exit(1);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  std::string prefix = "master";
+  std::string kind = "dark";
+  dalsa_master_config_t config = {3.0f, 5, 0};
+  std::vector<std::string> paths;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg.compare(0, 2, "--") != 0) {
+      paths.push_back(arg);
+      continue;
+    }
+    if (i + 1 >= argc) {
+      usage(argv[0]);
+    }
+    const char *value = argv[++i];
+    if (arg == "--out") {
+      prefix = value;
+    } else if (arg == "--kind") {
+      kind = value;
+    } else if (arg == "--clip") {
+      config.clip_sigma = atof(value);
+    } else if (arg == "--warmup") {
+      config.clip_warmup = atoi(value);
+    } else if (arg == "--threads") {
+      config.threads = atoi(value);
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (paths.empty() || (kind != "dark" && kind != "flat")) {
+    usage(argv[0]);
+  }
+
+  // Darks show hot and noisy pixels, flats dead ones and those that respond far too strongly
+  dalsa_defect_config_t defects = {6.0f, 0.0f, 4.0f, 0.5f};
+  if (kind == "flat") {
+    defects = {6.0f, 0.5f, 0.0f, 0.5f};
+  }
+
+  try {
+    uint32_t rows = 0, cols = 0;
+    dalsa_master_t *master = nullptr;
+    double add_s = 0;
+    for (const std::string &path : paths) {
+      uint32_t r, c;
+      std::vector<uint16_t> frame = read_npy(path, r, c);
+      if (master == nullptr) {
+        rows = r;
+        cols = c;
+        master = dalsa_master_create(rows, cols, &config);
+      } else if (r != rows || c != cols) {
+        throw std::runtime_error(path + " does not match the size of the first frame");
+      }
+      auto start = clock_type::now();
+      dalsa_master_add(master, frame.data());
+      add_s += std::chrono::duration<double>(clock_type::now() - start).count();
+    }
+
+    std::string shape = "(" + std::to_string(rows) + ", " + std::to_string(cols) + ")";
+    std::vector<float> plane((size_t) rows * cols);
+    const std::pair<uint8_t, const char *> outputs[] = {
+      {DALSA_MASTER_MEAN, "mean"}, {DALSA_MASTER_CLIPPED, "clipped"}, {DALSA_MASTER_MEDIAN, "median"}, {DALSA_MASTER_SIGMA, "sigma"},
+    };
+    for (const auto &output : outputs) {
+      dalsa_master_get(master, output.first, plane.data());
+      write_npy(prefix + "_" + output.second + ".npy", "<f4", shape, plane.data(), plane.size() * sizeof(float));
+    }
+
+    std::vector<uint8_t> map(plane.size());
+    uint32_t count = dalsa_master_defects(master, &defects, map.data(), nullptr, 0);
+    std::vector<dalsa_bad_pixel_t> list(count);
+    dalsa_master_defects(master, &defects, nullptr, list.data(), count);
+    write_npy(prefix + "_defect_map.npy", "|u1", shape, map.data(), map.size());
+    write_npy(prefix + "_defects.npy", "<u2", "(" + std::to_string(count) + ", 2)", list.data(), list.size() * sizeof(dalsa_bad_pixel_t));
+
+    printf("%u frames of %ux%u, %.2f ms per frame, %u defects\n", dalsa_master_frames(master), rows, cols,
+           add_s * 1e3 / paths.size(), count);
+    dalsa_master_destroy(master);
+  } catch (const std::exception &e) {
+    fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+  return 0;
+}